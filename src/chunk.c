@@ -0,0 +1,340 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// chunk.c scans an input which arrives a chunk at a time (e.g. an upload),
+// so that it is tokenized as it comes in rather than once all of it is
+// there, and without keeping more of it than the tokens still in progress.
+//
+// Between two chunks, a scan is summed up by a LexerState: where it resumes
+// (an offset in the whole input and the line number there) and what it is
+// in the middle of. Like a line index checkpoint (see lines.c), the state is
+// taken right after a token, since the lexers don't look back. A state can
+// be encoded into a few bytes, to be saved with the unused bytes and resumed
+// by another process.
+//
+// scan_chunk() only scans the complete lines of what it is given. No lexer
+// looks past a newline unless its token goes on after it (a /* comment, or a
+// literal or directive continued with backslash-newline), so the tokens of
+// complete lines are the same as in a scan of the whole input, except for
+// the token which reaches the end of the last complete line: it may go on in
+// the next chunk, so it is held back and scanned again from there with the
+// next chunk. A /* comment is the exception, since it may be arbitrarily
+// long and has no text: its beginning is kept in the state (LM_MC) and the
+// rest of it is read as it comes, like scan_mc() does.
+//
+// Brackets are not matched: no closing bracket is flagged TF_UNMATCHED,
+// since its opener may be in an earlier chunk. Carrying the open brackets
+// in the state would make it grow with their depth, and the state is to
+// stay a few bytes.
+//
+// A Scanner is the push-mode interface to scan_chunk(): it is fed the input
+// as it comes and keeps the bytes which haven't been used yet. Since
+// nothing but the rest of a comment can be scanned before the next line end
+// (\n or \r), it only calls scan_chunk() once one has been fed (or in a
+// comment), so that a long line fed a few bytes at a time isn't searched
+// again and again. Likewise, a held literal or directive continued with
+// backslash-newline is only scanned again once a line end which isn't
+// escaped has been fed, rather than from its beginning for every line it is
+// continued over. (A directive can also go on over the lines of a /*
+// comment in it; these are still scanned again for every line.)
+//
+// Encoded state (LS_ENCODED_SIZE bytes, integers little-endian):
+//   u8 version, u8 mode (LM_*), u32 line number, u64 offset,
+//   u32 begin line of the token in progress, u64 its offset
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+#define LEXER_STATE_VERSION 1
+
+struct Scanner {
+  TokenWriter base;
+  TokenCallback callback;
+  void* data;
+  LexerState state;
+  char* buf;           // bytes fed and not used yet
+  size_t len;
+  size_t capacity;
+  size_t checked;      // bytes of buf searched for the end of a held token
+  bool finished;
+};
+
+// Passes tokens on to next with offsets in the whole input, but stops the
+// scan at the token which reaches the end of the chunk (unless it is the
+// last one)
+typedef struct {
+  TokenWriter base;
+  TokenWriter* next;
+  const FileReader* fr;
+  uint64_t base_offset;  // of fr->buf in the input
+  bool last;
+  size_t last_end;       // state of the reader after the last token passed on
+  int last_line;
+  bool held;             // a token was held back
+  int held_kind;
+  size_t held_offset;
+  int held_line;
+} ChunkWriter;
+
+
+static bool
+is_newline(char c) {
+  return c == '\r' || c == '\n';
+}
+
+static void
+write_chunk(TokenWriter* self, const Token* tok) {
+  ChunkWriter* cw = (ChunkWriter*) self;
+  if (!cw->last && cw->fr->pos >= cw->fr->len) {
+    cw->held = true;
+    cw->held_kind = tok->kind;
+    cw->held_offset = tok->offset;
+    cw->held_line = tok->begin_line_number;
+    self->stop = true;
+    return;
+  }
+
+  // scan() matches the brackets within the chunk only, so a closer may be
+  // flagged for want of an opener in an earlier chunk
+  Token t = *tok;
+  t.flags &= ~TF_UNMATCHED;
+  t.offset += cw->base_offset;
+  if (t.kind == TC_PREP) {
+    t.args_offset += cw->base_offset;
+  }
+  cw->next->write(cw->next, &t);
+  cw->last_end = cw->fr->pos;
+  cw->last_line = frlineno(cw->fr);
+}
+
+// Read the rest of a /* comment from buf. Returns the number of bytes
+// read, and sets *line to the line number after them and *closed if the
+// comment was closed.
+static size_t
+finish_mc(const char* buf, size_t len, bool last, int* line, bool* closed) {
+  size_t i = 0;
+  *closed = false;
+  while (i < len && !*closed) {
+    if (buf[i] == '*' && i + 1 < len) {
+      // The char after a * is never the * of the closing */
+      *closed = (buf[i + 1] == '/');
+      *line += is_newline(buf[i + 1]);
+      i += 2;
+    } else if (buf[i] == '*' && !last) {
+      break;
+    } else {
+      *line += is_newline(buf[i]);
+      i++;
+    }
+  }
+  return i;
+}
+
+void lsinit(LexerState* self) {
+  memset(self, 0, sizeof(LexerState));
+  self->line_number = 1;
+  self->mode = LM_CODE;
+}
+
+static void
+put_le(unsigned char* buf, uint64_t v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t
+get_le(const unsigned char* buf, size_t size) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < size; i++) {
+    v |= (uint64_t) buf[i] << (8 * i);
+  }
+  return v;
+}
+
+void lsencode(const LexerState* self, unsigned char* buf) {
+  put_le(buf, LEXER_STATE_VERSION, 1);
+  put_le(buf + 1, self->mode, 1);
+  put_le(buf + 2, self->line_number, 4);
+  put_le(buf + 6, self->offset, 8);
+  put_le(buf + 14, self->token_line, 4);
+  put_le(buf + 18, self->token_offset, 8);
+}
+
+bool lsdecode(LexerState* self, const unsigned char* buf) {
+  if (buf[0] != LEXER_STATE_VERSION || buf[1] > LM_PREP) {
+    return false;
+  }
+  self->mode = buf[1];
+  self->line_number = get_le(buf + 2, 4);
+  self->offset = get_le(buf + 6, 8);
+  self->token_line = get_le(buf + 14, 4);
+  self->token_offset = get_le(buf + 18, 8);
+  return true;
+}
+
+size_t scan_chunk(const char* buf, size_t len, bool last, LexerState* state, TokenWriter* tw) {
+  size_t pos = 0;
+  int line = state->line_number;
+
+  if (state->mode == LM_MC) {
+    bool closed = false;
+    pos = finish_mc(buf, len, last, &line, &closed);
+    if (!closed && !last) {
+      state->offset += pos;
+      state->line_number = line;
+      return pos;
+    }
+    Token tok = {
+      .kind = TC_MC,
+      .begin_line_number = state->token_line,
+      .end_line_number = line,
+      .offset = state->token_offset,
+      .length = state->offset + pos - state->token_offset
+    };
+    if (!closed) {
+      tok.end_line_number--;
+      tok.error = "missing */";
+    }
+    tw->write(tw, &tok);
+    state->mode = LM_CODE;
+  }
+
+  // Complete lines only, unless they are the last ones
+  size_t end = len;
+  while (!last && end > pos && !is_newline(buf[end - 1])) {
+    end--;
+  }
+  FileReader fr = {
+    .buf = (char*) buf,
+    .len = end,
+    .pos = pos,
+    .line_number = line,
+    .lazy_lines = false
+  };
+  ChunkWriter cw = {
+    .base = { .write = write_chunk, .fout = tw->fout },
+    .next = tw,
+    .fr = &fr,
+    .base_offset = state->offset,
+    .last = last,
+    .last_end = pos,
+    .last_line = line,
+    .held = false
+  };
+  if (!scan(&fr, &cw.base, NULL)) {
+    return SIZE_MAX;
+  }
+
+  size_t used = end;
+  if (cw.held && cw.held_kind == TC_MC) {
+    // The comment is read on from the end of the chunk
+    state->mode = LM_MC;
+    state->token_offset = state->offset + cw.held_offset;
+    state->token_line = cw.held_line;
+    state->line_number = fr.line_number;
+  } else if (cw.held) {
+    // The token is scanned again from the end of the one before
+    used = cw.last_end;
+    state->mode = token_mode(cw.held_kind);
+    state->token_offset = state->offset + cw.held_offset;
+    state->token_line = cw.held_line;
+    state->line_number = cw.last_line;
+  } else {
+    state->mode = LM_CODE;
+    state->token_offset = state->offset + end;
+    state->token_line = fr.line_number;
+    state->line_number = fr.line_number;
+  }
+  state->offset += used;
+  return used;
+}
+
+
+static void
+write_callback(TokenWriter* self, const Token* tok) {
+  Scanner* sc = (Scanner*) self;
+  sc->callback(tok, sc->data);
+}
+
+static bool
+scan_pending(Scanner* self, bool last) {
+  size_t used = scan_chunk(self->buf, self->len, last, &self->state, &self->base);
+  if (used == SIZE_MAX) {
+    return false;
+  }
+  memmove(self->buf, self->buf + used, self->len - used);
+  self->len -= used;
+  self->checked = 0;
+  return true;
+}
+
+// Whether the bytes of buf from self->checked on may complete a token
+static bool
+may_complete(Scanner* self) {
+  if (self->state.mode == LM_MC) {
+    return true;
+  }
+  const char* buf = self->buf;
+  for (size_t i = self->checked; i < self->len; i++) {
+    if (!is_newline(buf[i])) {
+      continue;
+    }
+    // A line end right after a backslash (or a \r\n right after one) only
+    // continues a held literal or directive
+    bool escaped = (i > 0 && buf[i - 1] == '\\') ||
+                   (i > 1 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\\');
+    if (self->state.mode == LM_CODE || !escaped) {
+      return true;
+    }
+  }
+  self->checked = self->len;
+  return false;
+}
+
+Scanner* scanner_new(TokenCallback callback, void* data) {
+  Scanner* self = calloc(1, sizeof(Scanner));
+  self->base.write = write_callback;
+  self->callback = callback;
+  self->data = data;
+  lsinit(&self->state);
+  return self;
+}
+
+void scanner_free(Scanner* self) {
+  free(self->buf);
+  free(self);
+}
+
+bool scanner_feed(Scanner* self, const char* buf, size_t len) {
+  if (self->finished || len == 0) {
+    return true;
+  }
+  if (self->len + len > self->capacity) {
+    size_t capacity = (self->len + len > 2 * self->capacity) ? self->len + len : 2 * self->capacity;
+    char* grown = realloc(self->buf, capacity);
+    if (!grown) {
+      return false;
+    }
+    self->buf = grown;
+    self->capacity = capacity;
+  }
+  memcpy(self->buf + self->len, buf, len);
+  self->len += len;
+
+  return !may_complete(self) || scan_pending(self, false);
+}
+
+bool scanner_finish(Scanner* self) {
+  if (self->finished) {
+    return true;
+  }
+  self->finished = true;
+  return scan_pending(self, true);
+}
@@ -0,0 +1,847 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// cond.c implements conditional compilation (scanner -D/-U): a table of
+// macros, an evaluator for #if expressions, and the bookkeeping of nested
+// #if/#ifdef/#ifndef/#elif/#else/#endif groups.
+//
+// Macros are defined by -D/-U and by the #define/#undef directives in
+// active groups. #if expressions are evaluated the way the preprocessor
+// does: object-like macros are replaced by their definitions (a macro is
+// never expanded within itself), "defined X" and "defined(X)" test the
+// table, other identifiers are 0, and everything is computed in int64_t.
+// As in C, an operand of &&, || or ?: which the result doesn't depend on
+// isn't evaluated, so a division by zero in it is no error.
+// Function-like macros are not expanded; an invocation evaluates to 0, and
+// so does any other identifier followed by parentheses (__has_include(...)).
+//
+// An inactive group is skipped without being tokenized: skip_group() hops
+// from line to line with memchr() and only looks at lines starting with #,
+// counting nested #if groups until the #elif, #else or #endif which ends it.
+// Comments and literals are not looked into, so a directive-like line inside
+// a comment in an inactive group still counts.
+//
+// Include guards are recognized from the PREP tokens of a file: the first
+// directive is #ifndef X (or #if !defined X), immediately followed by
+// #define X, and its #endif ends the file. Comments may appear anywhere.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+#define EXPANSION_MAX_DEPTH 32
+
+typedef struct {
+  char* name;
+  char* value;
+  bool function_like;
+} Macro;
+
+struct MacroTable {
+  Macro* macros; // open addressing, name == NULL if empty
+  size_t count;  // including undefined ones (value == NULL)
+  size_t capacity;
+};
+
+
+static bool
+is_iden_char(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static size_t
+hash_name(const char* name, size_t n) {
+  size_t h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char) name[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// Slot of name, which is either the macro or an empty slot
+static Macro*
+mtslot(const MacroTable* self, const char* name, size_t n) {
+  size_t i = hash_name(name, n) & (self->capacity - 1);
+  while (self->macros[i].name &&
+         !(strlen(self->macros[i].name) == n && !memcmp(self->macros[i].name, name, n))) {
+    i = (i + 1) & (self->capacity - 1);
+  }
+  return &self->macros[i];
+}
+
+MacroTable* mtnew(void) {
+  MacroTable* self = malloc(sizeof(MacroTable));
+  if (!self) {
+    return NULL;
+  }
+  self->count = 0;
+  self->capacity = 64;
+  self->macros = calloc(self->capacity, sizeof(Macro));
+  if (!self->macros) {
+    free(self);
+    return NULL;
+  }
+  return self;
+}
+
+MacroTable* mtclone(const MacroTable* self) {
+  MacroTable* clone = malloc(sizeof(MacroTable));
+  clone->count = self->count;
+  clone->capacity = self->capacity;
+  clone->macros = calloc(self->capacity, sizeof(Macro));
+  for (size_t i = 0; i < self->capacity; i++) {
+    const Macro* m = &self->macros[i];
+    if (m->name) {
+      clone->macros[i].name = strdup(m->name);
+      clone->macros[i].value = (m->value) ? strdup(m->value) : NULL;
+      clone->macros[i].function_like = m->function_like;
+    }
+  }
+  return clone;
+}
+
+void mtfree(MacroTable* self) {
+  for (size_t i = 0; i < self->capacity; i++) {
+    free(self->macros[i].name);
+    free(self->macros[i].value);
+  }
+  free(self->macros);
+  free(self);
+}
+
+bool mtdefine(MacroTable* self, const char* name, size_t name_length,
+              const char* value, size_t value_length, bool function_like) {
+  if (2 * (self->count + 1) > self->capacity) {
+    Macro* macros = self->macros;
+    size_t capacity = self->capacity;
+    Macro* grown = calloc(2 * capacity, sizeof(Macro));
+    if (!grown) {
+      return false;
+    }
+    self->macros = grown;
+    self->capacity = 2 * capacity;
+    for (size_t i = 0; i < capacity; i++) {
+      if (macros[i].name) {
+        *mtslot(self, macros[i].name, strlen(macros[i].name)) = macros[i];
+      }
+    }
+    free(macros);
+  }
+
+  Macro* m = mtslot(self, name, name_length);
+  if (!m->name) {
+    m->name = strndup(name, name_length);
+    if (!m->name) {
+      return false;
+    }
+    self->count++;
+  }
+  char* copy = strndup(value, value_length);
+  if (!copy) {
+    return false;
+  }
+  free(m->value);
+  m->value = copy;
+  m->function_like = function_like;
+  return true;
+}
+
+void mtundef(MacroTable* self, const char* name, size_t name_length) {
+  // Keep the slot, so that probing for other names isn't cut short
+  Macro* m = mtslot(self, name, name_length);
+  free(m->value);
+  m->value = NULL;
+}
+
+bool mtdefined(const MacroTable* self, const char* name, size_t name_length) {
+  return mtslot(self, name, name_length)->value != NULL;
+}
+
+// NAME, NAME=VALUE (-D) or NAME(ARGS)=VALUE
+bool mtparse(MacroTable* self, const char* definition) {
+  size_t n = 0;
+  while (is_iden_char(definition[n])) {
+    n++;
+  }
+  bool function_like = (definition[n] == '(');
+  const char* value = strchr(definition + n, '=');
+  if (value) {
+    return mtdefine(self, definition, n, value + 1, strlen(value + 1), function_like);
+  }
+  return mtdefine(self, definition, n, "1", 1, function_like);
+}
+
+
+// #if expressions
+//
+// Tokens are read from a stack of sources: the expression itself, and the
+// definitions of the macros being expanded in it.
+enum {
+  ET_END,
+  ET_NUMBER,
+  ET_IDEN,
+  ET_PUNCT,
+  ET_ERROR
+};
+
+typedef struct {
+  int kind;
+  const char* text;
+  size_t length;
+  int64_t value;
+} ExprToken;
+
+typedef struct {
+  const char* s;
+  size_t n;
+  size_t pos;
+  const Macro* macro; // macro being expanded, NULL for the expression
+} ExprSource;
+
+typedef struct {
+  const MacroTable* macros;
+  ExprSource sources[EXPANSION_MAX_DEPTH];
+  int depth;
+  ExprToken tok; // current token
+  bool error;
+  int skipped;   // > 0 within an operand which isn't evaluated
+} Expr;
+
+static const char* const expr_puncts[] = {
+  "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+  "+", "-", "*", "/", "%", "<", ">", "&", "|", "^", "!", "~", "?", ":", "(", ")", ","
+};
+
+static int64_t
+char_value(const char* s, size_t n, size_t* length) {
+  // 'c' or '\n' style escapes, s points after the opening quote
+  size_t i = 0;
+  int64_t value = 0;
+  if (i < n && s[i] == '\\' && i + 1 < n) {
+    switch (s[i + 1]) {
+      case 'n': value = '\n'; break;
+      case 't': value = '\t'; break;
+      case 'r': value = '\r'; break;
+      case '0': value = 0; break;
+      default: value = (unsigned char) s[i + 1]; break;
+    }
+    i += 2;
+  } else if (i < n) {
+    value = (unsigned char) s[i++];
+  }
+  *length = (i < n && s[i] == '\'') ? i + 1 : 0;
+  return value;
+}
+
+// Next token of the topmost source, without macro expansion
+static ExprToken
+expr_next_raw(Expr* e) {
+  ExprToken tok = { .kind = ET_END };
+
+  for (;;) {
+    ExprSource* src = &e->sources[e->depth];
+    const char* s = src->s;
+    size_t n = src->n;
+    size_t i = src->pos;
+
+    // Whitespace, backslash-newlines and comments
+    while (i < n) {
+      if (s[i] == ' ' || s[i] == '\t' || s[i] == '\\' || s[i] == '\r' || s[i] == '\n') {
+        i++;
+      } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '*') {
+        const char* closer = NULL;
+        for (size_t j = i + 2; j + 1 < n && !closer; j++) {
+          closer = (s[j] == '*' && s[j + 1] == '/') ? s + j : NULL;
+        }
+        i = (closer) ? (size_t) (closer - s) + 2 : n;
+      } else if (s[i] == '/' && i + 1 < n && s[i + 1] == '/') {
+        i = n;
+      } else {
+        break;
+      }
+    }
+
+    if (i == n) {
+      src->pos = n;
+      if (e->depth == 0) {
+        return tok;
+      }
+      e->depth--;
+      continue;
+    }
+
+    tok.text = s + i;
+    if (is_iden_char(s[i]) && !(s[i] >= '0' && s[i] <= '9')) {
+      while (i < n && is_iden_char(s[i])) {
+        i++;
+      }
+      tok.kind = ET_IDEN;
+    } else if (s[i] >= '0' && s[i] <= '9') {
+      // Integer literal, the u and l suffixes don't change its value here
+      size_t begin = i;
+      while (i < n && is_iden_char(s[i])) {
+        i++;
+      }
+      size_t digits = i - begin;
+      while (digits > 0 && strchr("uUlL", s[begin + digits - 1])) {
+        digits--;
+      }
+      char buf[64] = {0};
+      if (digits >= sizeof(buf)) {
+        tok.kind = ET_ERROR;
+        break;
+      }
+      memcpy(buf, s + begin, digits);
+      char* end = NULL;
+      if (digits > 1 && buf[0] == '0' && (buf[1] == 'b' || buf[1] == 'B')) {
+        tok.value = (int64_t) strtoull(buf + 2, &end, 2);
+      } else {
+        tok.value = (int64_t) strtoull(buf, &end, 0);
+      }
+      tok.kind = (*end == 0x00) ? ET_NUMBER : ET_ERROR;
+    } else if (s[i] == '\'') {
+      size_t length = 0;
+      tok.value = char_value(s + i + 1, n - i - 1, &length);
+      tok.kind = (length) ? ET_NUMBER : ET_ERROR;
+      i += 1 + length;
+    } else {
+      tok.kind = ET_ERROR;
+      for (size_t j = 0; j < sizeof(expr_puncts) / sizeof(expr_puncts[0]); j++) {
+        size_t length = strlen(expr_puncts[j]);
+        if (n - i >= length && !memcmp(s + i, expr_puncts[j], length)) {
+          tok.kind = ET_PUNCT;
+          i += length;
+          break;
+        }
+      }
+      i += (tok.kind == ET_ERROR) ? 1 : 0;
+    }
+    tok.length = (size_t) (s + i - tok.text);
+    src->pos = i;
+    return tok;
+  }
+  return tok;
+}
+
+static bool
+is_expanding(const Expr* e, const Macro* m) {
+  for (int i = 1; i <= e->depth; i++) {
+    if (e->sources[i].macro == m) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Skip a parenthesized argument list, if there is one
+static void
+expr_skip_args(Expr* e) {
+  Expr saved = *e;
+  ExprToken tok = expr_next_raw(e);
+  if (!(tok.kind == ET_PUNCT && tok.text[0] == '(')) {
+    *e = saved;
+    return;
+  }
+  int depth = 1;
+  while (depth > 0 && tok.kind != ET_END) {
+    tok = expr_next_raw(e);
+    if (tok.kind == ET_PUNCT && tok.length == 1 && tok.text[0] == '(') {
+      depth++;
+    } else if (tok.kind == ET_PUNCT && tok.length == 1 && tok.text[0] == ')') {
+      depth--;
+    }
+  }
+  e->error |= (depth > 0);
+}
+
+// Advance to the next token, expanding macros
+static void
+expr_advance(Expr* e) {
+  for (;;) {
+    e->tok = expr_next_raw(e);
+    if (e->tok.kind != ET_IDEN ||
+        (e->tok.length == strlen("defined") && !memcmp(e->tok.text, "defined", e->tok.length))) {
+      return;
+    }
+
+    const Macro* m = mtslot(e->macros, e->tok.text, e->tok.length);
+    if (m->value && !m->function_like && !is_expanding(e, m)) {
+      if (e->depth + 1 == EXPANSION_MAX_DEPTH) {
+        e->error = true;
+        e->tok.kind = ET_ERROR;
+        return;
+      }
+      e->sources[++e->depth] = (ExprSource) { m->value, strlen(m->value), 0, m };
+      continue;
+    }
+
+    // Anything else is 0, including invocations of function-like macros
+    expr_skip_args(e);
+    e->tok.kind = ET_NUMBER;
+    e->tok.value = 0;
+    return;
+  }
+}
+
+static bool
+expr_accept(Expr* e, const char* punct) {
+  if (e->tok.kind == ET_PUNCT && e->tok.length == strlen(punct) &&
+      !memcmp(e->tok.text, punct, e->tok.length)) {
+    expr_advance(e);
+    return true;
+  }
+  return false;
+}
+
+static int64_t expr_conditional(Expr* e);
+
+static int64_t
+expr_unary(Expr* e) {
+  if (expr_accept(e, "+")) {
+    return expr_unary(e);
+  } else if (expr_accept(e, "-")) {
+    return -(uint64_t) expr_unary(e);
+  } else if (expr_accept(e, "!")) {
+    return !expr_unary(e);
+  } else if (expr_accept(e, "~")) {
+    return ~expr_unary(e);
+  } else if (expr_accept(e, "(")) {
+    int64_t value = expr_conditional(e);
+    e->error |= !expr_accept(e, ")");
+    return value;
+  }
+
+  if (e->tok.kind == ET_NUMBER) {
+    int64_t value = e->tok.value;
+    expr_advance(e);
+    return value;
+  }
+
+  if (e->tok.kind == ET_IDEN) {
+    // defined X or defined(X); X is not expanded
+    ExprToken tok = expr_next_raw(e);
+    bool parens = (tok.kind == ET_PUNCT && tok.text[0] == '(');
+    if (parens) {
+      tok = expr_next_raw(e);
+    }
+    if (tok.kind != ET_IDEN) {
+      e->error = true;
+      return 0;
+    }
+    int64_t value = mtdefined(e->macros, tok.text, tok.length);
+    if (parens) {
+      tok = expr_next_raw(e);
+      e->error |= !(tok.kind == ET_PUNCT && tok.text[0] == ')');
+    }
+    expr_advance(e);
+    return value;
+  }
+
+  e->error = true;
+  return 0;
+}
+
+static int64_t
+expr_binary(Expr* e, int level) {
+  // Binary operators from the loosest to the tightest binding
+  static const char* const levels[][4] = {
+    {"||"}, {"&&"}, {"|"}, {"^"}, {"&"}, {"==", "!="},
+    {"<", ">", "<=", ">="}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"}
+  };
+  if (level == sizeof(levels) / sizeof(levels[0])) {
+    return expr_unary(e);
+  }
+
+  int64_t lhs = expr_binary(e, level + 1);
+  for (;;) {
+    const char* op = NULL;
+    for (int i = 0; i < 4 && levels[level][i] && !op; i++) {
+      if (expr_accept(e, levels[level][i])) {
+        op = levels[level][i];
+      }
+    }
+    if (!op) {
+      return lhs;
+    }
+
+    // The right operand of && and || isn't evaluated if the left one
+    // decides, so dividing by zero there is no error
+    bool skip = (!strcmp(op, "&&") && !lhs) || (!strcmp(op, "||") && lhs);
+    e->skipped += skip;
+    int64_t rhs = expr_binary(e, level + 1);
+    e->skipped -= skip;
+    if ((!strcmp(op, "/") || !strcmp(op, "%")) && rhs == 0) {
+      e->error |= !e->skipped;
+      lhs = 0;
+      continue;
+    }
+    if (!strcmp(op, "||")) lhs = lhs || rhs;
+    else if (!strcmp(op, "&&")) lhs = lhs && rhs;
+    else if (!strcmp(op, "|")) lhs = lhs | rhs;
+    else if (!strcmp(op, "^")) lhs = lhs ^ rhs;
+    else if (!strcmp(op, "&")) lhs = lhs & rhs;
+    else if (!strcmp(op, "==")) lhs = lhs == rhs;
+    else if (!strcmp(op, "!=")) lhs = lhs != rhs;
+    else if (!strcmp(op, "<")) lhs = lhs < rhs;
+    else if (!strcmp(op, ">")) lhs = lhs > rhs;
+    else if (!strcmp(op, "<=")) lhs = lhs <= rhs;
+    else if (!strcmp(op, ">=")) lhs = lhs >= rhs;
+    else if (!strcmp(op, "<<")) lhs = (uint64_t) lhs << (rhs & 63);
+    else if (!strcmp(op, ">>")) lhs = lhs >> (rhs & 63);
+    else if (!strcmp(op, "+")) lhs = (uint64_t) lhs + (uint64_t) rhs;
+    else if (!strcmp(op, "-")) lhs = (uint64_t) lhs - (uint64_t) rhs;
+    else if (!strcmp(op, "*")) lhs = (uint64_t) lhs * (uint64_t) rhs;
+    else if (!strcmp(op, "/")) lhs = (rhs == -1) ? (int64_t) -(uint64_t) lhs : lhs / rhs;
+    else if (!strcmp(op, "%")) lhs = (rhs == -1) ? 0 : lhs % rhs;
+  }
+}
+
+static int64_t
+expr_conditional(Expr* e) {
+  int64_t cond = expr_binary(e, 0);
+  if (!expr_accept(e, "?")) {
+    return cond;
+  }
+  // Only the chosen operand is evaluated
+  e->skipped += !cond;
+  int64_t a = expr_conditional(e);
+  e->skipped -= !cond;
+  e->error |= !expr_accept(e, ":");
+  e->skipped += !!cond;
+  int64_t b = expr_conditional(e);
+  e->skipped -= !!cond;
+  return (cond) ? a : b;
+}
+
+bool mteval(const MacroTable* self, const char* expr, size_t n, int64_t* value) {
+  Expr e = {
+    .macros = self,
+    .sources = {{ expr, n, 0, NULL }},
+    .depth = 0,
+    .error = false,
+    .skipped = 0
+  };
+  expr_advance(&e);
+  *value = expr_conditional(&e);
+  return !e.error && e.tok.kind == ET_END;
+}
+
+
+// Nesting of #if groups
+enum {
+  GROUP_TAKEN = 1 << 0, // one of the branches has been active
+  GROUP_ELSE  = 1 << 1  // #else has been seen
+};
+
+void cdinit(Conditionals* self, MacroTable* macros) {
+  self->macros = macros;
+  self->groups = NULL;
+  self->depth = 0;
+  self->capacity = 0;
+  self->failed = false;
+}
+
+void cdfree(Conditionals* self) {
+  free(self->groups);
+}
+
+static void
+cdpush(Conditionals* self, unsigned char group) {
+  if (self->depth == self->capacity) {
+    size_t capacity = (self->capacity) ? self->capacity * 2 : 16;
+    unsigned char* groups = realloc(self->groups, capacity);
+    if (!groups) {
+      self->failed = true;
+      return;
+    }
+    self->groups = groups;
+    self->capacity = capacity;
+  }
+  self->groups[self->depth++] = group;
+}
+
+// The macro name at the beginning of args, 0 if there isn't one
+static size_t
+macro_name_length(const char* args, size_t n) {
+  size_t i = 0;
+  if (n == 0 || (args[0] >= '0' && args[0] <= '9')) {
+    return 0;
+  }
+  while (i < n && is_iden_char(args[i])) {
+    i++;
+  }
+  return i;
+}
+
+// Whether the branch following an #if, #ifdef, #ifndef or #elif is active
+static bool
+cdcondition(Conditionals* self, int directive, const char* args, size_t n,
+            const char** error) {
+  if (directive == PD_IF || directive == PD_ELIF) {
+    int64_t value = 0;
+    if (!mteval(self->macros, args, n, &value)) {
+      *error = "invalid #if expression";
+      return false;
+    }
+    return value != 0;
+  }
+
+  size_t name_length = macro_name_length(args, n);
+  if (name_length == 0) {
+    *error = "expected macro name";
+    return false;
+  }
+  bool defined = mtdefined(self->macros, args, name_length);
+  return (directive == PD_IFDEF) ? defined : !defined;
+}
+
+bool cddirective(Conditionals* self, const char* buf, const Token* tok,
+                 const char** error) {
+  const char* args = buf + tok->args_offset;
+  size_t n = tok->args_length;
+  unsigned char* group = (self->depth) ? &self->groups[self->depth - 1] : NULL;
+
+  switch (tok->directive) {
+    case PD_IF:
+    case PD_IFDEF:
+    case PD_IFNDEF: {
+      bool active = cdcondition(self, tok->directive, args, n, error);
+      cdpush(self, (active) ? GROUP_TAKEN : 0);
+      return !active;
+    }
+    case PD_ELIF:
+      if (!group || (*group & GROUP_ELSE)) {
+        *error = (group) ? "#elif after #else" : "#elif without #if";
+        return false;
+      } else if (*group & GROUP_TAKEN) {
+        return true;
+      } else if (cdcondition(self, tok->directive, args, n, error)) {
+        *group |= GROUP_TAKEN;
+        return false;
+      }
+      return true;
+    case PD_ELSE:
+      if (!group || (*group & GROUP_ELSE)) {
+        *error = (group) ? "#else after #else" : "#else without #if";
+        return false;
+      }
+      *group |= GROUP_ELSE;
+      if (*group & GROUP_TAKEN) {
+        return true;
+      }
+      *group |= GROUP_TAKEN;
+      return false;
+    case PD_ENDIF:
+      if (!group) {
+        *error = "#endif without #if";
+        return false;
+      }
+      self->depth--;
+      return false;
+    case PD_DEFINE: {
+      size_t name_length = macro_name_length(args, n);
+      if (name_length == 0) {
+        *error = "expected macro name";
+        return false;
+      }
+      // NAME(params) body, or NAME body
+      size_t i = name_length;
+      bool function_like = (i < n && args[i] == '(');
+      if (function_like) {
+        while (i < n && args[i] != ')') {
+          i++;
+        }
+        i += (i < n) ? 1 : 0;
+      }
+      while (i < n && (args[i] == ' ' || args[i] == '\t')) {
+        i++;
+      }
+      self->failed |= !mtdefine(self->macros, args, name_length, args + i, n - i, function_like);
+      return false;
+    }
+    case PD_UNDEF: {
+      size_t name_length = macro_name_length(args, n);
+      if (name_length == 0) {
+        *error = "expected macro name";
+        return false;
+      }
+      mtundef(self->macros, args, name_length);
+      return false;
+    }
+    default:
+      return false;
+  }
+}
+
+// Offset of the line after the one containing pos, or len. Lines joined
+// with backslash-newline count as one.
+static size_t
+next_line(const char* buf, size_t len, size_t pos) {
+  for (;;) {
+    const char* newline = memchr(buf + pos, '\n', len - pos);
+    if (!newline) {
+      return len;
+    }
+    size_t end = (size_t) (newline - buf);
+    pos = end + 1;
+    end -= (end > 0 && buf[end - 1] == '\r') ? 1 : 0;
+    if (end == 0 || buf[end - 1] != '\\') {
+      return pos;
+    }
+  }
+}
+
+size_t skip_group(const char* buf, size_t len, size_t pos) {
+  size_t depth = 0;
+
+  if (pos > 0 && buf[pos - 1] != '\n') {
+    pos = next_line(buf, len, pos);
+  }
+
+  for (; pos < len; pos = next_line(buf, len, pos)) {
+    size_t i = pos;
+    while (i < len && (buf[i] == ' ' || buf[i] == '\t')) {
+      i++;
+    }
+    if (i == len || buf[i] != '#') {
+      continue;
+    }
+    size_t hash = i;
+
+    do {
+      i++;
+    } while (i < len && (buf[i] == ' ' || buf[i] == '\t'));
+    size_t name = i;
+    while (i < len && is_iden_char(buf[i])) {
+      i++;
+    }
+    size_t n = i - name;
+
+    if ((n == 2 && !memcmp(buf + name, "if", 2)) ||
+        (n == 5 && !memcmp(buf + name, "ifdef", 5)) ||
+        (n == 6 && !memcmp(buf + name, "ifndef", 6))) {
+      depth++;
+    } else if (n == 5 && !memcmp(buf + name, "endif", 5)) {
+      if (depth == 0) {
+        return hash;
+      }
+      depth--;
+    } else if (depth == 0 && ((n == 4 && !memcmp(buf + name, "elif", 4)) ||
+                              (n == 4 && !memcmp(buf + name, "else", 4)))) {
+      return hash;
+    }
+  }
+  return len;
+}
+
+
+// Include guard detection
+enum {
+  GS_START,  // nothing but comments so far
+  GS_DEFINE, // after #ifndef X
+  GS_BODY,   // after #define X
+  GS_CLOSED, // after the #endif of #ifndef X
+  GS_NONE    // not guarded
+};
+
+void gdinit(GuardDetector* self) {
+  self->state = GS_START;
+  self->depth = 0;
+  self->macro = NULL;
+  self->macro_length = 0;
+  self->once = false;
+}
+
+static size_t
+skip_blanks(const char* s, size_t n, size_t i) {
+  while (i < n && (s[i] == ' ' || s[i] == '\t')) {
+    i++;
+  }
+  return i;
+}
+
+// Length of X in "!defined X" or "!defined(X)", 0 if args is something else
+static size_t
+negated_defined(const char* args, size_t n, const char** name) {
+  size_t i = skip_blanks(args, n, 0);
+  if (i == n || args[i] != '!') {
+    return 0;
+  }
+  i = skip_blanks(args, n, i + 1);
+  if (n - i < strlen("defined") || memcmp(args + i, "defined", strlen("defined"))) {
+    return 0;
+  }
+  i = skip_blanks(args, n, i + strlen("defined"));
+  bool parens = (i < n && args[i] == '(');
+  if (parens) {
+    i = skip_blanks(args, n, i + 1);
+  }
+
+  *name = args + i;
+  size_t length = macro_name_length(args + i, n - i);
+  i = skip_blanks(args, n, i + length);
+  if (parens) {
+    if (i == n || args[i] != ')') {
+      return 0;
+    }
+    i = skip_blanks(args, n, i + 1);
+  }
+  return (i == n) ? length : 0;
+}
+
+void gdtoken(GuardDetector* self, const char* buf, const Token* tok) {
+  if (tok->kind == TC_SC || tok->kind == TC_MC || self->state == GS_NONE) {
+    return;
+  }
+  bool prep = (tok->kind == TC_PREP && !tok->error);
+  const char* args = buf + tok->args_offset;
+  size_t n = tok->args_length;
+
+  if (prep && tok->directive == PD_PRAGMA && n == strlen("once") && !memcmp(args, "once", n)) {
+    self->once = true;
+    return;
+  }
+
+  switch (self->state) {
+    case GS_START:
+      if (prep && tok->directive == PD_IFNDEF) {
+        self->macro = args;
+        self->macro_length = macro_name_length(args, n);
+      } else if (prep && tok->directive == PD_IF) {
+        self->macro_length = negated_defined(args, n, &self->macro);
+      }
+      self->state = (self->macro_length) ? GS_DEFINE : GS_NONE;
+      break;
+    case GS_DEFINE:
+      self->state = (prep && tok->directive == PD_DEFINE &&
+                     macro_name_length(args, n) == self->macro_length &&
+                     !memcmp(args, self->macro, self->macro_length)) ? GS_BODY : GS_NONE;
+      break;
+    case GS_BODY:
+      if (!prep) {
+        break;
+      } else if (tok->directive == PD_IF || tok->directive == PD_IFDEF ||
+                 tok->directive == PD_IFNDEF) {
+        self->depth++;
+      } else if (tok->directive == PD_ENDIF) {
+        self->state = (self->depth) ? GS_BODY : GS_CLOSED;
+        self->depth -= (self->depth) ? 1 : 0;
+      } else if (self->depth == 0 && (tok->directive == PD_ELIF || tok->directive == PD_ELSE)) {
+        self->state = GS_NONE;
+      }
+      break;
+    default:
+      self->state = GS_NONE;
+      break;
+  }
+}
+
+size_t gdguard(const GuardDetector* self, const char** macro) {
+  *macro = self->macro;
+  return (self->state == GS_CLOSED) ? self->macro_length : 0;
+}
@@ -0,0 +1,518 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// deps.c extracts the include dependency graph of a set of source files
+// (scanner --deps). The directives of every file are tokenized by
+// scan_directives(), which jumps over the code between them, with a
+// TokenWriter which only picks up the header names of well-formed #include
+// directives. A "name" is
+// looked up in the directory of the including file and then in the -I
+// directories, while <name> is only looked up in the -I directories.
+// Includes which can't be found are kept in the graph, without a file.
+// With -D/-U, includes in inactive #if groups are not followed.
+//
+// Files are lexed in parallel by a pool of worker threads. The graph itself
+// is the work queue: files are appended to it as they are discovered, and
+// workers take the next file nobody has lexed yet. A file is identified by
+// its canonical path (realpath), so every file is lexed only once no matter
+// how many times (or by how many names) it is included. The graph is guarded
+// by a single mutex, which is never held while lexing or probing the disk.
+//
+// The output only depends on the order of the #include directives, never on
+// the order in which the workers happen to finish.
+//
+// Since files are lexed once per run rather than once per translation unit,
+// include guards (#ifndef X / #define X ... #endif) and #pragma once never
+// cause any rescanning here; they are detected while lexing and reported in
+// the JSON graph, for tools which process every translation unit separately.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "scanner.h"
+
+// An #include directive
+typedef struct {
+  char* name;   // header name without the delimiters
+  bool system;  // <name> rather than "name"
+  char* path;   // where the header was found, NULL if not found
+  char* key;    // canonical path of the header
+  size_t file;  // index of the header in the graph (if found)
+} Include;
+
+// A file in the graph, with the #include directives found in it
+typedef struct {
+  char* path;   // path the file is opened with
+  char* key;    // canonical path, identifies the file
+  bool readable;
+  char* guard;  // include guard macro, NULL if none
+  bool once;    // #pragma once
+  Include* includes;
+  size_t includes_count;
+  size_t includes_capacity;
+} DepsFile;
+
+typedef struct {
+  const DepsOptions* opts;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  // Files in order of discovery. files[next] is the next one to be lexed.
+  DepsFile** files;
+  size_t files_count;
+  size_t files_capacity;
+  size_t next;
+  size_t busy; // number of workers lexing a file
+
+  // Open-addressing hash set of canonical paths (index + 1, 0 if empty)
+  size_t* table;
+  size_t table_capacity;
+} DepsGraph;
+
+// Collects #include directives into file
+typedef struct {
+  TokenWriter base;
+  const FileReader* fr;
+  DepsFile* file;
+  GuardDetector guard;
+} IncludeCollector;
+
+
+static void
+collect_include(TokenWriter* self, const Token* tok) {
+  IncludeCollector* collector = (IncludeCollector*) self;
+  gdtoken(&collector->guard, collector->fr->buf, tok);
+  if (tok->kind != TC_PREP || tok->directive != PD_INCLUDE || tok->error) {
+    return;
+  }
+
+  // <name> or "name" (but not a computed #include MACRO)
+  const char* args = collector->fr->buf + tok->args_offset;
+  if (args[0] != '<' && args[0] != '"') {
+    return;
+  }
+
+  DepsFile* file = collector->file;
+  if (file->includes_count == file->includes_capacity) {
+    file->includes_capacity = (file->includes_capacity) ? file->includes_capacity * 2 : 8;
+    file->includes = realloc(file->includes, file->includes_capacity * sizeof(Include));
+  }
+  Include* inc = &file->includes[file->includes_count++];
+  inc->name = strndup(args + 1, tok->args_length - 2);
+  inc->system = (args[0] == '<');
+  inc->path = NULL;
+  inc->key = NULL;
+  inc->file = 0;
+}
+
+// Remove "." and "dir/.." components of path in place, so that a header
+// gets the same name no matter which directory it was found from
+static void
+normalize_path(char* path) {
+  bool absolute = (path[0] == '/');
+  char* begin = path + absolute; // where the first component goes
+  char* out = begin;
+  char* s = begin;
+
+  while (*s) {
+    char* end = strchr(s, '/');
+    size_t n = (end) ? (size_t) (end - s) : strlen(s);
+    char* next = (end) ? end + 1 : s + n;
+    bool dot_dot = (n == 2 && s[0] == '.' && s[1] == '.');
+    bool last_dot_dot = (out - begin >= 2 && out[-1] == '.' && out[-2] == '.' &&
+                         (out - begin == 2 || out[-3] == '/'));
+
+    if (n == 0 || (n == 1 && s[0] == '.')) {
+      // Drop the component
+    } else if (dot_dot && out > begin && !last_dot_dot) {
+      // Drop the previous component
+      while (out > begin && out[-1] != '/') {
+        out--;
+      }
+      out -= (out > begin);
+    } else if (dot_dot && absolute && out == begin) {
+      // "/.." is "/"
+    } else {
+      if (out > begin) {
+        *out++ = '/';
+      }
+      memmove(out, s, n);
+      out += n;
+    }
+    s = next;
+  }
+
+  if (out == begin && !absolute) {
+    *out++ = '.';
+  }
+  *out = 0x00;
+}
+
+static char*
+join_path(const char* dir, size_t dir_length, const char* name) {
+  char* path = NULL;
+  if (dir_length == 0 || name[0] == '/') {
+    path = strdup(name);
+  } else {
+    bool slash = (dir[dir_length - 1] == '/');
+    path = malloc(dir_length + strlen(name) + 2);
+    sprintf(path, "%.*s%s%s", (int) dir_length, dir, (slash) ? "" : "/", name);
+  }
+  normalize_path(path);
+  return path;
+}
+
+static bool
+is_regular_file(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static bool
+probe_include(Include* inc, char* path) {
+  if (is_regular_file(path) && (inc->key = realpath(path, NULL))) {
+    inc->path = path;
+    return true;
+  }
+  free(path);
+  return false;
+}
+
+// Look up the header of inc, which is included from file
+static void
+resolve_include(const DepsGraph* g, const DepsFile* file, Include* inc) {
+  if (!inc->system) {
+    const char* slash = strrchr(file->path, '/');
+    size_t dir_length = (slash) ? (size_t) (slash - file->path) + 1 : 0;
+    if (probe_include(inc, join_path(file->path, dir_length, inc->name))) {
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < g->opts->include_dirs_count; i++) {
+    const char* dir = g->opts->include_dirs[i];
+    if (probe_include(inc, join_path(dir, strlen(dir), inc->name))) {
+      return;
+    }
+  }
+}
+
+static void
+lex_file(DepsFile* file, const MacroTable* macros) {
+  FileReader* fr = fropen(file->path, true);
+  if (!fr) {
+    return;
+  }
+
+  IncludeCollector collector = {
+    .base = { .write = collect_include, .fout = NULL },
+    .fr = fr,
+    .file = file
+  };
+  gdinit(&collector.guard);
+  // Every file starts from the -D/-U macros, as if it was compiled alone
+  MacroTable* file_macros = (macros) ? mtclone(macros) : NULL;
+  // A file which can't be lexed for lack of memory is as good as unreadable
+  file->readable = scan_directives(fr, &collector.base, file_macros);
+  if (file_macros) {
+    mtfree(file_macros);
+  }
+
+  const char* guard = NULL;
+  size_t guard_length = gdguard(&collector.guard, &guard);
+  file->guard = (guard_length) ? strndup(guard, guard_length) : NULL;
+  file->once = collector.guard.once;
+  frclose(fr);
+}
+
+
+static size_t
+hash_string(const char* s) {
+  size_t h = 14695981039346656037ULL; // FNV-1a
+  for (; *s; s++) {
+    h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// Find the file identified by key, or append it to the graph (and thus to
+// the work queue). Must be called with g->lock held.
+static size_t
+add_file(DepsGraph* g, const char* path, const char* key) {
+  if (2 * (g->files_count + 1) > g->table_capacity) {
+    size_t capacity = (g->table_capacity) ? g->table_capacity * 2 : 64;
+    size_t* table = calloc(capacity, sizeof(size_t));
+    for (size_t i = 0; i < g->files_count; i++) {
+      size_t slot = hash_string(g->files[i]->key) & (capacity - 1);
+      while (table[slot]) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      table[slot] = i + 1;
+    }
+    free(g->table);
+    g->table = table;
+    g->table_capacity = capacity;
+  }
+
+  size_t slot = hash_string(key) & (g->table_capacity - 1);
+  while (g->table[slot]) {
+    if (!strcmp(g->files[g->table[slot] - 1]->key, key)) {
+      return g->table[slot] - 1;
+    }
+    slot = (slot + 1) & (g->table_capacity - 1);
+  }
+
+  if (g->files_count == g->files_capacity) {
+    g->files_capacity = (g->files_capacity) ? g->files_capacity * 2 : 64;
+    g->files = realloc(g->files, g->files_capacity * sizeof(DepsFile*));
+  }
+  DepsFile* file = calloc(1, sizeof(DepsFile));
+  file->path = strdup(path);
+  file->key = strdup(key);
+  g->files[g->files_count] = file;
+  g->table[slot] = ++g->files_count;
+  pthread_cond_broadcast(&g->cond);
+  return g->files_count - 1;
+}
+
+static void*
+deps_worker(void* arg) {
+  DepsGraph* g = arg;
+
+  pthread_mutex_lock(&g->lock);
+  for (;;) {
+    // Wait for more files, unless nobody is left to discover them
+    while (g->next == g->files_count && g->busy > 0) {
+      pthread_cond_wait(&g->cond, &g->lock);
+    }
+    if (g->next == g->files_count) {
+      break;
+    }
+    DepsFile* file = g->files[g->next++];
+    g->busy++;
+    pthread_mutex_unlock(&g->lock);
+
+    lex_file(file, g->opts->macros);
+    for (size_t i = 0; i < file->includes_count; i++) {
+      resolve_include(g, file, &file->includes[i]);
+    }
+
+    pthread_mutex_lock(&g->lock);
+    for (size_t i = 0; i < file->includes_count; i++) {
+      Include* inc = &file->includes[i];
+      if (inc->key) {
+        inc->file = add_file(g, inc->path, inc->key);
+      }
+    }
+    g->busy--;
+  }
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+
+// Make-style escaping of a file name
+static void
+write_make_path(FILE* fout, const char* path) {
+  for (const char* s = path; *s; s++) {
+    if (*s == ' ' || *s == '#') {
+      fputc('\\', fout);
+    } else if (*s == '$') {
+      fputc('$', fout);
+    }
+    fputc(*s, fout);
+  }
+}
+
+// All files file includes (directly or not), in order of first inclusion
+static void
+write_make_prerequisites(const DepsGraph* g, size_t file, bool* seen, FILE* fout) {
+  const DepsFile* f = g->files[file];
+  for (size_t i = 0; i < f->includes_count; i++) {
+    const Include* inc = &f->includes[i];
+    if (!inc->key || seen[inc->file]) {
+      continue;
+    }
+    seen[inc->file] = true;
+    fputs(" \\\n  ", fout);
+    write_make_path(fout, inc->path);
+    write_make_prerequisites(g, inc->file, seen, fout);
+  }
+}
+
+// One rule per input, e.g. "main.o: main.c util.h", like "cc -M"
+static void
+write_make(const DepsGraph* g, const size_t* inputs, size_t inputs_count, FILE* fout) {
+  bool* seen = malloc(g->files_count * sizeof(bool));
+
+  for (size_t i = 0; i < inputs_count; i++) {
+    const char* path = g->files[inputs[i]]->path;
+    const char* base = strrchr(path, '/');
+    base = (base) ? base + 1 : path;
+    const char* dot = strrchr(base, '.');
+    size_t stem_length = (dot) ? (size_t) (dot - base) : strlen(base);
+
+    char* target = malloc(stem_length + 3);
+    sprintf(target, "%.*s.o", (int) stem_length, base);
+    write_make_path(fout, target);
+    fputs(": ", fout);
+    write_make_path(fout, path);
+    free(target);
+
+    memset(seen, 0, g->files_count * sizeof(bool));
+    seen[inputs[i]] = true;
+    write_make_prerequisites(g, inputs[i], seen, fout);
+    fputc('\n', fout);
+  }
+
+  free(seen);
+}
+
+static void
+write_json_string(FILE* fout, const char* s) {
+  fputc('"', fout);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(fout, "\\%c", *s);
+    } else if ((unsigned char) *s < 0x20) {
+      fprintf(fout, "\\u%04x", *s);
+    } else {
+      fputc(*s, fout);
+    }
+  }
+  fputc('"', fout);
+}
+
+static void
+write_json_file(const DepsGraph* g, size_t file, bool* seen, bool* first, FILE* fout) {
+  if (seen[file]) {
+    return;
+  }
+  seen[file] = true;
+
+  const DepsFile* f = g->files[file];
+  fputs((*first) ? "\n" : ",\n", fout);
+  *first = false;
+  fputs("    {\n      \"path\": ", fout);
+  write_json_string(fout, f->path);
+  fputs(",\n      \"guard\": ", fout);
+  if (f->guard) {
+    write_json_string(fout, f->guard);
+  } else {
+    fputs("null", fout);
+  }
+  fprintf(fout, ",\n      \"pragma_once\": %s", (f->once) ? "true" : "false");
+  fputs(",\n      \"includes\": [", fout);
+  for (size_t i = 0; i < f->includes_count; i++) {
+    const Include* inc = &f->includes[i];
+    fputs((i) ? ",\n        {\"name\": " : "\n        {\"name\": ", fout);
+    write_json_string(fout, inc->name);
+    fprintf(fout, ", \"system\": %s, \"path\": ", (inc->system) ? "true" : "false");
+    if (inc->key) {
+      write_json_string(fout, inc->path);
+    } else {
+      fputs("null", fout);
+    }
+    fputc('}', fout);
+  }
+  fputs((f->includes_count) ? "\n      ]\n    }" : "]\n    }", fout);
+
+  for (size_t i = 0; i < f->includes_count; i++) {
+    if (f->includes[i].key) {
+      write_json_file(g, f->includes[i].file, seen, first, fout);
+    }
+  }
+}
+
+// {"files": [{"path", "guard", "pragma_once",
+//             "includes": [{"name", "system", "path"}, ...]}, ...]}
+static void
+write_json(const DepsGraph* g, const size_t* inputs, size_t inputs_count, FILE* fout) {
+  bool* seen = calloc(g->files_count, sizeof(bool));
+  bool first = true;
+
+  fputs("{\n  \"files\": [", fout);
+  for (size_t i = 0; i < inputs_count; i++) {
+    write_json_file(g, inputs[i], seen, &first, fout);
+  }
+  fputs((first) ? "]\n}\n" : "\n  ]\n}\n", fout);
+
+  free(seen);
+}
+
+
+bool scan_deps(const char* const* inputs, size_t inputs_count,
+               const DepsOptions* opts, FILE* fout) {
+  DepsGraph g = {
+    .opts = opts,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+  };
+  bool ok = true;
+
+  // Seed the work queue with the inputs
+  size_t* input_files = malloc(inputs_count * sizeof(size_t));
+  for (size_t i = 0; i < inputs_count; i++) {
+    char* key = realpath(inputs[i], NULL);
+    if (!key) {
+      fprintf(stderr, "Fatal error: %s: %s\n", inputs[i], strerror(errno));
+      ok = false;
+      continue;
+    }
+    input_files[i] = add_file(&g, inputs[i], key);
+    free(key);
+  }
+
+  if (ok) {
+    int jobs = (opts->jobs > 0) ? opts->jobs : 1;
+    pthread_t* workers = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++) {
+      pthread_create(&workers[i], NULL, deps_worker, &g);
+    }
+    for (int i = 0; i < jobs; i++) {
+      pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (size_t i = 0; i < inputs_count; i++) {
+      if (!g.files[input_files[i]]->readable) {
+        fprintf(stderr, "Fatal error: %s: cannot be read\n", inputs[i]);
+        ok = false;
+      }
+    }
+  }
+
+  if (ok) {
+    if (opts->format == DEPS_JSON) {
+      write_json(&g, input_files, inputs_count, fout);
+    } else {
+      write_make(&g, input_files, inputs_count, fout);
+    }
+  }
+
+  // Clean up
+  for (size_t i = 0; i < g.files_count; i++) {
+    DepsFile* file = g.files[i];
+    for (size_t j = 0; j < file->includes_count; j++) {
+      free(file->includes[j].name);
+      free(file->includes[j].path);
+      free(file->includes[j].key);
+    }
+    free(file->includes);
+    free(file->path);
+    free(file->key);
+    free(file->guard);
+    free(file);
+  }
+  free(g.files);
+  free(g.table);
+  free(input_files);
+  return ok;
+}
@@ -0,0 +1,150 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// index.c finds the directives of an input without lexing the code between
+// them, for jobs which only need the directives (scanner --deps). Like
+// simdjson, it works in two stages over blocks of 64 bytes.
+//
+// Stage one classifies the bytes of a block as code or as the inside of a
+// literal or comment. The structural_masks kernel gives bitmaps of the
+// chars which may change that (quotes, backslashes, slashes, stars and
+// newlines). In a block without char literals, escapes or comments, the
+// inside of the string literals is the prefix xor of the quotes, so the
+// whole block is classified with a few bit operations. Other blocks are
+// walked from one set bit to the next through a small state machine, which
+// only looks at the bits that matter in its state (newlines in a // comment,
+// stars in a /* comment, ...).
+//
+// Stage two walks the # bits of the code, the first of which is where scan()
+// would find the next PREP token.
+//
+// The state machine follows the lexers to the letter, quirks included: a
+// backslash-newline in a string literal takes the char after it as well, a
+// // comment ends at the newline even after a backslash, and the char after
+// a * in a /* comment is never the * of the closing */. Directives are
+// left to scan_prep(), so stage one always starts in code.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+// States of stage one
+enum {
+  SI_CODE,
+  SI_STR,  // in a string literal
+  SI_CHAR, // in a char literal
+  SI_SC,   // in a // comment
+  SI_MC    // in a /* comment
+};
+
+
+// Bits of the chars which end state
+static uint64_t
+state_mask(const StructuralMasks* m, int state) {
+  switch (state) {
+    case SI_CODE:
+      return m->quotes | m->apostrophes | m->slashes | m->hashes;
+    case SI_STR:
+      return m->quotes | m->backslashes | m->newlines;
+    case SI_CHAR:
+      return m->apostrophes | m->backslashes | m->newlines;
+    case SI_SC:
+      return m->newlines;
+    default:
+      return m->stars;
+  }
+}
+
+// Bits i..63
+static uint64_t
+bits_from(size_t i) {
+  return (i < 64) ? ~(uint64_t) 0 << i : 0;
+}
+
+size_t next_directive(const char* buf, size_t len, size_t pos) {
+  char padded[64];
+  int state = SI_CODE;
+  size_t next = pos; // first byte the state machine hasn't consumed
+
+  for (size_t block = pos; block < len; block += 64) {
+    const char* p = buf + block;
+    if (len - block < 64) {
+      // Blanks have no bit in any mask
+      memset(padded, ' ', sizeof(padded));
+      memcpy(padded, p, len - block);
+      p = padded;
+    }
+    StructuralMasks m;
+    kernels.structural_masks(p, &m);
+    next = (next > block) ? next : block;
+    uint64_t valid = bits_from(next - block);
+
+    // Fast path: string literals (if any) without escapes
+    if ((state == SI_CODE || state == SI_STR) &&
+        !((m.apostrophes | m.backslashes) & valid)) {
+      uint64_t carry = (state == SI_STR) ? ~(uint64_t) 0 : 0;
+      uint64_t in_string = kernels.prefix_xor(m.quotes & valid) ^ carry;
+      uint64_t follows = (block + 64 < len && (buf[block + 64] == '/' || buf[block + 64] == '*'))
+                         ? (uint64_t) 1 << 63 : 0;
+      uint64_t openers = m.slashes & (((m.slashes | m.stars) >> 1) | follows);
+      if (!((openers | m.newlines) & in_string & valid) && !(openers & ~in_string & valid)) {
+        uint64_t hashes = m.hashes & ~in_string & valid;
+        if (hashes) {
+          return block + __builtin_ctzll(hashes);
+        }
+        state = (in_string >> 63) ? SI_STR : SI_CODE;
+        next = block + 64;
+        continue;
+      }
+    }
+
+    uint64_t bits = 0;
+    while ((bits = state_mask(&m, state) & bits_from(next - block))) {
+      size_t i = block + __builtin_ctzll(bits);
+      char c = buf[i];
+      char following = (i + 1 < len) ? buf[i + 1] : 0x00;
+      next = i + 1;
+      switch (state) {
+        case SI_CODE:
+          if (c == '#') {
+            return i;
+          } else if (c == '"') {
+            state = SI_STR;
+          } else if (c == '\'') {
+            state = SI_CHAR;
+          } else if (c == '/' && (following == '/' || following == '*')) {
+            state = (following == '/') ? SI_SC : SI_MC;
+            next = i + 2;
+          }
+          break;
+        case SI_STR:
+          if (c == '\\') {
+            next = i + ((following == '\n') ? 3 : 2);
+          } else {
+            state = SI_CODE;
+          }
+          break;
+        case SI_CHAR:
+          if (c == '\\') {
+            next = i + 2;
+          } else {
+            state = SI_CODE;
+          }
+          break;
+        case SI_SC:
+          state = SI_CODE;
+          break;
+        case SI_MC:
+          next = i + 2;
+          state = (following == '/') ? SI_CODE : SI_MC;
+          break;
+      }
+    }
+  }
+  return len;
+}
@@ -0,0 +1,284 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// lines.c keeps a checkpoint of the lexer every LI_INTERVAL lines of an
+// input, so that the tokens of a few lines of a huge file (scanner --lines)
+// are found by scanning from the checkpoint before them instead of from the
+// beginning of the file.
+//
+// The lexers don't look back, so the state of the scan between two tokens is
+// nothing but the cursor of the FileReader and its line number. The
+// checkpoint of line L is that state right after the last token which ends
+// before L: every token beginning on L or after it is scanned again from
+// there, exactly as in a scan of the whole file. If L begins in the middle
+// of a token (a /* comment, or a literal or directive continued with
+// backslash-newline), that token is scanned again and dropped; the mode of
+// the checkpoint tells which kind of token it is.
+//
+// Checkpoints are saved to a sidecar file next to the input (<input>.lines),
+// together with the size and modification time of the input, and rebuilt
+// when these change. All integers are little-endian:
+//   header      "SCNL", u8 version, u8 lazy lines, u32 LI_INTERVAL,
+//               u64 input size, i64 input modification time (ns),
+//               u64 number of checkpoints
+//   checkpoint  u32 line, u8 mode (LM_*), u64 offset, u32 offset line
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "scanner.h"
+
+#define LINE_INDEX_MAGIC "SCNL"
+#define LINE_INDEX_VERSION 1
+#define LINE_INDEX_SUFFIX ".lines"
+
+// Collects the checkpoints of an input
+typedef struct {
+  TokenWriter base;
+  const FileReader* fr;
+  LineIndex* index;
+  size_t capacity;
+  int next_line;       // of the next checkpoint
+  size_t last_end;     // state of the reader after the last token
+  int last_line;
+  bool failed;         // the index couldn't grow, which ends the scan
+} IndexWriter;
+
+// Passes the tokens beginning on lines first..last on to next
+typedef struct {
+  TokenWriter base;
+  TokenWriter* next;
+  int first;
+  int last;
+} RangeWriter;
+
+
+int token_mode(int kind) {
+  switch (kind) {
+    case TC_MC:
+      return LM_MC;
+    case TC_STR:
+      return LM_STR;
+    case TC_CHAR:
+      return LM_CHAR;
+    case TC_PREP:
+      return LM_PREP;
+    default:
+      return LM_CODE;
+  }
+}
+
+static void
+write_index(TokenWriter* self, const Token* tok) {
+  IndexWriter* iw = (IndexWriter*) self;
+  LineIndex* index = iw->index;
+
+  while (iw->next_line <= tok->end_line_number) {
+    if (index->count == iw->capacity) {
+      size_t capacity = (iw->capacity) ? iw->capacity * 2 : 64;
+      LineCheckpoint* checkpoints = realloc(index->checkpoints, capacity * sizeof(LineCheckpoint));
+      if (!checkpoints) {
+        iw->failed = true;
+        self->stop = true;
+        return;
+      }
+      index->checkpoints = checkpoints;
+      iw->capacity = capacity;
+    }
+    LineCheckpoint* cp = &index->checkpoints[index->count++];
+    cp->line = iw->next_line;
+    cp->mode = (iw->next_line <= tok->begin_line_number) ? LM_CODE : token_mode(tok->kind);
+    cp->offset = iw->last_end;
+    cp->offset_line = iw->last_line;
+    iw->next_line += LI_INTERVAL;
+  }
+  iw->last_end = iw->fr->pos;
+  iw->last_line = frlineno(iw->fr);
+}
+
+LineIndex* libuild(FileReader* fr) {
+  LineIndex* index = calloc(1, sizeof(LineIndex));
+  if (!index) {
+    return NULL;
+  }
+  index->lazy_lines = fr->lazy_lines;
+  IndexWriter iw = {
+    .base = { .write = write_index, .fout = NULL },
+    .fr = fr,
+    .index = index,
+    .next_line = 1,
+    .last_end = 0,
+    .last_line = 1,
+    .failed = false
+  };
+  frjump(fr, 0, 1);
+  if (!scan(fr, &iw.base, NULL) || iw.failed) {
+    lifree(index);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return index;
+}
+
+void lifree(LineIndex* self) {
+  free(self->checkpoints);
+  free(self);
+}
+
+
+static void
+put_le(FILE* fout, uint64_t v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    fputc((v >> (8 * i)) & 0xff, fout);
+  }
+}
+
+static uint64_t
+get_le(FILE* fin, size_t size, bool* ok) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < size; i++) {
+    int c = fgetc(fin);
+    *ok &= (c != EOF);
+    v |= (uint64_t) (c & 0xff) << (8 * i);
+  }
+  return v;
+}
+
+static bool
+lisave(const LineIndex* self, const char* path) {
+  FILE* fout = fopen(path, "wb");
+  if (!fout) {
+    return false;
+  }
+  fwrite(LINE_INDEX_MAGIC, 1, strlen(LINE_INDEX_MAGIC), fout);
+  put_le(fout, LINE_INDEX_VERSION, 1);
+  put_le(fout, self->lazy_lines, 1);
+  put_le(fout, LI_INTERVAL, 4);
+  put_le(fout, self->input_size, 8);
+  put_le(fout, self->input_mtime, 8);
+  put_le(fout, self->count, 8);
+  for (size_t i = 0; i < self->count; i++) {
+    const LineCheckpoint* cp = &self->checkpoints[i];
+    put_le(fout, cp->line, 4);
+    put_le(fout, cp->mode, 1);
+    put_le(fout, cp->offset, 8);
+    put_le(fout, cp->offset_line, 4);
+  }
+  return fclose(fout) == 0;
+}
+
+// The index saved at path, NULL if there is none or it doesn't belong to
+// an input of this size and modification time
+static LineIndex*
+liload(const char* path, bool lazy_lines, uint64_t size, int64_t mtime) {
+  FILE* fin = fopen(path, "rb");
+  if (!fin) {
+    return NULL;
+  }
+  char magic[sizeof(LINE_INDEX_MAGIC) - 1];
+  bool ok = fread(magic, 1, sizeof(magic), fin) == sizeof(magic) &&
+            !memcmp(magic, LINE_INDEX_MAGIC, sizeof(magic));
+  ok = ok && get_le(fin, 1, &ok) == LINE_INDEX_VERSION;
+  ok = ok && get_le(fin, 1, &ok) == lazy_lines;
+  ok = ok && get_le(fin, 4, &ok) == LI_INTERVAL;
+  ok = ok && get_le(fin, 8, &ok) == size;
+  ok = ok && (int64_t) get_le(fin, 8, &ok) == mtime;
+  size_t count = (ok) ? get_le(fin, 8, &ok) : 0;
+  // Not more checkpoints than lines
+  ok = ok && count <= size + 1;
+  if (!ok) {
+    fclose(fin);
+    return NULL;
+  }
+
+  LineIndex* index = calloc(1, sizeof(LineIndex));
+  if (!index || !(index->checkpoints = malloc(count * sizeof(LineCheckpoint) + 1))) {
+    free(index);
+    fclose(fin);
+    return NULL;
+  }
+  index->count = count;
+  index->lazy_lines = lazy_lines;
+  index->input_size = size;
+  index->input_mtime = mtime;
+  for (size_t i = 0; i < count && ok; i++) {
+    LineCheckpoint* cp = &index->checkpoints[i];
+    cp->line = get_le(fin, 4, &ok);
+    cp->mode = get_le(fin, 1, &ok);
+    cp->offset = get_le(fin, 8, &ok);
+    cp->offset_line = get_le(fin, 4, &ok);
+    ok = ok && cp->line == (int) (i * LI_INTERVAL + 1) && cp->offset <= size;
+  }
+  fclose(fin);
+  if (!ok) {
+    lifree(index);
+    return NULL;
+  }
+  return index;
+}
+
+LineIndex* liopen(const char* filename, FileReader* fr) {
+  struct stat st;
+  if (stat(filename, &st) || !S_ISREG(st.st_mode) || (uint64_t) st.st_size != fr->len) {
+    // Nothing to tell whether a saved index is stale by
+    return libuild(fr);
+  }
+  int64_t mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  char path[strlen(filename) + sizeof(LINE_INDEX_SUFFIX)];
+  snprintf(path, sizeof(path), "%s%s", filename, LINE_INDEX_SUFFIX);
+
+  LineIndex* index = liload(path, fr->lazy_lines, fr->len, mtime);
+  if (!index) {
+    index = libuild(fr);
+    if (!index) {
+      return NULL;
+    }
+    index->input_size = fr->len;
+    index->input_mtime = mtime;
+    // The index is only a cache, so an input in a read-only directory is
+    // simply indexed again next time
+    if (!lisave(index, path)) {
+      remove(path);
+    }
+  }
+  return index;
+}
+
+
+static void
+write_range(TokenWriter* self, const Token* tok) {
+  RangeWriter* rw = (RangeWriter*) self;
+  if (tok->begin_line_number > rw->last) {
+    self->stop = true;
+  } else if (tok->begin_line_number >= rw->first) {
+    // The opener of a closer may be before the checkpoint
+    Token t = *tok;
+    t.flags &= ~TF_UNMATCHED;
+    rw->next->write(rw->next, &t);
+  }
+}
+
+bool scan_lines(FileReader* fr, const LineIndex* index, int first, int last, TokenWriter* tw) {
+  RangeWriter rw = {
+    .base = { .write = write_range, .fout = tw->fout },
+    .next = tw,
+    .first = first,
+    .last = last
+  };
+  size_t i = (first > 1) ? (size_t) (first - 1) / LI_INTERVAL : 0;
+  if (i >= index->count) {
+    i = (index->count) ? index->count - 1 : 0;
+  }
+  if (index->count) {
+    frjump(fr, index->checkpoints[i].offset, index->checkpoints[i].offset_line);
+  } else {
+    frjump(fr, 0, 1);
+  }
+  return scan(fr, &rw.base, NULL);
+}
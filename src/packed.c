@@ -0,0 +1,439 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// packed.c writes and reads the packed token stream, a compact form of the
+// binary stream for archiving the tokens of many files. It holds the same
+// fields, so a packed stream unpacks to the binary (or text) stream the
+// scanner would have written.
+//
+// Most fields are small, or close to the same field of the previous token,
+// so they are stored as LEB128 varints (7 bits per byte, low bits first,
+// the high bit set on every byte but the last): line numbers and offsets as
+// the difference from the previous token, zigzag-encoded so that a negative
+// difference is still short. The kind takes the low 4 bits of the first
+// byte of a token, and the high 4 bits tell which of the optional fields
+// follow.
+//
+// The text of identifiers, reserved words, operators and special symbols is
+// interned: the first time a text is written it is given the next id of a
+// dictionary and written out in full, and then only its id is. The reader
+// builds the same dictionary as it goes, so a stream is decoded one token at
+// a time, without a dictionary up front and without inflating the whole
+// stream.
+//
+// Format:
+//   header  "SCNZ", u8 version
+//   token   u8  kind (TC_*) | PK_* flags
+//           zigzag begin line - begin line of the previous token
+//           [PK_LINES] zigzag end line - begin line
+//           zigzag offset - end offset of the previous token
+//           text: IDEN/REWD/OPER/SPEC: id + 1, and if it's a new id,
+//                 length and text; others: length + 1 and text (0 if none)
+//           [PK_LENGTH] byte length (otherwise the text length)
+//           [PK_LITERAL] flags (TF_*), literal type (LT_*), value (varint,
+//                 or the 8 bytes of the double of a FLOT, little-endian)
+//           PREP: directive (PD_*), zigzag args offset - offset, args length
+//           [PK_ERROR] length, error message
+//   end     u8  PK_END, number of opening brackets
+//           each: token index - index of the previous opening bracket,
+//                 closing index - opening index (0 if none)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+#define PACKED_MAGIC "SCNZ"
+#define PACKED_VERSION 1
+// Longest text or error message a reader accepts
+#define PACKED_MAX_BYTES (1 << 30)
+
+// Low 4 bits of the first byte of a token
+#define PK_KIND 0x0f
+#define PK_END 0x0f
+
+// High 4 bits: fields which follow
+enum {
+  PK_LINES   = 1 << 4, // end line differs from begin line
+  PK_LENGTH  = 1 << 5, // byte length differs from text length
+  PK_LITERAL = 1 << 6, // flags, literal type and value
+  PK_ERROR   = 1 << 7
+};
+
+typedef struct {
+  const char* text;    // NULL if the slot is empty
+  size_t length;
+  uint32_t id;
+} Interned;
+
+typedef struct {
+  TokenWriter base;
+  Interned* slots;     // open addressing
+  size_t count;
+  size_t capacity;
+  int64_t line;        // begin line of the previous token
+  int64_t end;         // end offset of the previous token
+} PackedWriter;
+
+struct PackedReader {
+  FILE* fin;
+  bool ok;             // false once the stream turns out to be invalid
+  bool done;           // the end of the tokens was read
+  char** dict;         // texts by id
+  size_t* dict_lengths;
+  size_t dict_count;
+  size_t dict_capacity;
+  char* text;          // of the last token, if not interned
+  size_t text_capacity;
+  char* error;         // of the last token
+  size_t error_capacity;
+  int64_t line;
+  int64_t end;
+  BracketPair* pairs;
+  size_t pairs_count;
+};
+
+
+static bool
+is_interned(int kind) {
+  return kind == TC_IDEN || kind == TC_REWD || kind == TC_OPER || kind == TC_SPEC;
+}
+
+static size_t
+hash_text(const char* s, size_t n) {
+  size_t h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t
+zigzag(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t v) {
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static void
+put_varint(FILE* fout, uint64_t v) {
+  while (v >= 0x80) {
+    putc((v & 0x7f) | 0x80, fout);
+    v >>= 7;
+  }
+  putc(v, fout);
+}
+
+static void
+put_bytes(FILE* fout, const char* s, size_t n) {
+  put_varint(fout, n);
+  fwrite(s, 1, n, fout);
+}
+
+
+// Slot of the text, which is either its entry or an empty slot
+static Interned*
+pwslot(const PackedWriter* self, const char* s, size_t n) {
+  size_t i = hash_text(s, n) & (self->capacity - 1);
+  while (self->slots[i].text &&
+         !(self->slots[i].length == n && !memcmp(self->slots[i].text, s, n))) {
+    i = (i + 1) & (self->capacity - 1);
+  }
+  return &self->slots[i];
+}
+
+// Id of the text, and true if it was just added
+static bool
+pwintern(PackedWriter* self, const char* s, size_t n, uint32_t* id) {
+  Interned* slot = pwslot(self, s, n);
+  if (slot->text) {
+    *id = slot->id;
+    return false;
+  }
+
+  if (2 * (self->count + 1) > self->capacity) {
+    Interned* slots = self->slots;
+    size_t capacity = self->capacity;
+    self->capacity *= 2;
+    self->slots = calloc(self->capacity, sizeof(Interned));
+    for (size_t i = 0; i < capacity; i++) {
+      if (slots[i].text) {
+        *pwslot(self, slots[i].text, slots[i].length) = slots[i];
+      }
+    }
+    free(slots);
+    slot = pwslot(self, s, n);
+  }
+  // Copied, since the input may be gone before the writer
+  char* text = malloc(n + 1);
+  memcpy(text, s, n);
+  slot->text = text;
+  slot->length = n;
+  slot->id = self->count++;
+  *id = slot->id;
+  return true;
+}
+
+static void
+write_packed(TokenWriter* self, const Token* tok) {
+  PackedWriter* pw = (PackedWriter*) self;
+  FILE* fout = self->fout;
+  bool literal = tok->flags || tok->type != LT_NONE || tok->value.i;
+  bool length = !tok->text || tok->length != tok->text_length;
+
+  putc(tok->kind | ((tok->begin_line_number != tok->end_line_number) ? PK_LINES : 0) |
+       ((length) ? PK_LENGTH : 0) | ((literal) ? PK_LITERAL : 0) |
+       ((tok->error) ? PK_ERROR : 0), fout);
+  put_varint(fout, zigzag(tok->begin_line_number - pw->line));
+  if (tok->begin_line_number != tok->end_line_number) {
+    put_varint(fout, zigzag((int64_t) tok->end_line_number - tok->begin_line_number));
+  }
+  put_varint(fout, zigzag((int64_t) tok->offset - pw->end));
+
+  uint32_t id = 0;
+  if (tok->text && is_interned(tok->kind)) {
+    bool added = pwintern(pw, tok->text, tok->text_length, &id);
+    put_varint(fout, id + 1);
+    if (added) {
+      put_bytes(fout, tok->text, tok->text_length);
+    }
+  } else if (tok->text) {
+    put_varint(fout, tok->text_length + 1);
+    fwrite(tok->text, 1, tok->text_length, fout);
+  } else {
+    put_varint(fout, 0);
+  }
+
+  if (length) {
+    put_varint(fout, tok->length);
+  }
+  if (literal) {
+    put_varint(fout, tok->flags);
+    put_varint(fout, tok->type);
+    if (tok->kind == TC_FLOT) {
+      for (size_t i = 0; i < 8; i++) {
+        putc((tok->value.i >> (8 * i)) & 0xff, fout);
+      }
+    } else {
+      put_varint(fout, tok->value.i);
+    }
+  }
+  if (tok->kind == TC_PREP) {
+    put_varint(fout, tok->directive);
+    put_varint(fout, zigzag((int64_t) tok->args_offset - (int64_t) tok->offset));
+    put_varint(fout, tok->args_length);
+  }
+  if (tok->error) {
+    put_bytes(fout, tok->error, strlen(tok->error));
+  }
+
+  pw->line = tok->begin_line_number;
+  pw->end = tok->offset + tok->length;
+}
+
+static void
+finish_packed(TokenWriter* self, const BracketPair* pairs, size_t count) {
+  putc(PK_END, self->fout);
+  put_varint(self->fout, count);
+  uint32_t open = 0;
+  for (size_t i = 0; i < count; i++) {
+    put_varint(self->fout, pairs[i].open - open);
+    put_varint(self->fout, (pairs[i].close == BRACKET_NONE) ? 0 : pairs[i].close - pairs[i].open);
+    open = pairs[i].open;
+  }
+}
+
+TokenWriter* pwnew(FILE* fout) {
+  PackedWriter* self = calloc(1, sizeof(PackedWriter));
+  self->base.write = write_packed;
+  self->base.fout = fout;
+  self->base.finish = finish_packed;
+  self->capacity = 1024;
+  self->slots = calloc(self->capacity, sizeof(Interned));
+
+  fwrite(PACKED_MAGIC, 1, strlen(PACKED_MAGIC), fout);
+  putc(PACKED_VERSION, fout);
+  return &self->base;
+}
+
+void pwfree(TokenWriter* self) {
+  PackedWriter* pw = (PackedWriter*) self;
+  for (size_t i = 0; i < pw->capacity; i++) {
+    free((char*) pw->slots[i].text);
+  }
+  free(pw->slots);
+  free(pw);
+}
+
+
+static uint64_t
+get_varint(PackedReader* self) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(self->fin);
+    if (c == EOF) {
+      break;
+    }
+    v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return v;
+    }
+  }
+  self->ok = false;
+  return 0;
+}
+
+// Read n bytes into *buf (grown as needed), NUL-terminated
+static bool
+get_bytes(PackedReader* self, size_t n, char** buf, size_t* capacity) {
+  if (!self->ok || n > PACKED_MAX_BYTES) {
+    self->ok = false;
+    return false;
+  }
+  if (n + 1 > *capacity) {
+    *capacity = (n + 1 > 2 * *capacity) ? n + 1 : 2 * *capacity;
+    *buf = realloc(*buf, *capacity);
+  }
+  if (fread(*buf, 1, n, self->fin) != n) {
+    self->ok = false;
+    return false;
+  }
+  (*buf)[n] = '\0';
+  return true;
+}
+
+PackedReader* propen(FILE* fin) {
+  char magic[sizeof(PACKED_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), fin) != sizeof(magic) ||
+      memcmp(magic, PACKED_MAGIC, sizeof(magic)) || getc(fin) != PACKED_VERSION) {
+    return NULL;
+  }
+  PackedReader* self = calloc(1, sizeof(PackedReader));
+  self->fin = fin;
+  self->ok = true;
+  return self;
+}
+
+void prclose(PackedReader* self) {
+  for (size_t i = 0; i < self->dict_count; i++) {
+    free(self->dict[i]);
+  }
+  free(self->dict);
+  free(self->dict_lengths);
+  free(self->text);
+  free(self->error);
+  free(self->pairs);
+  free(self);
+}
+
+static void
+read_brackets(PackedReader* self) {
+  size_t count = get_varint(self);
+  uint32_t open = 0;
+  for (size_t i = 0; i < count && self->ok; i++) {
+    if (i % 1024 == 0) {
+      self->pairs = realloc(self->pairs, (i + 1024) * sizeof(BracketPair));
+    }
+    open += get_varint(self);
+    uint64_t distance = get_varint(self);
+    self->pairs[i].open = open;
+    self->pairs[i].close = (distance) ? open + distance : BRACKET_NONE;
+    self->pairs_count = i + 1;
+  }
+}
+
+bool prnext(PackedReader* self, Token* tok) {
+  if (!self->ok || self->done) {
+    return false;
+  }
+  int head = getc(self->fin);
+  if (head == EOF) {
+    self->ok = false;
+    return false;
+  }
+  if ((head & PK_KIND) == PK_END) {
+    self->done = true;
+    read_brackets(self);
+    return false;
+  }
+  if ((head & PK_KIND) >= TC_LAST) {
+    self->ok = false;
+    return false;
+  }
+
+  memset(tok, 0, sizeof(Token));
+  tok->kind = head & PK_KIND;
+  self->line += unzigzag(get_varint(self));
+  tok->begin_line_number = self->line;
+  tok->end_line_number = self->line;
+  if (head & PK_LINES) {
+    tok->end_line_number += unzigzag(get_varint(self));
+  }
+  tok->offset = self->end + unzigzag(get_varint(self));
+
+  uint64_t n = get_varint(self);
+  if (n > 0 && is_interned(tok->kind)) {
+    n--;
+    if (n == self->dict_count && self->ok) {
+      if (self->dict_count == self->dict_capacity) {
+        self->dict_capacity = (self->dict_capacity) ? self->dict_capacity * 2 : 1024;
+        self->dict = realloc(self->dict, self->dict_capacity * sizeof(char*));
+        self->dict_lengths = realloc(self->dict_lengths, self->dict_capacity * sizeof(size_t));
+      }
+      char* text = NULL;
+      size_t capacity = 0;
+      size_t length = get_varint(self);
+      get_bytes(self, length, &text, &capacity);
+      self->dict[self->dict_count] = text;
+      self->dict_lengths[self->dict_count++] = length;
+    }
+    if (n >= self->dict_count) {
+      self->ok = false;
+      return false;
+    }
+    tok->text = self->dict[n];
+    tok->text_length = self->dict_lengths[n];
+  } else if (n > 0 && get_bytes(self, n - 1, &self->text, &self->text_capacity)) {
+    tok->text = self->text;
+    tok->text_length = n - 1;
+  }
+
+  tok->length = (head & PK_LENGTH) ? get_varint(self) : tok->text_length;
+  if (head & PK_LITERAL) {
+    tok->flags = get_varint(self);
+    tok->type = get_varint(self);
+    if (tok->kind == TC_FLOT) {
+      for (size_t i = 0; i < 8; i++) {
+        int c = getc(self->fin);
+        tok->value.i |= (uint64_t) (c & 0xff) << (8 * i);
+        self->ok &= (c != EOF);
+      }
+    } else {
+      tok->value.i = get_varint(self);
+    }
+  }
+  if (tok->kind == TC_PREP) {
+    tok->directive = get_varint(self);
+    tok->args_offset = tok->offset + unzigzag(get_varint(self));
+    tok->args_length = get_varint(self);
+  }
+  if ((head & PK_ERROR) && get_bytes(self, get_varint(self), &self->error, &self->error_capacity)) {
+    tok->error = self->error;
+  }
+
+  self->end = tok->offset + tok->length;
+  return self->ok;
+}
+
+bool prbrackets(const PackedReader* self, const BracketPair** pairs, size_t* count) {
+  *pairs = self->pairs;
+  *count = self->pairs_count;
+  return self->ok && self->done;
+}
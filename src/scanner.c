@@ -18,69 +18,120 @@
 // then an acceptable token has been found, and thus we can return immediately.
 // Otherwise (if it returns false) we'll have to try the next tokenizing function
 // until one finally returns true.
+//
+// Most tokenizing functions can be ruled out by the first char alone, so
+// get_next_token() dispatches on it and only tries the functions which may
+// accept a token starting with that char (still in the order of TC_*).
+// With GCC the dispatch is a computed goto through a table of labels,
+// otherwise (or with -DSCANNER_NO_COMPUTED_GOTO) it is a plain switch.
+//
+// Identifiers and numbers, most of the bytes of a typical input, are not
+// read char by char: run_length() finds the end of a run of letters or
+// digits 8 bytes at a time (SWAR), or 64 at a time with the kernels for
+// long runs, and the lexers move the cursor over it at once.
  
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "scanner.h"
 
-#define IDEN_MAX_LEN 32
 #define REWD_MAX_LEN 9
-#define INTE_MAX_LEN 12
-#define FLOT_MAX_LEN 64 // not sure @_@
 #define CHAR_MAX_LEN 256
 #define STRING_MAX_LEN 256
 #define OPER_MAX_LEN 3
 #define SC_MAX_LEN 256
-#define PREP_MAX_LEN 128
+#define WS_SWAR_MAX_LEN 32
+#define RUN_SWAR_MAX_LEN 16
 
 #define DEFAULT_OUTPUT_FILENAME "output.txt"
 
+#if defined(__GNUC__) && !defined(SCANNER_NO_COMPUTED_GOTO)
+#define SCANNER_COMPUTED_GOTO
+#endif
+
+// Classes of chars for run_length()
 enum {
-  TC_SC,   // single-line comment
-  TC_MC,   // multi-line comment
-  TC_PREP, // preprocessor directive
-  TC_SPEC, // special symbol
-  TC_REWD, // reserved word
-  TC_CHAR, // char literal
-  TC_STR,  // string literal
-  TC_FLOT, // float
-  TC_OPER, // operator
-  TC_IDEN, // identifier
-  TC_INTE, // interger literal
-  TC_LAST
+  CC_IDEN,  // letters, digits and _
+  CC_DIGIT,
+  CC_HEX,   // hex digits
+  CC_OCTAL
 };
 
+static const char* const token_names[TC_LAST] = {
+  [TC_SC]   = "SC",
+  [TC_MC]   = "MC",
+  [TC_PREP] = "PREP",
+  [TC_SPEC] = "SPEC",
+  [TC_REWD] = "REWD",
+  [TC_CHAR] = "CHAR",
+  [TC_STR]  = "STR",
+  [TC_FLOT] = "FLOT",
+  [TC_OPER] = "OPER",
+  [TC_IDEN] = "IDEN",
+  [TC_INTE] = "INTE",
+  [TC_UNKN] = "UNKN"
+};
 
-// Keep track of line number in a systematic way
-typedef struct {
-  FILE* fin;
-  int line_number;
-} FileReader;
-
-char frgetc(FileReader* self);
-char* frgets(FileReader* self, char* buf, size_t size);
-void frungetc(FileReader* self, char c);
-void frungets(FileReader* self, const char* s);
+static const char* const directive_names[PD_LAST] = {
+  [PD_INCLUDE] = "include",
+  [PD_DEFINE]  = "define",
+  [PD_UNDEF]   = "undef",
+  [PD_IF]      = "if",
+  [PD_IFDEF]   = "ifdef",
+  [PD_IFNDEF]  = "ifndef",
+  [PD_ELIF]    = "elif",
+  [PD_ELSE]    = "else",
+  [PD_ENDIF]   = "endif",
+  [PD_LINE]    = "line",
+  [PD_ERROR]   = "error",
+  [PD_PRAGMA]  = "pragma",
+  [PD_WARNING] = "warning"
+};
 
 
-static void get_next_token(FileReader* fr, FILE* fout);
+static void get_next_token(FileReader* fr, TokenWriter* tw);
+static Token make_token(const FileReader* fr, int kind, size_t offset);
+static void emit(TokenWriter* tw, const Token* tok);
 
 // Lex functions prototypes
-static bool scan_sc(FileReader* fr, FILE* fout);
-static bool scan_mc(FileReader* fr, FILE* fout);
-static bool scan_prep(FileReader* fr, FILE* fout);
-static bool scan_spec(FileReader* fr, FILE* fout);
-static bool scan_rewd(FileReader* fr, FILE* fout);
-static bool scan_char(FileReader* fr, FILE* fout);
-static bool scan_str(FileReader* fr, FILE* fout);
-static bool scan_flot(FileReader* fr, FILE* fout);
-static bool scan_oper(FileReader* fr, FILE* fout);
-static bool scan_iden(FileReader* fr, FILE* fout);
-static bool scan_inte(FileReader* fr, FILE* fout);
+static bool scan_sc(FileReader* fr, TokenWriter* tw);
+static bool scan_mc(FileReader* fr, TokenWriter* tw);
+static bool scan_prep(FileReader* fr, TokenWriter* tw);
+static bool scan_spec(FileReader* fr, TokenWriter* tw);
+static bool scan_rewd(FileReader* fr, TokenWriter* tw);
+static bool scan_char(FileReader* fr, TokenWriter* tw);
+static bool scan_str(FileReader* fr, TokenWriter* tw);
+static bool scan_flot(FileReader* fr, TokenWriter* tw);
+static bool scan_oper(FileReader* fr, TokenWriter* tw);
+static bool scan_iden(FileReader* fr, TokenWriter* tw);
+static bool scan_inte(FileReader* fr, TokenWriter* tw);
+static bool scan_unkn(FileReader* fr, TokenWriter* tw);
+static bool emit_flot(FileReader* fr, TokenWriter* tw, size_t begin);
 
 // Utility functions prototypes
-static void ungets(char* s, FILE* fin);
+static size_t* build_newline_index(const char* buf, size_t len, size_t* count);
+static size_t integer_suffix_length(const char* s, size_t n, bool* is_unsigned, int* longs);
+static size_t float_suffix_length(const char* s, size_t n, int* type);
+static size_t hex_float_length(const char* s, size_t n);
+static int integer_type(uint64_t value, bool decimal, bool is_unsigned, int longs);
+static bool decode_integer(const char* s, size_t n, uint64_t* value);
+static bool decode_float(const char* s, size_t n, bool single, double* value);
+static size_t skip_blanks(const char* buf, size_t len, size_t i);
+static int find_directive(const char* name, size_t n);
+static size_t directive_length(const char* s, size_t n);
+static char* join_lines(const char* s, size_t n, size_t* length);
+static size_t run_length(const char* s, size_t n, int cc);
+static bool is_unknown(char c);
+static bool is_eof(const FileReader* fr, char c);
 static bool is_newline(char c);
 static bool is_whitespace(char c);
 static bool is_alphabet(char c);
@@ -90,92 +141,736 @@ static bool is_hex_digit(char c);
 static char get_escaped_char(char c);
 
 
+FileReader* fropen(const char* filename, bool lazy_lines) {
+  FILE* fin = fopen(filename, "r");
+  if (!fin) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fileno(fin), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t) st.st_size > FR_MAX_LENGTH) {
+    fclose(fin);
+    errno = EFBIG;
+    return NULL;
+  }
+
+  // Read the entire file into memory. The buffer is grown geometrically
+  // so that non-seekable inputs (pipes, /dev/stdin) work as well.
+  size_t capacity = 4096;
+  size_t len = 0;
+  char* buf = (char*) malloc(capacity);
+  size_t n = 0;
+  while (buf && len <= FR_MAX_LENGTH && (n = fread(buf + len, 1, capacity - len, fin)) > 0) {
+    len += n;
+    if (len == capacity) {
+      capacity *= 2;
+      char* tmp = (char*) realloc(buf, capacity);
+      if (!tmp) {
+        free(buf);
+      }
+      buf = tmp;
+    }
+  }
+  fclose(fin);
+  if (len > FR_MAX_LENGTH) {
+    free(buf);
+    errno = EFBIG;
+    return NULL;
+  }
+
+  FileReader* self = (FileReader*) calloc(1, sizeof(FileReader));
+  if (!buf || !self) {
+    free(buf);
+    free(self);
+    return NULL;
+  }
+  self->buf = buf;
+  self->len = len;
+  self->pos = 0;
+  self->line_number = 1;
+  self->lazy_lines = lazy_lines;
+  if (lazy_lines) {
+    self->newlines = build_newline_index(buf, len, &self->newlines_count);
+    if (!self->newlines) {
+      frclose(self);
+      return NULL;
+    }
+  }
+  return self;
+}
+
+void frclose(FileReader* self) {
+  free(self->buf);
+  free(self->newlines);
+  free(self);
+}
+
+int frlineno(const FileReader* self) {
+  if (!self->lazy_lines) {
+    return self->line_number;
+  }
+
+  // Number of newline chars strictly before the cursor
+  size_t lo = 0;
+  size_t hi = self->newlines_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (self->newlines[mid] < self->pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (int) lo + 1;
+}
+
 char frgetc(FileReader* self) {
-  char c =fgetc(self->fin);
-  self->line_number += (is_newline(c)) ? 1 : 0;
+  if (self->pos >= self->len) {
+    self->eof_reads++;
+    return EOF;
+  }
+  char c = self->buf[self->pos++];
+  if (!self->lazy_lines) {
+    self->line_number += (is_newline(c)) ? 1 : 0;
+  }
   return c;
 }
 
 char* frgets(FileReader* self, char* buf, size_t size) {
-  char* ret = fgets(buf, size, self->fin);
-  for (size_t i = 0; i < size; i++) {
-    if (is_newline(buf[i])) {
-      self->line_number++;
+  // Same semantics as fgets(): read at most size - 1 chars,
+  // stop after '\n', return NULL if nothing could be read. A NUL char is
+  // left unread, so that frungets() can push back strlen(buf) chars.
+  if (size == 0 || self->pos >= self->len) {
+    return NULL;
+  }
+  size_t i = 0;
+  while (i < size - 1 && self->pos < self->len && self->buf[self->pos]) {
+    char c = self->buf[self->pos++];
+    buf[i++] = c;
+    if (!self->lazy_lines) {
+      self->line_number += (is_newline(c)) ? 1 : 0;
+    }
+    if (c == '\n') {
+      break;
     }
   }
-  return ret;
+  buf[i] = 0x00;
+  return buf;
 }
 
 void frungetc(FileReader* self, char c) {
-  ungetc(c, self->fin);
-  self->line_number -= (is_newline(c)) ? 1 : 0;
+  // Pushing back EOF is a no-op, just like ungetc(), unless it is a 0xff
+  // char of the input
+  if (c == EOF && self->eof_reads > 0) {
+    self->eof_reads--;
+    return;
+  }
+  if (self->pos == 0) {
+    return;
+  }
+  self->pos--;
+  if (!self->lazy_lines) {
+    self->line_number -= (is_newline(c)) ? 1 : 0;
+  }
 }
 
 void frungets(FileReader* self, const char* s) {
-  for (int i = strlen(s) - 1; i >= 0; i--) {
-    frungetc(self, s[i]);
-  }
-}
-
-
-// Array of lex function pointers.
-// get_next_token(FILE* f) will call these functions in the following order.
-static bool (*lex[TC_LAST])(FileReader* fr, FILE* fout) = {
-  [TC_SC]   = scan_sc,
-  [TC_MC]   = scan_mc,
-  [TC_PREP] = scan_prep,
-  [TC_SPEC] = scan_spec,
-  [TC_REWD] = scan_rewd,
-  [TC_CHAR] = scan_char,
-  [TC_STR]  = scan_str,
-  [TC_FLOT] = scan_flot,
-  [TC_OPER] = scan_oper,
-  [TC_IDEN] = scan_iden,
-  [TC_INTE] = scan_inte
-};
+  // s was read by frgets(), so even a 0xff char in it is a char of the input
+  for (size_t i = strlen(s); i > 0 && self->pos > 0; i--) {
+    char c = self->buf[--self->pos];
+    if (!self->lazy_lines) {
+      self->line_number -= (is_newline(c)) ? 1 : 0;
+    }
+  }
+}
+
+void frseek(FileReader* self, size_t offset) {
+  self->eof_reads = 0;
+  if (!self->lazy_lines) {
+    for (size_t i = offset; i < self->pos; i++) {
+      self->line_number -= (is_newline(self->buf[i])) ? 1 : 0;
+    }
+    for (size_t i = self->pos; i < offset; i++) {
+      self->line_number += (is_newline(self->buf[i])) ? 1 : 0;
+    }
+  }
+  self->pos = offset;
+}
+
+void frjump(FileReader* self, size_t offset, int line_number) {
+  self->eof_reads = 0;
+  self->pos = offset;
+  self->line_number = line_number;
+}
+
+void frskip(FileReader* self, size_t n) {
+  self->pos += n;
+}
+
+// SWAR: 0x80 in each byte of x which is zero, exactly (no false positives
+// from borrows, unlike the usual (x - 0x01..) & ~x & 0x80.. test)
+static uint64_t
+zero_bytes(uint64_t x) {
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+  return ~(((x & low7) + low7) | x | low7);
+}
+
+static uint64_t
+repeat_byte(unsigned char c) {
+  return 0x0101010101010101ULL * c;
+}
+
+// Without the popcnt instruction __builtin_popcountll() is a library call,
+// slower than a loop for the few newline bits in a run of whitespace
+static int
+count_bits(uint64_t x) {
+#ifdef __POPCNT__
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x; x &= x - 1) {
+    n++;
+  }
+  return n;
+#endif
+}
+
+void frskipws(FileReader* self) {
+  // Most runs are an indentation or a newline and an indentation, which
+  // take one or a few 8-byte words. Runs longer than WS_SWAR_MAX_LEN
+  // (blank lines, deep indentation) go on in blocks of 64 bytes.
+  const char* buf = self->buf;
+  size_t pos = self->pos;
+  size_t newlines = 0;
+
+  while (pos + 8 <= self->len && pos - self->pos < WS_SWAR_MAX_LEN) {
+    uint64_t word = 0;
+    memcpy(&word, buf + pos, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word); // first char in the low byte
+#endif
+    uint64_t newline = zero_bytes(word ^ repeat_byte('\n')) | zero_bytes(word ^ repeat_byte('\r'));
+    uint64_t other = ~(newline | zero_bytes(word ^ repeat_byte(' ')) |
+                       zero_bytes(word ^ repeat_byte('\t'))) & repeat_byte(0x80);
+    if (other) {
+      // Bits of the whitespace chars before the first other char
+      uint64_t before = (other & -other) - 1;
+      newlines += count_bits(newline & before);
+      pos += __builtin_ctzll(other) / 8;
+      goto done;
+    }
+    newlines += count_bits(newline);
+    pos += 8;
+  }
+
+  while (pos + 64 <= self->len) {
+    uint64_t newline = 0;
+    uint64_t other = ~kernels.whitespace_mask(buf + pos, &newline);
+    if (other) {
+      newlines += count_bits(newline & ((other & -other) - 1));
+      pos += __builtin_ctzll(other);
+      goto done;
+    }
+    newlines += count_bits(newline);
+    pos += 64;
+  }
+
+  while (pos < self->len && is_whitespace(buf[pos])) {
+    newlines += is_newline(buf[pos++]);
+  }
+
+done:
+  if (!self->lazy_lines) {
+    self->line_number += newlines;
+  }
+  self->pos = pos;
+}
+
+// SWAR: 0x80 in each byte of x between lo and hi, inclusive (exactly, for
+// 0 < lo <= hi < 0x7f)
+static uint64_t
+between_bytes(uint64_t x, unsigned char lo, unsigned char hi) {
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+  uint64_t y = x & low7;
+  uint64_t from_lo = y + repeat_byte(0x80 - lo);
+  uint64_t to_hi = repeat_byte(0x80 + hi) - y;
+  return from_lo & to_hi & ~x & repeat_byte(0x80);
+}
+
+// 0x80 in each byte of word which is a char of class cc
+static uint64_t
+class_bytes(uint64_t word, int cc) {
+  switch (cc) {
+    case CC_IDEN:
+      return between_bytes(word | repeat_byte(0x20), 'a', 'z') | between_bytes(word, '0', '9') |
+             zero_bytes(word ^ repeat_byte('_'));
+    case CC_DIGIT:
+      return between_bytes(word, '0', '9');
+    case CC_HEX:
+      return between_bytes(word | repeat_byte(0x20), 'a', 'f') | between_bytes(word, '0', '9');
+    default:
+      return between_bytes(word, '0', '7');
+  }
+}
+
+static bool
+is_class(char c, int cc) {
+  switch (cc) {
+    case CC_IDEN:
+      return is_alphabet(c) || is_digit(c) || is_underscore(c);
+    case CC_DIGIT:
+      return is_digit(c);
+    case CC_HEX:
+      return is_hex_digit(c);
+    default:
+      return c >= '0' && c <= '7';
+  }
+}
+
+// Length of the run of chars of class cc at s. Most identifiers and numbers
+// fit in one or two 8-byte words, tested with SWAR. Longer runs of letters
+// or digits go on in blocks of 64 bytes.
+static size_t
+run_length(const char* s, size_t n, int cc) {
+  size_t i = 0;
+
+  while (i + 8 <= n && (i < RUN_SWAR_MAX_LEN || cc == CC_HEX || cc == CC_OCTAL)) {
+    uint64_t word = 0;
+    memcpy(&word, s + i, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word); // first char in the low byte
+#endif
+    uint64_t other = ~class_bytes(word, cc) & repeat_byte(0x80);
+    if (other) {
+      return i + __builtin_ctzll(other) / 8;
+    }
+    i += 8;
+  }
+
+  if (cc == CC_IDEN || cc == CC_DIGIT) {
+    for (; i + 64 <= n; i += 64) {
+      uint64_t other = ~((cc == CC_IDEN) ? kernels.iden_mask(s + i) : kernels.digit_mask(s + i));
+      if (other) {
+        return i + __builtin_ctzll(other);
+      }
+    }
+  }
+
+  while (i < n && is_class(s[i], cc)) {
+    i++;
+  }
+  return i;
+}
+
+
+const char* token_name(int kind) {
+  return token_names[kind];
+}
+
+// Text output, one token per line:
+//   <line>[-<end line>] TAB <class> [TAB <text>] [TAB ERROR: <message>]
+void write_text(TokenWriter* self, const Token* tok) {
+  if (tok->begin_line_number != tok->end_line_number) {
+    fprintf(self->fout, "%d-%d", tok->begin_line_number, tok->end_line_number);
+  } else {
+    fprintf(self->fout, "%d", tok->end_line_number);
+  }
+  fprintf(self->fout, "\t%s", token_names[tok->kind]);
+  if (tok->text) {
+    fprintf(self->fout, "\t%.*s", (int) tok->text_length, tok->text);
+  }
+  if (tok->error) {
+    fprintf(self->fout, "\tERROR: %s", tok->error);
+  }
+  fputc('\n', self->fout);
+}
+
+// Binary output, all integers are little-endian:
+//   header  "SCNB", u8 version
+//   token   u8  kind (TC_*)
+//           u8  flags (TF_*)
+//           u8  literal type (LT_*)
+//           u32 begin line number, u32 end line number
+//           u32 byte offset, u32 byte length
+//           u64 value (integer, or bits of an IEEE 754 double for FLOT)
+//           u8  directive (PD_*), u32 args offset, u32 args length
+//           u32 text length (0xffffffff if none), text
+//           u16 error length, error message
+//   end     u8  0xff (BINARY_END, in place of a kind)
+//           u32 number of opening brackets
+//           u32 token index of each opening bracket, u32 index of the
+//               bracket closing it (0xffffffff if none)
+#define BINARY_MAGIC "SCNB"
+#define BINARY_VERSION 5
+#define BINARY_END 0xff
+
+static void
+put_le(FILE* fout, uint64_t v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    fputc((v >> (8 * i)) & 0xff, fout);
+  }
+}
+
+void write_binary_header(FILE* fout) {
+  fwrite(BINARY_MAGIC, 1, strlen(BINARY_MAGIC), fout);
+  put_le(fout, BINARY_VERSION, 1);
+}
+
+void write_binary(TokenWriter* self, const Token* tok) {
+  put_le(self->fout, tok->kind, 1);
+  put_le(self->fout, tok->flags, 1);
+  put_le(self->fout, tok->type, 1);
+  put_le(self->fout, tok->begin_line_number, 4);
+  put_le(self->fout, tok->end_line_number, 4);
+  put_le(self->fout, tok->offset, 4);
+  put_le(self->fout, tok->length, 4);
+  put_le(self->fout, tok->value.i, 8);
+  put_le(self->fout, tok->directive, 1);
+  put_le(self->fout, tok->args_offset, 4);
+  put_le(self->fout, tok->args_length, 4);
+  if (tok->text) {
+    put_le(self->fout, tok->text_length, 4);
+    fwrite(tok->text, 1, tok->text_length, self->fout);
+  } else {
+    put_le(self->fout, 0xffffffff, 4);
+  }
+  size_t error_length = (tok->error) ? strlen(tok->error) : 0;
+  put_le(self->fout, error_length, 2);
+  if (error_length) {
+    fwrite(tok->error, 1, error_length, self->fout);
+  }
+}
+
+void write_binary_brackets(TokenWriter* self, const BracketPair* pairs, size_t count) {
+  put_le(self->fout, BINARY_END, 1);
+  put_le(self->fout, count, 4);
+  for (size_t i = 0; i < count; i++) {
+    put_le(self->fout, pairs[i].open, 4);
+    put_le(self->fout, pairs[i].close, 4);
+  }
+}
+
+
+static void
+get_next_token(FileReader* fr, TokenWriter* tw) {
+  // Peek the first char without consuming it
+  char c = (fr->pos < fr->len) ? fr->buf[fr->pos] : EOF;
+
+#ifdef SCANNER_COMPUTED_GOTO
+  static void* const dispatch[256] = {
+    [0 ... 255] = &&none,
+    ['/'] = &&slash,
+    ['#'] = &&hash,
+    ['{'] = &&spec, ['}'] = &&spec, ['('] = &&spec, [')'] = &&spec, [';'] = &&spec,
+    ['A' ... 'Z'] = &&iden, ['a' ... 'z'] = &&iden, ['_'] = &&iden,
+    // First letters of reserved words
+    ['a'] = &&rewd, ['b'] = &&rewd, ['c'] = &&rewd, ['d'] = &&rewd,
+    ['e'] = &&rewd, ['f'] = &&rewd, ['g'] = &&rewd, ['i'] = &&rewd,
+    ['r'] = &&rewd, ['s'] = &&rewd, ['u'] = &&rewd, ['w'] = &&rewd,
+    ['\''] = &&chr,
+    ['"'] = &&str,
+    ['+'] = &&sign, ['-'] = &&sign, ['.'] = &&sign,
+    ['0' ... '9'] = &&digit,
+    ['>'] = &&oper, ['<'] = &&oper, ['*'] = &&oper, ['%'] = &&oper,
+    ['&'] = &&oper, ['|'] = &&oper, ['='] = &&oper, ['!'] = &&oper,
+    [','] = &&oper, ['['] = &&oper, [']'] = &&oper, ['^'] = &&oper,
+    [':'] = &&oper, ['?'] = &&oper
+  };
+  goto *dispatch[(unsigned char) c];
+#else
+  switch (c) {
+    case '/':
+      goto slash;
+    case '#':
+      goto hash;
+    case '{': case '}': case '(': case ')': case ';':
+      goto spec;
+    case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g':
+    case 'i': case 'r': case 's': case 'u': case 'w':
+      goto rewd;
+    case 'h': case 'j': case 'k': case 'l': case 'm': case 'n': case 'o':
+    case 'p': case 'q': case 't': case 'v': case 'x': case 'y': case 'z':
+    case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G':
+    case 'H': case 'I': case 'J': case 'K': case 'L': case 'M': case 'N':
+    case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U':
+    case 'V': case 'W': case 'X': case 'Y': case 'Z': case '_':
+      goto iden;
+    case '\'':
+      goto chr;
+    case '"':
+      goto str;
+    case '+': case '-': case '.':
+      goto sign;
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      goto digit;
+    case '>': case '<': case '*': case '%': case '&': case '|': case '=':
+    case '!': case ',': case '[': case ']': case '^': case ':': case '?':
+      goto oper;
+    default:
+      goto none;
+  }
+#endif
+
+slash:
+  if (!scan_sc(fr, tw) && !scan_mc(fr, tw)) {
+    scan_oper(fr, tw);
+  }
+  return;
+hash:
+  scan_prep(fr, tw);
+  return;
+spec:
+  scan_spec(fr, tw);
+  return;
+rewd:
+  if (!scan_rewd(fr, tw)) {
+    scan_iden(fr, tw);
+  }
+  return;
+iden:
+  scan_iden(fr, tw);
+  return;
+chr:
+  scan_char(fr, tw);
+  return;
+str:
+  scan_str(fr, tw);
+  return;
+sign:
+  if (!scan_flot(fr, tw)) {
+    scan_oper(fr, tw);
+  }
+  return;
+digit:
+  if (!scan_flot(fr, tw)) {
+    scan_inte(fr, tw);
+  }
+  return;
+oper:
+  scan_oper(fr, tw);
+  return;
+none:
+  // No lexer accepts this char (whitespace, EOF, or an unknown char which
+  // scan() turns into an UNKN token)
+  return;
+}
+
+// Brackets still open, innermost last
+typedef struct {
+  size_t pair;         // in pairs
+  char bracket;
+} OpenBracket;
+
+// Passes tokens on to next, numbering them, matching brackets and
+// following the conditional directives among them
+typedef struct {
+  TokenWriter base;
+  TokenWriter* next;
+  const FileReader* fr;
+  uint32_t index;      // of the next token
+  BracketPair* pairs;
+  size_t pairs_count;
+  size_t pairs_capacity;
+  OpenBracket* open;
+  size_t depth;
+  size_t open_capacity;
+  Conditionals conditionals;
+  bool conditional;    // with macros
+  bool skip;           // an inactive group follows the last token
+  bool failed;         // out of memory, which ends the scan
+} ScanWriter;
+
+// False if the bracket stack can't grow
+static bool
+match_bracket(ScanWriter* self, Token* tok, char c) {
+  if (c == '(' || c == '{' || c == '[') {
+    if (self->pairs_count == self->pairs_capacity) {
+      size_t capacity = (self->pairs_capacity) ? self->pairs_capacity * 2 : 64;
+      BracketPair* pairs = realloc(self->pairs, capacity * sizeof(BracketPair));
+      if (!pairs) {
+        return false;
+      }
+      self->pairs = pairs;
+      self->pairs_capacity = capacity;
+    }
+    if (self->depth == self->open_capacity) {
+      size_t capacity = (self->open_capacity) ? self->open_capacity * 2 : 64;
+      OpenBracket* open = realloc(self->open, capacity * sizeof(OpenBracket));
+      if (!open) {
+        return false;
+      }
+      self->open = open;
+      self->open_capacity = capacity;
+    }
+    self->pairs[self->pairs_count].open = self->index;
+    self->pairs[self->pairs_count].close = BRACKET_NONE;
+    self->open[self->depth].pair = self->pairs_count++;
+    self->open[self->depth++].bracket = c;
+    return true;
+  }
 
+  // Close the innermost open bracket of the same kind, leaving the ones
+  // within it unclosed, as in "( [ )"
+  char opening = (c == ')') ? '(' : (c == '}') ? '{' : '[';
+  size_t depth = self->depth;
+  while (depth > 0 && self->open[depth - 1].bracket != opening) {
+    depth--;
+  }
+  if (depth == 0) {
+    tok->flags |= TF_UNMATCHED;
+    return true;
+  }
+  self->pairs[self->open[depth - 1].pair].close = self->index;
+  self->depth = depth - 1;
+  return true;
+}
 
 static void
-get_next_token(FileReader* fr, FILE* fout) {
-  // Iterate through the array of lexing function pointers.
-  // If any lexing function returns true, it means that
-  // a suitable token is found, hence we can return at once.
-  for (size_t i = 0; i < TC_LAST; i++) {
-    if (lex[i](fr, fout)) {
-      return;
+write_scan(TokenWriter* self, const Token* tok) {
+  ScanWriter* sw = (ScanWriter*) self;
+  char c = sw->fr->buf[tok->offset];
+  bool bracket = (tok->kind == TC_SPEC || tok->kind == TC_OPER) && tok->length == 1 &&
+                 (c == '(' || c == ')' || c == '{' || c == '}' || c == '[' || c == ']');
+  bool directive = (sw->conditional && tok->kind == TC_PREP && !tok->error);
+
+  if (!bracket && !directive) {
+    emit(sw->next, tok);
+  } else {
+    Token t = *tok;
+    if (bracket) {
+      if (!match_bracket(sw, &t, c)) {
+        sw->failed = true;
+        return;
+      }
+    } else {
+      sw->skip = cddirective(&sw->conditionals, sw->fr->buf, &t, &t.error);
+      if (sw->conditionals.failed) {
+        sw->failed = true;
+        return;
+      }
+    }
+    emit(sw->next, &t);
+  }
+  sw->index++;
+}
+
+// With directives_only, the code after the first token following a
+// directive is jumped over, to the next directive
+static bool
+scan_input(FileReader* fr, TokenWriter* tw, MacroTable* macros, bool directives_only) {
+  ScanWriter sw = {
+    .base = { .write = write_scan, .fout = tw->fout },
+    .next = tw,
+    .fr = fr,
+    .index = 0,
+    .conditional = (macros != NULL),
+    .skip = false,
+    .failed = false
+  };
+  if (macros) {
+    cdinit(&sw.conditionals, macros);
+  }
+
+  // Main tokenizing loop. Every iteration consumes at least one byte, so
+  // a scan takes linear time whatever the input.
+  while (fr->pos < fr->len && !tw->stop && !sw.failed) {
+    // if successful, FILE position will be advanced
+    size_t pos = fr->pos;
+    get_next_token(fr, &sw.base);
+    if (fr->pos == pos && !is_whitespace(fr->buf[pos])) {
+      scan_unkn(fr, &sw.base);
     }
+
+    // Jump over an inactive group, to the directive which ends it (but
+    // a // comment after the directive opening it is still tokenized)
+    if (sw.skip && (fr->pos == fr->len || is_newline(fr->buf[fr->pos]) ||
+                    fr->buf[fr->pos - 1] == '\n')) {
+      sw.skip = false;
+      frseek(fr, skip_group(fr->buf, fr->len, fr->pos));
+    }
+
+    // Skip the whole run of whitespace (space, tab, or newline) before
+    // the next token, if any.
+    frskipws(fr);
+
+    // Every token but comments and directives is code, and one of them is
+    // enough for include guard detection
+    if (directives_only && fr->pos != pos && !sw.skip) {
+      char c = fr->buf[pos];
+      char following = (pos + 1 < fr->len) ? fr->buf[pos + 1] : 0x00;
+      if (c != '#' && !is_whitespace(c) && !(c == '/' && (following == '/' || following == '*'))) {
+        frseek(fr, next_directive(fr->buf, fr->len, fr->pos));
+      }
+    }
+  }
+
+  if (tw->finish && !directives_only && !tw->stop && !sw.failed) {
+    tw->finish(tw, sw.pairs, sw.pairs_count);
+  }
+
+  free(sw.pairs);
+  free(sw.open);
+  if (macros) {
+    cdfree(&sw.conditionals);
+  }
+  if (sw.failed) {
+    errno = ENOMEM;
   }
+  return !sw.failed;
+}
+
+bool scan(FileReader* fr, TokenWriter* tw, MacroTable* macros) {
+  return scan_input(fr, tw, macros, false);
+}
+
+bool scan_directives(FileReader* fr, TokenWriter* tw, MacroTable* macros) {
+  return scan_input(fr, tw, macros, true);
+}
+
+
+static Token
+make_token(const FileReader* fr, int kind, size_t offset) {
+  Token tok = {
+    .kind = kind,
+    .begin_line_number = frlineno(fr),
+    .end_line_number = frlineno(fr),
+    .offset = offset,
+    .length = fr->pos - offset,
+    .text = fr->buf + offset,
+    .text_length = fr->pos - offset
+  };
+  return tok;
+}
+
+static void
+emit(TokenWriter* tw, const Token* tok) {
+  tw->write(tw, tok);
 }
 
 
 // Identifier
 static bool
-scan_iden(FileReader* fr, FILE* fout) {
+scan_iden(FileReader* fr, TokenWriter* tw) {
   // 第一個字必須是英文字母或底線字元
   // 由英文字母、底線及數字組成, 長度不限
-  char c = frgetc(fr);
+  size_t begin = fr->pos;
+  char c = (begin < fr->len) ? fr->buf[begin] : EOF;
 
   if (is_alphabet(c) || is_underscore(c)) {
-    char str[IDEN_MAX_LEN] = {0};
-    size_t current = 0;
-
     // Advance cursor
-    while (is_alphabet(c) || is_underscore(c) || is_digit(c)) {
-      str[current++] = c;
-      c = frgetc(fr);
-    }
-    frungetc(fr, c);
-    fprintf(fout, "%d\tIDEN\t%s\n", fr->line_number, str);
+    frskip(fr, run_length(fr->buf + begin, fr->len - begin, CC_IDEN));
+
+    Token tok = make_token(fr, TC_IDEN, begin);
+    emit(tw, &tok);
     return true;
   } else {
-    frungetc(fr, c);
     return false;
   }
 }
 
 // Reserved word
 static bool
-scan_rewd(FileReader* fr, FILE* fout) {
+scan_rewd(FileReader* fr, TokenWriter* tw) {
   static const char rewds[][REWD_MAX_LEN] = {
     "if", "else", "while", "for", "do", "switch", "case", "default",
     "continue", "int", "float", "double", "char", "break", "static",
@@ -183,19 +878,20 @@ scan_rewd(FileReader* fr, FILE* fout) {
     "return", "goto", "const"
   };
   static const size_t rewds_size = sizeof(rewds) / sizeof(rewds[0]);
-  
+  size_t begin = fr->pos;
+  const char* s = fr->buf + begin;
+  size_t n = fr->len - begin;
+
+  // The first reserved word the input starts with, compared in place
   for (size_t i = 0; i < rewds_size; i++) {
     const char* rewd = rewds[i];
     const size_t rewd_size = strlen(rewd);
 
-    char buf[rewd_size + 1];
-    memset(buf, 0x00, rewd_size + 1);
-
-    if (frgets(fr, buf, sizeof(buf)) && !strcmp(buf, rewd)) {
-      fprintf(fout, "%d\tREWD\t%s\n", fr->line_number, buf);
+    if (rewd_size <= n && rewd[0] == s[0] && !memcmp(s, rewd, rewd_size)) {
+      frskip(fr, rewd_size);
+      Token tok = make_token(fr, TC_REWD, begin);
+      emit(tw, &tok);
       return true;
-    } else {
-      frungets(fr, buf);
     }
   }
   return false;
@@ -203,169 +899,140 @@ scan_rewd(FileReader* fr, FILE* fout) {
 
 // Integer
 static bool
-scan_inte(FileReader* fr, FILE* fout) {
-  char buf[INTE_MAX_LEN] = {0};
-  size_t current = 0;
+scan_inte(FileReader* fr, TokenWriter* tw) {
+  size_t begin = fr->pos;
 
   // 0 -> decimal 0
   // 234 -> decimal 234
   // 0xff -> hex
   // 023 -> octal
-  char c = frgetc(fr);
-  buf[current++] = c;
-
-  if (is_digit(c)) {
-    if (c == '0') { // hex, octal or decimal 0
-      c = frgetc(fr);
-      buf[current++] = c;
-      if (c == 'x' || c == 'X') {
-        // Must have at least one hex digit
-        c = frgetc(fr);
-        buf[current++] = c;
-        if (!is_hex_digit(c)) { // (hex) first char after 0x is invalid, e.g., 0xp
-          ungets(&buf[current] - 2, fr->fin);
-          fprintf(fout, "%d\tINTE\t0\n", fr->line_number);
-          return true;
-        } else { // (hex) first char after 0x is valid, e.g., 0xff, 0xffp
-          do {
-            c = frgetc(fr);
-            buf[current++] = c;
-          } while (is_hex_digit(c));
-          frungetc(fr, c);
-          buf[current - 1] = 0x00;
-          fprintf(fout, "%d\tINTE\t%s\n", fr->line_number, buf);
-          return true;
-        }
-      } else if (c >= '0' && c <= '7') { // (octal) first char after 0 is valid
-        do {
-          c = frgetc(fr);
-          buf[current++] = c;
-        } while (c >= '0' && c <= '7');
-        frungetc(fr, c);
-        buf[current - 1] = 0x00;
-        fprintf(fout, "%d\tINTE\t%s\n", fr->line_number, buf);
-        return true;
-      } else { // (octal / dec 0) first char after 0 is invalid
-        frungetc(fr, c);
-        fprintf(fout, "%d\tINTE\t0\n", fr->line_number);
-        return true;
+  const char* buf = fr->buf;
+  size_t len = fr->len;
+  size_t i = begin;
+
+  if (i < len && is_digit(buf[i])) {
+    if (buf[i++] == '0') { // hex, octal or decimal 0
+      if (i + 1 < len && (buf[i] == 'x' || buf[i] == 'X') && is_hex_digit(buf[i + 1])) {
+        // (hex) first char after 0x is valid, e.g., 0xff, 0xffp, but not 0xp
+        i++;
+        i += run_length(buf + i, len - i, CC_HEX);
+      } else if (i < len && buf[i] >= '0' && buf[i] <= '7') {
+        // (octal) first char after 0 is valid
+        i += run_length(buf + i, len - i, CC_OCTAL);
+      } else if (i + 1 < len && (buf[i] == 'x' || buf[i] == 'X') && is_newline(buf[i + 1]) &&
+                 !fr->lazy_lines) {
+        // A bare 0x at the end of a line counts the newline twice, as it
+        // always has (see test/data/inte.c)
+        fr->line_number++;
       }
     } else { // c >= '1' && c <= '9'
-      do {
-        c = frgetc(fr);
-        buf[current++] = c;
-      } while (is_digit(c));
-      frungetc(fr, c);
-      buf[current - 1] = 0x00;
-      fprintf(fout, "%d\tINTE\t%s\n", fr->line_number, buf);
-      return true;
-    } 
+      i += run_length(buf + i, len - i, CC_DIGIT);
+    }
+    frskip(fr, i - begin);
+
+    // Optional suffix, e.g., 10UL
+    size_t digits_length = fr->pos - begin;
+    bool is_unsigned = false;
+    int longs = 0;
+    frseek(fr, fr->pos + integer_suffix_length(fr->buf + fr->pos, fr->len - fr->pos,
+                                               &is_unsigned, &longs));
+
+    Token tok = make_token(fr, TC_INTE, begin);
+    tok.flags |= TF_VALUE;
+    if (decode_integer(tok.text, digits_length, &tok.value.i)) {
+      tok.flags |= TF_OVERFLOW;
+    }
+    bool decimal = tok.text[0] != '0' || digits_length == 1;
+    tok.type = integer_type(tok.value.i, decimal, is_unsigned, longs);
+    if (tok.flags & TF_OVERFLOW) {
+      tok.type = LT_ULLONG;
+    }
+    emit(tw, &tok);
+    return true;
   } else {
-    frungetc(fr, c);
     return false;
   }
 }
 
 // Float
 static bool
-scan_flot(FileReader* fr, FILE* fout) {
+scan_flot(FileReader* fr, TokenWriter* tw) {
   // (+|-|lambda) (D*.D+ | D+.D*) (lambda | ((E|e) (+|-|lambda) D+))
-  char buf[FLOT_MAX_LEN] = {0};
-  size_t current = 0;
+  const char* buf = fr->buf;
+  size_t len = fr->len;
+  size_t begin = fr->pos;
+  size_t i = begin;
 
   // A single '+' or '-' at the beginning is optional
-  char c = frgetc(fr);
-  if (c == '+' || c == '-') {
-    buf[current++] = c;
-  } else {
-    frungetc(fr, c);
+  if (i < len && (buf[i] == '+' || buf[i] == '-')) {
+    i++;
   }
 
-  c = frgetc(fr);
-  buf[current++] = c;
+  // Hexadecimal float, e.g., 0x1.8p3 (the binary exponent is mandatory)
+  size_t hex_length = 0;
+  if (i < len && buf[i] == '0' && (hex_length = hex_float_length(buf + i, len - i))) {
+    frskip(fr, i + hex_length - begin);
+    return emit_flot(fr, tw, begin);
+  }
 
   // Match (D*.D+ | D+.D*)
-  if (is_digit(c)) { // D+.D*
-    // Keep reading until a decimal point is found
-    do {
-      c = frgetc(fr);
-      buf[current++] = c;
-    } while (is_digit(c));
-    
-    // c should be a decimal point
-    if (c != '.') {
-      // Let scan_inte() takes care of it
-      frungets(fr, buf);
-      return false;
-    }
-
-    do {
-      c = frgetc(fr);
-      buf[current++] = c;
-    } while (is_digit(c));
-  } else if (c == '.') { // D*.D+
-    c = frgetc(fr);
-    buf[current++] = c;
-    if (is_digit(c)) {
-      do {
-        c = frgetc(fr);
-        buf[current++] = c;
-      } while (is_digit(c));
-    } else {
-      frungets(fr, buf);
+  size_t digits = run_length(buf + i, len - i, CC_DIGIT);
+  if (digits > 0) { // D+.D*
+    // The digits should be followed by a decimal point,
+    // otherwise let scan_inte() takes care of it
+    i += digits;
+    if (i == len || buf[i] != '.') {
       return false;
     }
+    i++;
+    i += run_length(buf + i, len - i, CC_DIGIT);
+  } else if (i + 1 < len && buf[i] == '.' && is_digit(buf[i + 1])) { // D*.D+
+    i++;
+    i += run_length(buf + i, len - i, CC_DIGIT);
   } else {
-    frungets(fr, buf);
     return false;
   }
 
-  // one char before E|e
-  // because -1 is 'E' or 'e' (or maybe some other char...)
-  // so -2 is the last accepted state (we'll cache the pointer here)
-  char* checkpoint = &buf[current - 2]; 
-
-  // Match (lambda | ((E|e) (+|-|lambda) D+))
-  if (c != 'E' && c != 'e') { // lambda
-    frungetc(fr, c); // backtrack
-    buf[--current] = 0x00;
-    fprintf(fout, "%d\tFLOT\t%s\n", fr->line_number, buf);
-    return true;
-  } else { // (+|-|lambda) D+
-    c = frgetc(fr);
-
-    if (c == '+' || c == '-') {
-      buf[current++] = c;
-      c = frgetc(fr);
+  // Match (lambda | ((E|e) (+|-|lambda) D+)), but backtrack to the last
+  // accepted state if the exponent has no digits,
+  // e.g., 3.e -> we want to wipe 'e' and leave "3." there
+  if (i < len && (buf[i] == 'E' || buf[i] == 'e')) {
+    size_t exponent = i + 1;
+    if (exponent < len && (buf[exponent] == '+' || buf[exponent] == '-')) {
+      exponent++;
     }
-
-    if (is_digit(c)) {
-      while (is_digit(c)) {
-        buf[current++] = c;
-        c = frgetc(fr);
-      }
-      frungetc(fr, c);
-      fprintf(fout, "%d\tFLOT\t%s\n", fr->line_number, buf);
-      return true;
-    } else {
-      // Backtrack to the last accepted state, and
-      // clear all data after checkpoint in reverse order
-      // e.g., 3.e -> we want to wipe 'e' and leave "3." there
-      frungetc(fr, c);
-      char* ptr = &buf[current - 1];
-      while (ptr > checkpoint) {
-        frungetc(fr, *ptr);
-        *(ptr--) = 0x00;
-      }
-      fprintf(fout, "%d\tFLOT\t%s\n", fr->line_number, buf);
-      return true;
+    size_t exponent_digits = run_length(buf + exponent, len - exponent, CC_DIGIT);
+    if (exponent_digits > 0) {
+      i = exponent + exponent_digits;
     }
   }
+
+  frskip(fr, i - begin);
+  return emit_flot(fr, tw, begin);
+}
+
+// Emit the float literal which starts at begin and ends at ifstream's
+// position, together with its suffix (if any).
+static bool
+emit_flot(FileReader* fr, TokenWriter* tw, size_t begin) {
+  size_t numeral_length = fr->pos - begin;
+  int type = LT_DOUBLE;
+  frseek(fr, fr->pos + float_suffix_length(fr->buf + fr->pos, fr->len - fr->pos, &type));
+
+  Token tok = make_token(fr, TC_FLOT, begin);
+  tok.flags |= TF_VALUE;
+  tok.type = type;
+  if (decode_float(tok.text, numeral_length, type == LT_FLOAT, &tok.value.f)) {
+    tok.flags |= TF_OVERFLOW;
+  }
+  emit(tw, &tok);
+  return true;
 }
 
 // Char literal
 static bool
-scan_char(FileReader* fr, FILE* fout) {
+scan_char(FileReader* fr, TokenWriter* tw) {
+  size_t begin = fr->pos;
   char c = frgetc(fr);
 
   if (c == '\'') {
@@ -373,25 +1040,32 @@ scan_char(FileReader* fr, FILE* fout) {
     size_t current = 0;
 
     c = frgetc(fr);
-    while (c != '\'' && !is_newline(c)) {
+    while (c != '\'' && !is_newline(c) && !is_eof(fr, c)) {
       if (c == '\\') {
-        c = get_escaped_char(frgetc(fr));
+        c = frgetc(fr);
+        if (is_eof(fr, c)) {
+          break;
+        }
+        c = get_escaped_char(c);
+      }
+      if (current < sizeof(buf) - 1) {
+        buf[current++] = c;
       }
-      buf[current++] = c;
       c = frgetc(fr);
     }
 
+    Token tok = make_token(fr, TC_CHAR, begin);
+    tok.text = buf;
+    tok.text_length = strlen(buf);
+
     // If nothing is in single quotes, print error message and return.
     if (strlen(buf) == 0) {
-      fprintf(fout, "%d\tCHAR\tERROR: expected at least one char literal\n", fr->line_number);
-      return true;
-    }
-
-    if (c == '\'') {
-      fprintf(fout, "%d\tCHAR\t%s\n", fr->line_number, buf);
-    } else {
-      fprintf(fout, "%d\tCHAR\t%s\tERROR: missing '\n", fr->line_number, buf);
+      tok.text = NULL;
+      tok.error = "expected at least one char literal";
+    } else if (c != '\'') {
+      tok.error = "missing '";
     }
+    emit(tw, &tok);
     return true;
   } else {
     frungetc(fr, c);
@@ -401,16 +1075,17 @@ scan_char(FileReader* fr, FILE* fout) {
 
 // String literal
 static bool
-scan_str(FileReader* fr, FILE* fout) {
+scan_str(FileReader* fr, TokenWriter* tw) {
   char buf[CHAR_MAX_LEN] = {0};
   size_t current = 0;
-  unsigned int begin_line_number = fr->line_number;
+  int begin_line_number = frlineno(fr);
+  size_t begin = fr->pos;
 
   char c = frgetc(fr);
   if (c == '"') {
     // Read until the other " or newline
     c = frgetc(fr);
-    while (c != '"' && !is_newline(c)) {
+    while (c != '"' && !is_newline(c) && !is_eof(fr, c)) {
       if (c == '\\') {
         c = frgetc(fr);
         if (c == '\n') { // multi-line string
@@ -419,24 +1094,30 @@ scan_str(FileReader* fr, FILE* fout) {
         } else { // escape this char
           c = get_escaped_char(c);
         }
+        if (is_eof(fr, c)) {
+          break;
+        }
+      }
+      if (current < sizeof(buf) - 1) {
+        buf[current++] = c;
       }
-      buf[current++] = c;
       c = frgetc(fr);
     }
 
+    Token tok = make_token(fr, TC_STR, begin);
+    tok.text = buf;
+    tok.text_length = strlen(buf);
+
     if (c == '"') {
-      if (fr->line_number != begin_line_number) {
-        fprintf(fout, "%d-%d\tSTR\t%s\n", begin_line_number, fr->line_number, buf);
-      } else {
-        fprintf(fout, "%d\tSTR\t%s\n", fr->line_number, buf);
-      }
+      tok.begin_line_number = begin_line_number;
     } else {
-      if (fr->line_number - 1 != begin_line_number) {
-        fprintf(fout, "%d-%d\tSTR\t%s\tERROR: missing \"\n", begin_line_number, fr->line_number, buf);
-      } else {
-        fprintf(fout, "%d\tSTR\t%s\tERROR: missing \"\n", fr->line_number, buf);
+      // The newline which terminates the string has been consumed
+      if (frlineno(fr) - 1 != begin_line_number) {
+        tok.begin_line_number = begin_line_number;
       }
+      tok.error = "missing \"";
     }
+    emit(tw, &tok);
     return true;
   } else {
     frungetc(fr, c);
@@ -446,7 +1127,7 @@ scan_str(FileReader* fr, FILE* fout) {
 
 // Operator
 static bool
-scan_oper(FileReader* fr, FILE* fout) {
+scan_oper(FileReader* fr, TokenWriter* tw) {
   static const char opers[][OPER_MAX_LEN] = {
     ">>", "<<", "++", "--", "+=", "-=", "*=", "/=", "%=", "&&", "||",
     "->", "==", ">=", "<=", "!=",
@@ -454,6 +1135,7 @@ scan_oper(FileReader* fr, FILE* fout) {
     ".", ">", "<", ":", "?"
   };
   static const size_t opers_size = sizeof(opers) / sizeof(opers[0]);
+  size_t begin = fr->pos;
   
   for (size_t i = 0; i < opers_size; i++) {
     const char* oper = opers[i];
@@ -463,7 +1145,8 @@ scan_oper(FileReader* fr, FILE* fout) {
     memset(buf, 0x00, oper_size + 1);
 
     if (frgets(fr, buf, sizeof(buf)) && !strcmp(buf, oper)) {
-      fprintf(fout, "%d\tOPER\t%s\n", fr->line_number, buf);
+      Token tok = make_token(fr, TC_OPER, begin);
+      emit(tw, &tok);
       return true;
     } else {
       frungets(fr, buf);
@@ -474,11 +1157,13 @@ scan_oper(FileReader* fr, FILE* fout) {
 
 // Special symbol
 static bool
-scan_spec(FileReader* fr, FILE* fout) {
+scan_spec(FileReader* fr, TokenWriter* tw) {
+  size_t begin = fr->pos;
   char c = frgetc(fr);
 
   if (c == '{' || c == '}' || c == '(' || c ==')' || c ==';') {
-    fprintf(fout, "%d\tSPEC\t%c\n", fr->line_number, c);
+    Token tok = make_token(fr, TC_SPEC, begin);
+    emit(tw, &tok);
     return true;
   } else {
     frungetc(fr, c);
@@ -486,29 +1171,43 @@ scan_spec(FileReader* fr, FILE* fout) {
   }
 }
 
+// Unknown chars, a whole run of them per token
+static bool
+scan_unkn(FileReader* fr, TokenWriter* tw) {
+  size_t begin = fr->pos;
+  frgetc(fr);
+  while (fr->pos < fr->len && is_unknown(fr->buf[fr->pos])) {
+    frgetc(fr);
+  }
+  Token tok = make_token(fr, TC_UNKN, begin);
+  tok.error = "unexpected character";
+  emit(tw, &tok);
+  return true;
+}
+
 // Single line comment
 static bool
-scan_sc(FileReader* fr, FILE* fout) {
+scan_sc(FileReader* fr, TokenWriter* tw) {
   static const char* sc_symbol = "//";
   char buf[strlen(sc_symbol) + 1];
   memset(buf, 0x00, sizeof(buf));
+  size_t begin = fr->pos;
 
   frgets(fr, buf, sizeof(buf));
   if (!strcmp(sc_symbol, buf)) {
-    frungets(fr, buf); // put // back to ifstream
-    char content[SC_MAX_LEN] = {0};
-    size_t current = 0;
-
     // Read until newline or EOF
     char c = 0x00;
+    size_t end = 0;
     do {
+      end = fr->pos;
       c = frgetc(fr);
-      content[current++] = c;
-    } while (!is_newline(c) && c != EOF);
-    content[current - 1] = 0x00;
+    } while (!is_newline(c) && !is_eof(fr, c));
 
     // Exclude newline on current line, so line_number - 1
-    fprintf(fout, "%d\tSC\t%s\n", fr->line_number - 1, content);
+    Token tok = make_token(fr, TC_SC, begin);
+    tok.begin_line_number = tok.end_line_number = frlineno(fr) - 1;
+    tok.text_length = end - begin;
+    emit(tw, &tok);
     return true;
   } else {
     frungets(fr, buf);
@@ -518,10 +1217,11 @@ scan_sc(FileReader* fr, FILE* fout) {
 
 // Multi line comment
 static bool
-scan_mc(FileReader* fr, FILE* fout) {
+scan_mc(FileReader* fr, TokenWriter* tw) {
   char buf[strlen("/*") + 1];
   memset(buf, 0x00, sizeof(buf));
-  unsigned int begin_line_number = fr->line_number;
+  unsigned int begin_line_number = frlineno(fr);
+  size_t begin = fr->pos;
 
   frgets(fr, buf, sizeof(buf));
   if (!strcmp("/*", buf)) {
@@ -529,31 +1229,26 @@ scan_mc(FileReader* fr, FILE* fout) {
     char c = 0x00;
     do {
       c = frgetc(fr);
-      //line_number += (is_newline(c)) ? 1 : 0;
       if (c == '*') {
         c = frgetc(fr);
         if (c == '/') {
-          if (fr->line_number == begin_line_number) {
-            fprintf(fout, "%d\tMC\n", fr->line_number);
-          } else {
-            fprintf(fout, "%d-%d\tMC\n", begin_line_number, fr->line_number);
-          }
+          Token tok = make_token(fr, TC_MC, begin);
+          tok.begin_line_number = begin_line_number;
+          tok.text = NULL;
+          emit(tw, &tok);
           return true;
         }
       }
-    } while (c != EOF);
+    } while (!is_eof(fr, c));
 
     // POSIX defines "an actual line" should always ends with a newline
     // so here we should decrement line number manually.
-    if (c == EOF) {
-      fr->line_number--;
-    }
-
-    if (fr->line_number == begin_line_number) {
-      fprintf(fout, "%d\tMC\tERROR: missing */\n", fr->line_number);
-    } else {
-      fprintf(fout, "%d-%d\tMC\tERROR: missing */\n", begin_line_number, fr->line_number);
-    }
+    Token tok = make_token(fr, TC_MC, begin);
+    tok.begin_line_number = begin_line_number;
+    tok.end_line_number--;
+    tok.text = NULL;
+    tok.error = "missing */";
+    emit(tw, &tok);
     return true;
   } else {
     frungets(fr, buf);
@@ -562,85 +1257,496 @@ scan_mc(FileReader* fr, FILE* fout) {
 }
 
 // Preprocessor directive
+//
+// A directive runs to the end of its line, or of the last line joined to it
+// with backslash-newline, but stops before a // comment. #include stops right
+// after the header name instead, and the rest of its line is tokenized as usual.
 static bool
-scan_prep(FileReader* fr, FILE* fout) {
-  char buf[PREP_MAX_LEN] = {0};
-  size_t current = 0;
+scan_prep(FileReader* fr, TokenWriter* tw) {
+  const char* buf = fr->buf;
+  size_t len = fr->len;
+  size_t begin = fr->pos;
+  int begin_line_number = frlineno(fr);
 
-  char c = frgetc(fr);
-  if (c == '#') { // #
-    buf[current++] = c;
+  if (begin >= len || buf[begin] != '#') {
+    return false;
+  }
 
-    // Skip whitespaces between # and include
-    do {
-      c = frgetc(fr);
-      buf[current++] = c;
-    } while (is_whitespace(c));
-    frungetc(fr, c);
-    buf[current--] = 0x00;
+  // # and the directive name, e.g. "#  define"
+  size_t i = skip_blanks(buf, len, begin + 1);
+  size_t name = i;
+  while (i < len && (is_alphabet(buf[i]) || is_digit(buf[i]) || is_underscore(buf[i]))) {
+    i++;
+  }
+  int directive = find_directive(buf + name, i - name);
+  size_t args = skip_blanks(buf, len, i);
+
+  if (directive == PD_INCLUDE && args < len && (buf[args] == '<' || buf[args] == '"')) {
+    // Read until the closing symbol or newline
+    char closing_symbol = (buf[args] == '<') ? '>' : '"';
+    i = args + 1;
+    while (i < len && buf[i] != closing_symbol && !is_newline(buf[i])) {
+      i++;
+    }
+    bool closed = (i < len && buf[i] == closing_symbol);
+
+    // An unterminated header name takes the newline with it
+    frseek(fr, (i < len) ? i + 1 : i);
+    Token tok = make_token(fr, TC_PREP, begin);
+    tok.text_length = (closed) ? i + 1 - begin : i - begin;
+    tok.directive = directive;
+    tok.args_offset = args;
+    tok.args_length = (closed) ? i + 1 - args : i - args;
+    if (!closed) {
+      tok.error = (closing_symbol == '>') ? "missing >" : "missing \"";
+    }
+    emit(tw, &tok);
+    return true;
+  }
 
-    // Try to get "include" from ifstream
-    frgets(fr, buf + current, strlen("include") + 1);
+  // The rest of the directive. A trailing comment is left to be scanned as
+  // a token of its own, whether it is a // or a /* */ one.
+  size_t args_end = args + directive_length(buf + args, len - args);
+  if (directive == PD_NONE && name == args && args == args_end) {
+    directive = PD_NULL;
+  }
 
-    // Copy "include" to buf (if found)
-    if (!strcmp(buf + current, "include")) {
-      strcpy(buf + current, "include");
-      current += strlen("include");
-    } else {
-      fprintf(fout, "%d\tPREP\t%s\tERROR: expected \"include\"\n", fr->line_number, buf);
-      frungets(fr, "include");
+  frseek(fr, args_end);
+  Token tok = make_token(fr, TC_PREP, begin);
+  tok.begin_line_number = begin_line_number;
+  size_t text_end = (args_end > args) ? args_end : (i > name) ? i : begin + 1;
+  tok.text_length = text_end - begin;
+  tok.directive = directive;
+  tok.args_offset = args;
+  tok.args_length = args_end - args;
+  if (directive == PD_NONE) {
+    tok.error = "unknown directive";
+  } else if (directive == PD_INCLUDE && args == args_end) {
+    tok.error = "expected < or \"";
+  }
+
+  char* joined = NULL;
+  if (tok.end_line_number != tok.begin_line_number) {
+    joined = join_lines(tok.text, tok.text_length, &tok.text_length);
+    tok.text = joined;
+  }
+  emit(tw, &tok);
+  free(joined);
+  return true;
+}
+
+
+// Utility functions
+
+// Appends offset to the newline index, false (and frees it) if it can't grow
+static bool
+push_newline(size_t** index, size_t* n, size_t* capacity, size_t offset) {
+  if (*n == *capacity) {
+    *capacity *= 2;
+    size_t* tmp = (size_t*) realloc(*index, *capacity * sizeof(size_t));
+    if (!tmp) {
+      free(*index);
+      *index = NULL;
       return false;
     }
+    *index = tmp;
+  }
+  (*index)[(*n)++] = offset;
+  return true;
+}
 
-    // Skip whitespaces between include and < or "
-    c = frgetc(fr);
-    while (is_whitespace(c)) {
-      buf[current++] = c;
-      c = frgetc(fr);
+// NULL if it runs out of memory
+static size_t*
+build_newline_index(const char* buf, size_t len, size_t* count) {
+  size_t capacity = 64;
+  size_t n = 0;
+  size_t* index = (size_t*) malloc(capacity * sizeof(size_t));
+  size_t i = 0;
+  if (!index) {
+    return NULL;
+  }
+
+  // Find the newlines of 64 bytes at once, then walk the set bits.
+  for (; i + 64 <= len; i += 64) {
+    uint64_t mask = kernels.newline_mask(buf + i);
+    while (mask) {
+      if (!push_newline(&index, &n, &capacity, i + __builtin_ctzll(mask))) {
+        return NULL;
+      }
+      mask &= mask - 1;
     }
+  }
 
-    // Determine the closing symbol
-    buf[current++] = c;
-    char closing_symbol = 0x00;
-    if (c == '<') { // <
-      closing_symbol = '>';
-    } else if (c == '"') {
-      closing_symbol = '"';
-    } else {
-      frungetc(fr, c);
-      fprintf(fout, "%d\tPREP\t%s\tERROR: expected < or \"\n", fr->line_number, buf);
-      return true;
+  for (; i < len; i++) {
+    if (is_newline(buf[i]) && !push_newline(&index, &n, &capacity, i)) {
+      return NULL;
     }
+  }
 
-    // Read until the closing symbol or newline
-    do {
-      c = frgetc(fr);
-      buf[current++] = c;
-    } while (c != closing_symbol && !is_newline(c));
+  *count = n;
+  return index;
+}
+
+// Length of the integer suffix (u, l, ll or a combination, in either case)
+// at s. A suffix running into an identifier is not taken, e.g., 10lol.
+static size_t
+integer_suffix_length(const char* s, size_t n, bool* is_unsigned, int* longs) {
+  size_t i = 0;
+  bool u = false;
+  int l = 0;
+
+  if (i < n && (s[i] == 'u' || s[i] == 'U')) {
+    u = true;
+    i++;
+  }
+  if (i < n && (s[i] == 'l' || s[i] == 'L')) {
+    l = (i + 1 < n && s[i + 1] == s[i]) ? 2 : 1; // but not lL or Ll
+    i += l;
+  }
+  if (!u && i < n && (s[i] == 'u' || s[i] == 'U')) {
+    u = true;
+    i++;
+  }
+
+  if (i < n && (is_alphabet(s[i]) || is_underscore(s[i]) || is_digit(s[i]))) {
+    return 0;
+  }
+  *is_unsigned = u;
+  *longs = l;
+  return i;
+}
+
+// Length of the float suffix (f or l, in either case) at s
+static size_t
+float_suffix_length(const char* s, size_t n, int* type) {
+  if (n == 0 || (s[0] != 'f' && s[0] != 'F' && s[0] != 'l' && s[0] != 'L')) {
+    return 0;
+  }
+  if (n > 1 && (is_alphabet(s[1]) || is_underscore(s[1]) || is_digit(s[1]))) {
+    return 0;
+  }
+  *type = (s[0] == 'f' || s[0] == 'F') ? LT_FLOAT : LT_LDOUBLE;
+  return 1;
+}
+
+// Length of the hex float at s, e.g., 0x1.8p3, or 0 if there is none
+static size_t
+hex_float_length(const char* s, size_t n) {
+  if (n < 2 || s[0] != '0' || (s[1] != 'x' && s[1] != 'X')) {
+    return 0;
+  }
+
+  size_t i = 2;
+  size_t digits = 0;
+  for (; i < n && is_hex_digit(s[i]); i++) {
+    digits++;
+  }
+  if (i < n && s[i] == '.') {
+    for (i++; i < n && is_hex_digit(s[i]); i++) {
+      digits++;
+    }
+  }
+  if (digits == 0 || i == n || (s[i] != 'p' && s[i] != 'P')) {
+    return 0;
+  }
+
+  i++;
+  if (i < n && (s[i] == '+' || s[i] == '-')) {
+    i++;
+  }
+  if (i == n || !is_digit(s[i])) {
+    return 0;
+  }
+  while (i < n && is_digit(s[i])) {
+    i++;
+  }
+  return i;
+}
+
+// The first type in C11 6.4.4.1's list that can represent value.
+// Unsuffixed decimal literals beyond long long are taken as unsigned
+// long long, like GCC does.
+static int
+integer_type(uint64_t value, bool decimal, bool is_unsigned, int longs) {
+  bool may_be_unsigned = is_unsigned || !decimal;
+
+  if (longs == 0 && !is_unsigned && value <= INT_MAX) {
+    return LT_INT;
+  }
+  if (longs == 0 && may_be_unsigned && value <= UINT_MAX) {
+    return LT_UINT;
+  }
+  if (longs <= 1 && !is_unsigned && value <= LONG_MAX) {
+    return LT_LONG;
+  }
+  if (longs <= 1 && may_be_unsigned) {
+    return LT_ULONG;
+  }
+  if (!is_unsigned && value <= LLONG_MAX) {
+    return LT_LLONG;
+  }
+  return LT_ULLONG;
+}
+
+// The k <= 8 chars at s in the bytes of a word, first char in the low byte,
+// after 8 - k '0' chars
+static uint64_t
+load_digits(const char* s, size_t k) {
+  uint64_t word = repeat_byte('0');
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy((char*) &word + 8 - k, s, k);
+  return __builtin_bswap64(word);
+#else
+  memcpy((char*) &word + 8 - k, s, k);
+  return word;
+#endif
+}
+
+// Value of the k <= 8 decimal digits at s, with SWAR: pairs of digits are
+// combined into bytes, pairs of bytes into 16-bit halves, then into the
+// value (Lemire's method)
+static uint32_t
+parse_digits(const char* s, size_t k) {
+  uint64_t word = load_digits(s, k) - repeat_byte('0');
+  word = (word * 10 + (word >> 8)) & 0x00ff00ff00ff00ffULL;
+  word = (word * (1 + (100ULL << 16))) >> 16 & 0x0000ffff0000ffffULL;
+  return (uint32_t) ((word * (1 + (10000ULL << 32))) >> 32);
+}
+
+// Value of the k <= 8 hex digits at s, with SWAR: every char gives its low
+// nibble, plus 9 for a letter, and the nibbles are packed pair by pair
+static uint32_t
+parse_hex_digits(const char* s, size_t k) {
+  uint64_t word = load_digits(s, k);
+  word = (word & repeat_byte(0x0f)) + ((word >> 6) & repeat_byte(0x01)) * 9;
+  word = ((word << 4) | (word >> 8)) & 0x00ff00ff00ff00ffULL;
+  word = ((word << 8) | (word >> 16)) & 0x0000ffff0000ffffULL;
+  return (uint32_t) ((word << 16) | (word >> 32));
+}
+
+// Returns true on overflow, in which case value wraps around modulo 2^64
+static bool
+decode_integer(const char* s, size_t n, uint64_t* value) {
+  unsigned int base = 10;
+  size_t i = 0;
+  if (n > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  } else if (n > 1 && s[0] == '0') {
+    base = 8;
+    i = 1;
+  }
+
+  // Up to 19 decimal or 16 hex digits can't overflow, and are parsed up to
+  // 8 at a time
+  uint64_t v = 0;
+  if (base == 10 && n - i <= 19) {
+    static const uint32_t powers_of_ten[] = {
+      1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+    };
+    for (; i < n; i += 8) {
+      size_t k = (n - i < 8) ? n - i : 8;
+      v = v * powers_of_ten[k] + parse_digits(s + i, k);
+    }
+    *value = v;
+    return false;
+  }
+  if (base == 16 && n - i <= 16) {
+    for (; i < n; i += 8) {
+      size_t k = (n - i < 8) ? n - i : 8;
+      v = (v << (4 * k)) | parse_hex_digits(s + i, k);
+    }
+    *value = v;
+    return false;
+  }
+
+  bool overflow = false;
+  for (; i < n; i++) {
+    char c = s[i];
+    unsigned int d = (is_digit(c)) ? c - '0' : (c | 0x20) - 'a' + 10;
+    overflow |= v > (UINT64_MAX - d) / base;
+    v = v * base + d;
+  }
+  *value = v;
+  return overflow;
+}
+
+// Returns true if the literal is out of the range of a double (or of a
+// float if single is set, in which case value is rounded to a float)
+static bool
+decode_float(const char* s, size_t n, bool single, double* value) {
+  // Fast path (Clinger): if the significand has no more than 19 digits
+  // and fits in 53 bits, and 10^|exp| is exactly representable as well,
+  // then a single IEEE multiplication or division is correctly rounded.
+  static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  static const int max_exact_power = 22;
 
-    if (is_newline(c)) {
-      buf[current - 1] = 0x00;
+  size_t i = 0;
+  bool negative = false;
+  if (s[i] == '+' || s[i] == '-') {
+    negative = s[i++] == '-';
+  }
+
+  uint64_t significand = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool is_hex = n - i > 1 && s[i] == '0' && (s[i + 1] == 'x' || s[i + 1] == 'X');
+  bool exact = !single && !is_hex;
+  bool fraction = false;
+  for (; exact && i < n && (is_digit(s[i]) || s[i] == '.'); i++) {
+    if (s[i] == '.') {
+      fraction = true;
+      continue;
     }
+    if (significand == 0 && s[i] == '0') { // leading zeros
+      exponent -= (fraction) ? 1 : 0;
+      continue;
+    }
+    if (digits == 19) {
+      exact = false;
+      break;
+    }
+    significand = significand * 10 + (s[i] - '0');
+    digits++;
+    exponent -= (fraction) ? 1 : 0;
+  }
 
-    if (c == closing_symbol) {
-      fprintf(fout, "%d\tPREP\t%s\n", fr->line_number, buf);
+  if (exact && i < n) { // (E|e) (+|-|lambda) D+
+    i++;
+    bool negative_exponent = s[i] == '-';
+    i += (s[i] == '+' || s[i] == '-') ? 1 : 0;
+    int e = 0;
+    for (; i < n && e < 100000; i++) {
+      e = e * 10 + (s[i] - '0');
+    }
+    exponent += (negative_exponent) ? -e : e;
+  }
+
+  if (exact && significand <= (uint64_t) 1 << 53 &&
+      exponent >= -max_exact_power && exponent <= max_exact_power) {
+    double d = (double) significand;
+    if (exponent < 0) {
+      d /= exact_powers_of_ten[-exponent];
     } else {
-      fprintf(fout, "%d\tPREP\t%s\tERROR: missing %c\n", fr->line_number, buf, closing_symbol);
+      d *= exact_powers_of_ten[exponent];
     }
-    return true;
-  } else {
-    frungetc(fr, c);
+    *value = (negative) ? -d : d;
     return false;
   }
+
+  // Slow path, strtod() and strtof() are correctly rounded
+  char* tmp = (char*) malloc(n + 1);
+  memcpy(tmp, s, n);
+  tmp[n] = 0x00;
+  errno = 0;
+  if (single) {
+    float f = strtof(tmp, NULL);
+    *value = f;
+  } else {
+    *value = strtod(tmp, NULL);
+  }
+  free(tmp);
+  return errno == ERANGE && isinf(*value);
 }
 
+static size_t
+skip_blanks(const char* buf, size_t len, size_t i) {
+  while (i < len && (buf[i] == ' ' || buf[i] == '\t')) {
+    i++;
+  }
+  return i;
+}
 
-// Utility functions
-static void
-ungets(char* s, FILE* fin) {
-  for (int i = strlen(s) - 1; i >= 0; i--) {
-    ungetc(s[i], fin);
+// PD_* of a directive name, PD_NONE if unknown
+static int
+find_directive(const char* name, size_t n) {
+  for (int i = PD_INCLUDE; i < PD_LAST; i++) {
+    if (strlen(directive_names[i]) == n && !memcmp(directive_names[i], name, n)) {
+      return i;
+    }
   }
+  return PD_NONE;
+}
+
+// Length of the logical line starting at s, up to (but excluding) the
+// newline or // comment which ends it, and the blanks and /* */ comments
+// before that. Lines joined by backslash-newline and /* */ comments within
+// the line are part of it, and comments in literals don't count.
+static size_t
+directive_length(const char* s, size_t n) {
+  char quote = 0x00;
+  size_t i = 0;
+  size_t length = 0;
+
+  while (i < n) {
+    char c = s[i];
+    if (c == '\\' && i + 1 < n && is_newline(s[i + 1])) {
+      i += (s[i + 1] == '\r' && i + 2 < n && s[i + 2] == '\n') ? 3 : 2;
+      length = i;
+      continue;
+    } else if (is_newline(c)) {
+      break;
+    }
+
+    if (quote) {
+      if (c == '\\' && i + 1 < n) {
+        i++;
+      } else if (c == quote) {
+        quote = 0x00;
+      }
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+    } else if (c == '/' && i + 1 < n && s[i + 1] == '/') {
+      break;
+    } else if (c == '/' && i + 1 < n && s[i + 1] == '*') {
+      // Skip to the closing */ (or the end of input)
+      i += 2;
+      while (i + 1 < n && !(s[i] == '*' && s[i + 1] == '/')) {
+        i++;
+      }
+      i += 2;
+      continue;
+    }
+    if (c != ' ' && c != '\t') {
+      length = i + 1;
+    }
+    i++;
+  }
+  return length;
+}
+
+// Copy of s without backslash-newlines (free() it)
+static char*
+join_lines(const char* s, size_t n, size_t* length) {
+  char* joined = malloc(n + 1);
+  size_t j = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == '\\' && i + 1 < n && is_newline(s[i + 1])) {
+      i += (s[i + 1] == '\r' && i + 2 < n && s[i + 2] == '\n') ? 2 : 1;
+      continue;
+    }
+    joined[j++] = s[i];
+  }
+  joined[j] = 0x00;
+  *length = j;
+  return joined;
+}
+
+// Neither whitespace nor the first char of any token (see get_next_token())
+static bool
+is_unknown(char c) {
+  return c == 0x00 || !(is_whitespace(c) || is_alphabet(c) || is_digit(c) || is_underscore(c) ||
+                        strchr("/#{}();'\"+-.><*%&|=!,[]^:?", c));
+}
+
+// c was returned by frgetc() at the end of input, rather than being a 0xff
+// char of the input
+static bool
+is_eof(const FileReader* fr, char c) {
+  return c == EOF && fr->eof_reads > 0;
 }
 
 static bool
@@ -709,59 +1815,569 @@ get_escaped_char(char c) {
 }
 
 
-int
-main(int argc, char* args[]) {
-  if (argc <= 1 || argc >= 4) {
-    printf("usage: %s <input file> <output file>\n", args[0]);
-    return EXIT_SUCCESS;
+// Write the token stream of filename, as lexed by the server
+static int
+connect_server(const char* socket_path, const char* filename, const char* output_filename) {
+  size_t size = 0;
+  const void* tokens = request_tokens(socket_path, filename, &size);
+  if (!tokens) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+
+  output_filename = (output_filename) ? output_filename : DEFAULT_OUTPUT_FILENAME;
+  FILE* fout = fopen(output_filename, "wb");
+  if (!fout) {
+    perror("Fatal error");
+    release_tokens(tokens, size);
+    return EXIT_FAILURE;
   }
+  fwrite(tokens, 1, size, fout);
+  fclose(fout);
+  release_tokens(tokens, size);
+
+  printf("Output has been written to: %s\n", output_filename);
+  return EXIT_SUCCESS;
+}
 
-  // Open input file from args[1]
-  FILE* fin = fopen(args[1], "r");
+// Write the tokens of the packed stream in filename as text, or as a
+// binary stream
+static int
+unpack(const char* filename, const char* output_filename, bool binary) {
+  FILE* fin = fopen(filename, "rb");
   if (!fin) {
     perror("Fatal error");
     return EXIT_FAILURE;
   }
+  PackedReader* pr = propen(fin);
+  if (!pr) {
+    fprintf(stderr, "Fatal error: %s is not a packed token stream\n", filename);
+    fclose(fin);
+    return EXIT_FAILURE;
+  }
+
+  output_filename = (output_filename) ? output_filename : DEFAULT_OUTPUT_FILENAME;
+  FILE* fout = fopen(output_filename, (binary) ? "wb" : "w");
+  if (!fout) {
+    perror("Fatal error");
+    prclose(pr);
+    fclose(fin);
+    return EXIT_FAILURE;
+  }
+  TokenWriter tw = {
+    .write = (binary) ? write_binary : write_text,
+    .fout = fout,
+    .finish = (binary) ? write_binary_brackets : NULL
+  };
+  if (binary) {
+    write_binary_header(fout);
+  }
+
+  Token tok;
+  while (prnext(pr, &tok)) {
+    tw.write(&tw, &tok);
+  }
+  const BracketPair* pairs = NULL;
+  size_t count = 0;
+  bool ok = prbrackets(pr, &pairs, &count);
+  if (ok && tw.finish) {
+    tw.finish(&tw, pairs, count);
+  }
+
+  fclose(fout);
+  prclose(pr);
+  fclose(fin);
+  if (!ok) {
+    fprintf(stderr, "Fatal error: %s is truncated or invalid\n", filename);
+    return EXIT_FAILURE;
+  }
+  printf("Output has been written to: %s\n", output_filename);
+  return EXIT_SUCCESS;
+}
 
-  // Open output file
-  const char* output_filename = DEFAULT_OUTPUT_FILENAME;
-  if (argc == 3) {
-    output_filename = args[2];
+static void
+write_text_callback(const Token* tok, void* data) {
+  write_text((TokenWriter*) data, tok);
+}
+
+// The state saved in filename, or the state at the beginning of an input
+// if there is no such file. Returns false, with errno set (or 0 if the file
+// doesn't hold a state), if it can't be read.
+static bool
+load_state(const char* filename, LexerState* state) {
+  lsinit(state);
+  FILE* fin = fopen(filename, "rb");
+  if (!fin) {
+    return errno == ENOENT;
   }
+  unsigned char buf[LS_ENCODED_SIZE];
+  errno = 0;
+  bool ok = fread(buf, 1, LS_ENCODED_SIZE, fin) == LS_ENCODED_SIZE && lsdecode(state, buf);
+  fclose(fin);
+  return ok;
+}
+
+static bool
+save_state(const char* filename, const unsigned char* buf) {
+  FILE* fout = fopen(filename, "wb");
+  if (!fout) {
+    return false;
+  }
+  bool ok = (fwrite(buf, 1, LS_ENCODED_SIZE, fout) == LS_ENCODED_SIZE);
+  return (fclose(fout) == 0) && ok;
+}
+
+// Scan fin chunk_size bytes at a time with scan_chunk(), from state on. The
+// state is encoded after every chunk and decoded again for the next one, as
+// a process resuming the scan would, and saved to state_filename, so that
+// an interrupted scan can be resumed from there. The file is removed at the
+// end of the input.
+static bool
+scan_saved_chunks(FILE* fin, size_t chunk_size, LexerState* state, const char* state_filename,
+                  TokenWriter* tw) {
+  if (fseeko(fin, state->offset, SEEK_SET)) {
+    return false;
+  }
+  unsigned char saved[LS_ENCODED_SIZE];
+  lsencode(state, saved);
+  char* buf = NULL;
+  size_t len = 0;
+  size_t capacity = 0;
+  bool last = false;
+  bool ok = true;
+  while (!last && ok) {
+    if (len + chunk_size > capacity) {
+      char* grown = realloc(buf, len + chunk_size);
+      if (!grown) {
+        ok = false;
+        break;
+      }
+      buf = grown;
+      capacity = len + chunk_size;
+    }
+    size_t n = fread(buf + len, 1, chunk_size, fin);
+    len += n;
+    last = (n < chunk_size);
+
+    lsdecode(state, saved);
+    size_t used = scan_chunk(buf, len, last, state, tw);
+    if (used == SIZE_MAX) {
+      ok = false;
+      break;
+    }
+    memmove(buf, buf + used, len - used);
+    len -= used;
+    lsencode(state, saved);
+    ok = save_state(state_filename, saved);
+  }
+  free(buf);
+  return ok && remove(state_filename) == 0;
+}
+
+// Write the tokens of filename as text, feeding it to a push-mode scanner
+// chunk_size bytes at a time, or with state_filename, to scan_saved_chunks()
+static int
+scan_chunked(const char* filename, const char* output_filename, size_t chunk_size,
+             const char* state_filename) {
+  LexerState state;
+  if (state_filename && !load_state(state_filename, &state)) {
+    if (errno) {
+      perror("Fatal error");
+    } else {
+      fprintf(stderr, "Fatal error: %s doesn't hold a lexer state\n", state_filename);
+    }
+    return EXIT_FAILURE;
+  }
+  FILE* fin = fopen(filename, "rb");
+  if (!fin) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+  output_filename = (output_filename) ? output_filename : DEFAULT_OUTPUT_FILENAME;
   FILE* fout = fopen(output_filename, "w");
   if (!fout) {
     perror("Fatal error");
+    fclose(fin);
     return EXIT_FAILURE;
   }
+  TokenWriter tw = {
+    .write = write_text,
+    .fout = fout,
+    .finish = NULL
+  };
 
+  bool ok = true;
+  if (state_filename) {
+    ok = scan_saved_chunks(fin, chunk_size, &state, state_filename, &tw);
+  } else {
+    Scanner* scanner = scanner_new(write_text_callback, &tw);
+    char* chunk = malloc(chunk_size);
+    size_t n = 0;
+    ok = (chunk != NULL);
+    while (ok && (n = fread(chunk, 1, chunk_size, fin)) > 0) {
+      ok = scanner_feed(scanner, chunk, n);
+    }
+    if (ok) {
+      ok = scanner_finish(scanner);
+    }
+    scanner_free(scanner);
+    free(chunk);
+  }
 
-  // Main tokenizing loop
-  FileReader* fr = (FileReader*) malloc(sizeof(FileReader));
-  fr->fin = fin;
-  fr->line_number = 1;
-  char c = 0x00;
+  fclose(fin);
+  fclose(fout);
+  if (!ok) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+  printf("Output has been written to: %s\n", output_filename);
+  return EXIT_SUCCESS;
+}
 
-  do {
-    // if successful, FILE position will be advanced
-    get_next_token(fr, fout);
+// Print the number of tokens of each kind in filename
+static int
+print_stats(const char* filename, bool lazy_lines, MacroTable* macros) {
+  FileReader* fr = fropen(filename, lazy_lines);
+  if (!fr) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+  TokenArray* tokens = tascan(fr, macros);
+  if (!tokens) {
+    perror("Fatal error");
+    frclose(fr);
+    return EXIT_FAILURE;
+  }
 
-    // One character lookahead.
-    c = frgetc(fr);
-    frungetc(fr, c);
+  for (int kind = 0; kind < TC_LAST; kind++) {
+    printf("%s\t%zu\n", token_names[kind], tacount(tokens, kind));
+  }
+  size_t errors = 0;
+  size_t matched = 0;
+  size_t unmatched = 0;
+  int last_line = 0;
+  TokenCursor cursor = tacursor(tokens);
+  while (tanext(&cursor)) {
+    size_t i = cursor.index;
+    errors += (taerror(tokens, i) != NULL);
+    if (tamatch(tokens, i) < tokens->count) {
+      matched++;
+    } else if ((tokens->kinds[i] == TC_SPEC || tokens->kinds[i] == TC_OPER) &&
+               tokens->lengths[i] == 1 && strchr("(){}[]", fr->buf[tokens->offsets[i]])) {
+      unmatched++;
+    }
+    last_line = cursor.line;
+  }
+  printf("tokens\t%zu\n", tokens->count);
+  printf("errors\t%zu\n", errors);
+  printf("bracket pairs\t%zu\n", matched / 2);
+  printf("unmatched brackets\t%zu\n", unmatched);
+  printf("last line\t%d\n", last_line);
+
+  tafree(tokens);
+  frclose(fr);
+  return EXIT_SUCCESS;
+}
 
-    // If it is a whitespace (space, tab, or newline),
-    // then just advance it.
-    if (is_whitespace(c)) {
-      c = frgetc(fr);
-      continue;
+// An output given with -o FORMAT=PATH[,buffer=BYTES][,flush=TOKENS]
+typedef struct {
+  const SinkFormat* format;
+  const char* path;
+  SinkPolicy policy;
+} Output;
+
+// Parses arg (in place), false if it is invalid
+static bool
+parse_output(char* arg, Output* output) {
+  char* path = strchr(arg, '=');
+  if (!path) {
+    return false;
+  }
+  *path++ = '\0';
+  output->format = sink_format(arg);
+  output->path = path;
+  if (!output->format) {
+    return false;
+  }
+  output->policy = output->format->policy;
+
+  for (char* option = strchr(path, ','); option; option = strchr(option, ',')) {
+    *option++ = '\0';
+    size_t* field = NULL;
+    if (!strncmp(option, "buffer=", 7)) {
+      field = &output->policy.buffer_size;
+    } else if (!strncmp(option, "flush=", 6)) {
+      field = &output->policy.flush_tokens;
+    }
+    if (!field || !is_digit(*(option = strchr(option, '=') + 1))) {
+      return false;
+    }
+    *field = strtoul(option, &option, 10);
+    if (*option && *option != ',') {
+      return false;
+    }
+  }
+  return *path != '\0';
+}
+
+static void
+print_usage(const char* prog) {
+  printf("usage: %s [-l] [-b|-z] [-D name[=value]]... [-U name]... <input file> <output file>\n", prog);
+  printf("       %s --deps[=make|json] [-I dir]... [-j jobs] <input file>...\n", prog);
+  printf("       %s --serve <socket> [-D name[=value]]... [-U name]...\n", prog);
+  printf("       %s --connect <socket> <input file> <output file>\n", prog);
+  printf("       %s --stats [-D name[=value]]... [-U name]... <input file>\n", prog);
+  printf("       %s --unpack [-b] <packed file> <output file>\n", prog);
+  printf("       %s --lines FIRST-LAST [-l] <input file> <output file>\n", prog);
+  printf("       %s --chunks SIZE [--state FILE] <input file> <output file>\n", prog);
+  printf("       %s -o FORMAT=PATH[,buffer=BYTES][,flush=TOKENS]... [-l] <input file>\n", prog);
+  printf("  -l, --lazy-lines  resolve line numbers from a newline index\n");
+  printf("  -b, --binary      write a binary token stream instead of text\n");
+  printf("  -z, --packed      write a packed (compressed) binary token stream\n");
+  printf("  -o, --output FORMAT=PATH  write the tokens as text, tsv, json, binary or packed\n");
+  printf("                    to PATH (may be given several times)\n");
+  printf("  --unpack          write the tokens of a packed stream as text (or -b)\n");
+  printf("  --deps[=FORMAT]   print the include dependency graph (make or json)\n");
+  printf("  -I DIR            search DIR for included files (with --deps)\n");
+  printf("  -j JOBS           number of threads (with --deps)\n");
+  printf("  -D NAME[=VALUE]   define a macro, and skip inactive #if groups\n");
+  printf("  -U NAME           undefine a macro, and skip inactive #if groups\n");
+  printf("  --serve SOCKET    serve binary token streams on a Unix domain socket\n");
+  printf("  --connect SOCKET  get the binary token stream from a server\n");
+  printf("  --stats           print the number of tokens of each kind\n");
+  printf("  --lines FIRST-LAST  only tokenize these lines, from a sidecar line index\n");
+  printf("  --chunks SIZE     read and tokenize the input SIZE bytes at a time\n");
+  printf("  --state FILE      with --chunks, save the lexer state to FILE after every\n");
+  printf("                    chunk, and resume from the state in FILE if it exists\n");
+  printf("  --isa=ISA         use the scalar, sse2, avx2 or avx512 kernels\n");
+}
+
+int
+main(int argc, char* args[]) {
+  static const struct option long_options[] = {
+    {"lazy-lines", no_argument, NULL, 'l'},
+    {"binary",     no_argument, NULL, 'b'},
+    {"packed",     no_argument, NULL, 'z'},
+    {"output",     required_argument, NULL, 'o'},
+    {"unpack",     no_argument, NULL, 'u'},
+    {"deps",       optional_argument, NULL, 'd'},
+    {"serve",      required_argument, NULL, 's'},
+    {"connect",    required_argument, NULL, 'c'},
+    {"stats",      no_argument, NULL, 't'},
+    {"lines",      required_argument, NULL, 'r'},
+    {"chunks",     required_argument, NULL, 'k'},
+    {"state",      required_argument, NULL, 'e'},
+    {"isa",        required_argument, NULL, 'x'},
+    {"help",       no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  bool lazy_lines = false;
+  bool binary = false;
+  bool packed = false;
+  bool unpacking = false;
+  bool deps = false;
+  bool stats = false;
+  int first_line = 0;
+  int last_line = 0;
+  long chunk_size = 0;
+  const char* state_filename = NULL;
+  const char* serve_socket = NULL;
+  const char* connect_socket = NULL;
+  MacroTable* macros = NULL;
+  const char* include_dirs[argc];
+  Output outputs[argc];
+  size_t outputs_count = 0;
+  DepsOptions deps_options = {
+    .include_dirs = include_dirs,
+    .include_dirs_count = 0,
+    .jobs = (int) sysconf(_SC_NPROCESSORS_ONLN),
+    .format = DEPS_MAKE
+  };
+
+  int opt = 0;
+  while ((opt = getopt_long(argc, args, "lbzho:I:j:D:U:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'l':
+        lazy_lines = true;
+        break;
+      case 'b':
+        binary = true;
+        break;
+      case 'z':
+        packed = true;
+        break;
+      case 'u':
+        unpacking = true;
+        break;
+      case 'o':
+        if (!parse_output(optarg, &outputs[outputs_count++])) {
+          print_usage(args[0]);
+          return EXIT_SUCCESS;
+        }
+        break;
+      case 'd':
+        deps = true;
+        if (optarg && !strcmp(optarg, "json")) {
+          deps_options.format = DEPS_JSON;
+        } else if (optarg && strcmp(optarg, "make")) {
+          print_usage(args[0]);
+          return EXIT_SUCCESS;
+        }
+        break;
+      case 't':
+        stats = true;
+        break;
+      case 'k':
+        chunk_size = atol(optarg);
+        if (chunk_size < 1) {
+          print_usage(args[0]);
+          return EXIT_SUCCESS;
+        }
+        break;
+      case 'e':
+        state_filename = optarg;
+        break;
+      case 'r':
+        if (sscanf(optarg, "%d-%d", &first_line, &last_line) != 2 ||
+            first_line < 1 || last_line < first_line) {
+          print_usage(args[0]);
+          return EXIT_SUCCESS;
+        }
+        break;
+      case 'x':
+        if (!isa_select(isa_parse(optarg))) {
+          fprintf(stderr, "Fatal error: %s kernels are not supported\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 's':
+        serve_socket = optarg;
+        break;
+      case 'c':
+        connect_socket = optarg;
+        break;
+      case 'I':
+        include_dirs[deps_options.include_dirs_count++] = optarg;
+        break;
+      case 'j':
+        deps_options.jobs = atoi(optarg);
+        break;
+      case 'D':
+      case 'U':
+        macros = (macros) ? macros : mtnew();
+        if (!macros || (opt == 'D' && !mtparse(macros, optarg))) {
+          perror("Fatal error");
+          return EXIT_FAILURE;
+        }
+        if (opt == 'U') {
+          mtundef(macros, optarg, strlen(optarg));
+        }
+        break;
+      default:
+        print_usage(args[0]);
+        return EXIT_SUCCESS;
+    }
+  }
+
+  int nargs = argc - optind;
+  if (serve_socket && nargs == 0) {
+    bool ok = serve(serve_socket, macros);
+    if (!ok) {
+      perror("Fatal error");
+    }
+    if (macros) {
+      mtfree(macros);
+    }
+    return (ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (connect_socket && (nargs == 1 || nargs == 2)) {
+    return connect_server(connect_socket, args[optind], (nargs == 2) ? args[optind + 1] : NULL);
+  }
+  if (deps && nargs >= 1) {
+    const char* const* inputs = (const char* const*) args + optind;
+    deps_options.macros = macros;
+    bool ok = scan_deps(inputs, nargs, &deps_options, stdout);
+    if (macros) {
+      mtfree(macros);
     }
-  } while (c != EOF);
+    return (ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (stats && nargs == 1) {
+    int status = print_stats(args[optind], lazy_lines, macros);
+    if (macros) {
+      mtfree(macros);
+    }
+    return status;
+  }
+  if (unpacking && !packed && (nargs == 1 || nargs == 2)) {
+    return unpack(args[optind], (nargs == 2) ? args[optind + 1] : NULL, binary);
+  }
+  bool lines = (first_line > 0);
+  if (chunk_size && !lines && !outputs_count && !lazy_lines && !binary && !packed && !macros &&
+      !deps && !stats && !serve_socket && !connect_socket && !unpacking &&
+      (nargs == 1 || nargs == 2)) {
+    return scan_chunked(args[optind], (nargs == 2) ? args[optind + 1] : NULL, chunk_size, state_filename);
+  }
+  if (chunk_size || state_filename || deps || stats || serve_socket || connect_socket || unpacking || (binary && packed) ||
+      (lines && (binary || packed || macros || outputs_count)) ||
+      (outputs_count && (binary || packed || nargs != 1)) || nargs < 1 || nargs > 2) {
+    print_usage(args[0]);
+    return EXIT_SUCCESS;
+  }
+
+  // Load input file from the first positional argument
+  FileReader* fr = fropen(args[optind], lazy_lines);
+  if (!fr) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+
+  // Without -o, the output file (or output.txt) is the only output
+  if (!outputs_count) {
+    Output* output = &outputs[outputs_count++];
+    output->format = sink_format((packed) ? "packed" : (binary) ? "binary" : "text");
+    output->path = (nargs == 2) ? args[optind + 1] : DEFAULT_OUTPUT_FILENAME;
+    output->policy = output->format->policy;
+  }
+
+  // Open output files
+  TokenWriter* writer = swnew(fr->buf, fr->len);
+  for (size_t i = 0; i < outputs_count; i++) {
+    if (!swadd(writer, outputs[i].format, outputs[i].path, &outputs[i].policy)) {
+      perror("Fatal error");
+      return EXIT_FAILURE;
+    }
+  }
+
+  bool scanned;
+  if (lines) {
+    LineIndex* index = liopen(args[optind], fr);
+    scanned = (index != NULL) && scan_lines(fr, index, first_line, last_line, writer);
+    if (index) {
+      lifree(index);
+    }
+  } else {
+    scanned = scan(fr, writer, macros);
+  }
+  int error = errno;
 
   // Clean up
-  fclose(fin);
-  fclose(fout);
-  free(fr);
+  bool ok = swclose(writer);
+  frclose(fr);
+  if (macros) {
+    mtfree(macros);
+  }
+  if (!scanned) {
+    errno = error;
+    ok = false;
+  }
+  if (!ok) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
 
-  printf("Output has been written to: %s\n", output_filename);
+  for (size_t i = 0; i < outputs_count; i++) {
+    printf("Output has been written to: %s\n", outputs[i].path);
+  }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,526 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Declarations shared by the scanner (scanner.c), its SIMD kernels (simd.c)
+// and structural index (index.c), conditional compilation (cond.c), the
+// include dependency extractor (deps.c), the token stream server (server.c),
+// token arrays (tokens.c), packed token streams (packed.c), line indexes
+// (lines.c) and chunked scans (chunk.c).
+
+#ifndef SCANNER_H_
+#define SCANNER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  TC_SC,   // single-line comment
+  TC_MC,   // multi-line comment
+  TC_PREP, // preprocessor directive
+  TC_SPEC, // special symbol
+  TC_REWD, // reserved word
+  TC_CHAR, // char literal
+  TC_STR,  // string literal
+  TC_FLOT, // float
+  TC_OPER, // operator
+  TC_IDEN, // identifier
+  TC_INTE, // interger literal
+  TC_UNKN, // bytes no other class accepts
+  TC_LAST
+};
+
+
+// Token flags
+enum {
+  TF_VALUE     = 1 << 0, // value holds the decoded INTE / FLOT literal
+  TF_OVERFLOW  = 1 << 1, // literal does not fit in 64 bits (INTE) or a double (FLOT)
+  TF_UNMATCHED = 1 << 2  // closing bracket without a matching opening one
+};
+
+// Types of INTE / FLOT literals, following C11 6.4.4 on LP64
+enum {
+  LT_NONE,
+  LT_INT,
+  LT_UINT,
+  LT_LONG,
+  LT_ULONG,
+  LT_LLONG,
+  LT_ULLONG,
+  LT_FLOAT,
+  LT_DOUBLE,
+  LT_LDOUBLE
+};
+
+// Directives of PREP tokens
+enum {
+  PD_NONE,    // not a PREP token, or an unknown directive
+  PD_NULL,    // "#" alone
+  PD_INCLUDE,
+  PD_DEFINE,
+  PD_UNDEF,
+  PD_IF,
+  PD_IFDEF,
+  PD_IFNDEF,
+  PD_ELIF,
+  PD_ELSE,
+  PD_ENDIF,
+  PD_LINE,
+  PD_ERROR,
+  PD_PRAGMA,
+  PD_WARNING,
+  PD_LAST
+};
+
+// A token found by one of the lexers. text is what gets printed for it,
+// which is the lexeme itself for most token classes, but the unescaped
+// content for CHAR and STR, and the directive without its backslash-newlines
+// for PREP. offset and length always locate the lexeme.
+typedef struct {
+  int kind;
+  unsigned int flags;
+  int type; // LT_* of INTE and FLOT, LT_NONE otherwise
+  int begin_line_number;
+  int end_line_number;
+  size_t offset;
+  size_t length;
+  const char* text;  // NULL if there is nothing to print
+  size_t text_length;
+  const char* error; // NULL if the token is well-formed
+  union {
+    uint64_t i;
+    double f;
+  } value;
+  int directive;      // PD_* of PREP
+  size_t args_offset; // what follows the directive name in the input,
+  size_t args_length; // e.g. <stdio.h> or X 1 (may contain \-newlines)
+} Token;
+
+#define BRACKET_NONE UINT32_MAX
+
+// An opening bracket, ( { (SPEC) or [ (OPER), and the bracket closing it,
+// by token index
+typedef struct {
+  uint32_t open;
+  uint32_t close; // BRACKET_NONE if it is never closed
+} BracketPair;
+
+// Output formats write tokens through a TokenWriter. finish (if not NULL)
+// gets the brackets of the input, one pair per opening bracket in order,
+// after the last token. write may set stop to end the scan after the
+// token it was given.
+typedef struct TokenWriter {
+  void (*write)(struct TokenWriter* self, const Token* tok);
+  FILE* fout;
+  void (*finish)(struct TokenWriter* self, const BracketPair* pairs, size_t count);
+  bool stop;
+} TokenWriter;
+
+// Name of a token class, e.g. "IDEN"
+const char* token_name(int kind);
+void write_text(TokenWriter* self, const Token* tok);
+void write_binary(TokenWriter* self, const Token* tok);
+void write_binary_header(FILE* fout);
+void write_binary_brackets(TokenWriter* self, const BracketPair* pairs, size_t count);
+
+// Packed output, a compact binary stream for archiving (packed.c). The
+// writer writes the header to fout at once; free it after the scan.
+TokenWriter* pwnew(FILE* fout);
+void pwfree(TokenWriter* self);
+
+// Decodes a packed stream one token at a time
+typedef struct PackedReader PackedReader;
+
+// NULL if fin doesn't start with a packed stream header
+PackedReader* propen(FILE* fin);
+void prclose(PackedReader* self);
+// Next token, false after the last one or if the stream is invalid. The
+// texts of tok are valid until the next call.
+bool prnext(PackedReader* self, Token* tok);
+// Brackets of the stream, once prnext() has returned false. Returns false
+// if the stream is truncated or invalid.
+bool prbrackets(const PackedReader* self, const BracketPair** pairs, size_t* count);
+
+
+// Keep track of line number in a systematic way
+//
+// The whole input is loaded into memory and the reader only moves a cursor
+// over it. By default line_number is maintained on every frgetc()/frungetc().
+// In lazy mode the reader tracks nothing but the byte offset; line numbers
+// are resolved on demand by frlineno(), which binary searches an index of
+// newline offsets built in a single pass when the file is opened.
+typedef struct {
+  char* buf;
+  size_t len;
+  size_t pos;
+  int line_number;
+  bool lazy_lines;
+  size_t* newlines; // offsets of all newline chars (lazy mode only)
+  size_t newlines_count;
+  int eof_reads;    // EOFs returned by frgetc() and not pushed back yet
+} FileReader;
+
+// Longest input fropen() reads: offsets and lengths are 32-bit in token
+// arrays and binary token streams. (Scan longer inputs with scan_chunk().)
+#define FR_MAX_LENGTH UINT32_MAX
+
+// NULL (with errno set, EFBIG if it is longer than FR_MAX_LENGTH) if
+// filename can't be read
+FileReader* fropen(const char* filename, bool lazy_lines);
+void frclose(FileReader* self);
+int frlineno(const FileReader* self);
+char frgetc(FileReader* self);
+char* frgets(FileReader* self, char* buf, size_t size);
+void frungetc(FileReader* self, char c);
+void frungets(FileReader* self, const char* s);
+void frseek(FileReader* self, size_t offset);
+// Move the cursor to offset, where the line number is known to be
+// line_number (unlike frseek(), without counting the newlines in between)
+void frjump(FileReader* self, size_t offset, int line_number);
+// Advance over the whitespace at the cursor, if any
+void frskipws(FileReader* self);
+// Advance over n chars, none of which is a newline
+void frskip(FileReader* self, size_t n);
+
+// Instruction sets the kernels are compiled for (simd.c)
+enum {
+  ISA_SCALAR,
+  ISA_SSE2,
+  ISA_AVX2,
+  ISA_AVX512, // AVX-512F and AVX-512BW
+  ISA_LAST
+};
+
+// Bits of the chars of a block of 64 bytes which may open or close a
+// literal, a comment or a directive
+typedef struct {
+  uint64_t quotes;      // "
+  uint64_t apostrophes; // '
+  uint64_t backslashes;
+  uint64_t slashes;
+  uint64_t stars;
+  uint64_t hashes;
+  uint64_t newlines;    // '\r' or '\n'
+} StructuralMasks;
+
+// Kernels of the selected instruction set
+typedef struct {
+  // Bit i is set if block[i] is '\r' or '\n', for a block of 64 bytes
+  uint64_t (*newline_mask)(const char* block);
+  // Bit i is set if block[i] is whitespace (' ', '\t', '\r' or '\n'), and
+  // in *newlines if it is '\r' or '\n'
+  uint64_t (*whitespace_mask)(const char* block, uint64_t* newlines);
+  void (*structural_masks)(const char* block, StructuralMasks* masks);
+  // Bit i is the xor of bits 0..i of bits
+  uint64_t (*prefix_xor)(uint64_t bits);
+  // Bit i is set if block[i] is a letter, a digit or _
+  uint64_t (*iden_mask)(const char* block);
+  // Bit i is set if block[i] is a decimal digit
+  uint64_t (*digit_mask)(const char* block);
+} Kernels;
+
+extern Kernels kernels;
+
+bool isa_supported(int isa);
+// Best instruction set of this CPU, which is selected at startup
+int isa_detect(void);
+// Switch the kernels to isa, false if the CPU doesn't support it
+bool isa_select(int isa);
+int isa_selected(void);
+// ISA_* of a name like "avx2", -1 if unknown
+int isa_parse(const char* name);
+const char* isa_name(int isa);
+
+// Offset of the first # at or after pos which is outside literals and
+// comments, where scan() would find the next PREP token, or len. pos must
+// be outside literals and comments (structural index, index.c).
+size_t next_directive(const char* buf, size_t len, size_t pos);
+
+// Macros known to #if and #ifdef (cond.c)
+typedef struct MacroTable MacroTable;
+
+// NULL if it can't be allocated
+MacroTable* mtnew(void);
+MacroTable* mtclone(const MacroTable* self);
+void mtfree(MacroTable* self);
+// False if it runs out of memory
+bool mtdefine(MacroTable* self, const char* name, size_t name_length,
+              const char* value, size_t value_length, bool function_like);
+void mtundef(MacroTable* self, const char* name, size_t name_length);
+bool mtdefined(const MacroTable* self, const char* name, size_t name_length);
+bool mtparse(MacroTable* self, const char* definition);
+bool mteval(const MacroTable* self, const char* expr, size_t n, int64_t* value);
+
+// Nesting of conditional groups in a file
+typedef struct {
+  MacroTable* macros;
+  unsigned char* groups; // GROUP_* flags of each open group
+  size_t depth;
+  size_t capacity;
+  bool failed;           // out of memory
+} Conditionals;
+
+void cdinit(Conditionals* self, MacroTable* macros);
+void cdfree(Conditionals* self);
+// Follow the directive of a PREP token. Returns true if the lines after it
+// are in an inactive group, sets *error if the directive is misplaced, and
+// sets failed if it runs out of memory.
+bool cddirective(Conditionals* self, const char* buf, const Token* tok,
+                 const char** error);
+// Offset of the # of the directive which ends the group starting after
+// pos, where pos is on the line of the directive opening the group or at
+// the beginning of the next line
+size_t skip_group(const char* buf, size_t len, size_t pos);
+
+// Recognizes the include guard of a file from its tokens
+typedef struct {
+  int state;
+  size_t depth;         // of #if groups within the guard
+  const char* macro;    // guard macro, in the input
+  size_t macro_length;
+  bool once;            // #pragma once
+} GuardDetector;
+
+void gdinit(GuardDetector* self);
+void gdtoken(GuardDetector* self, const char* buf, const Token* tok);
+// Length of the guard macro (set to *macro) once all tokens have been
+// seen, 0 if the file isn't guarded
+size_t gdguard(const GuardDetector* self, const char** macro);
+
+
+// Tokenize the whole input, passing every token to tw. With macros, the
+// inactive groups of conditional directives are skipped. Brackets are
+// matched on the way and passed to tw->finish. Returns false (with errno
+// set) if it runs out of memory, which ends the scan without calling finish.
+bool scan(FileReader* fr, TokenWriter* tw, MacroTable* macros);
+// Like scan(), but only the directives and the first token after each are
+// lexed; the rest is skipped with next_directive(). Brackets are not matched.
+bool scan_directives(FileReader* fr, TokenWriter* tw, MacroTable* macros);
+
+
+// A checkpoint of the lexer is kept every LI_INTERVAL lines
+#define LI_INTERVAL 1024
+
+// What the lexer is in the middle of at the beginning of a line
+enum {
+  LM_CODE, // nothing, the line begins between tokens
+  LM_MC,   // a /* comment
+  LM_STR,  // a string literal continued with backslash-newline
+  LM_CHAR, // a char literal continued with backslash-newline
+  LM_PREP  // a directive continued with backslash-newline
+};
+
+// LM_* of a token of kind which goes on after a line break
+int token_mode(int kind);
+
+typedef struct {
+  int line;        // 1, LI_INTERVAL + 1, 2 * LI_INTERVAL + 1, ...
+  int mode;        // LM_* at the beginning of line
+  size_t offset;   // where scanning resumes: after the last token which
+  int offset_line; // ends before line, and the line number there
+} LineCheckpoint;
+
+// Lexer checkpoints of an input, so that the tokens of a range of lines
+// can be scanned without scanning the lines before (lines.c)
+typedef struct {
+  LineCheckpoint* checkpoints;
+  size_t count;
+  bool lazy_lines;       // of the FileReader it was built with
+  uint64_t input_size;   // of the input file it was built for
+  int64_t input_mtime;   // in nanoseconds
+} LineIndex;
+
+// Scan the whole input of fr for its checkpoints, NULL (with errno set) if
+// it runs out of memory
+LineIndex* libuild(FileReader* fr);
+// The sidecar index of filename (filename.lines), read from disk, or built
+// from fr and saved if it's missing or stale. NULL if it can't be built.
+LineIndex* liopen(const char* filename, FileReader* fr);
+void lifree(LineIndex* self);
+// Tokenize lines first..last only: tw gets the tokens beginning on them,
+// scanned from the nearest checkpoint. Brackets are not matched (and no
+// closer is flagged TF_UNMATCHED). False (with errno set) if it runs out of
+// memory.
+bool scan_lines(FileReader* fr, const LineIndex* index, int first, int last, TokenWriter* tw);
+
+
+// State of a scan between two chunks of its input (chunk.c)
+typedef struct {
+  uint64_t offset;       // where the scan resumes, in the whole input
+  int line_number;       // at offset
+  int mode;              // LM_* of the token in progress at offset
+  uint64_t token_offset; // where the token in progress (or the next one)
+  int token_line;        // begins, and its begin line
+} LexerState;
+
+#define LS_ENCODED_SIZE 26
+
+// State at the beginning of an input
+void lsinit(LexerState* self);
+// Serialize a state into LS_ENCODED_SIZE bytes, and back. lsdecode()
+// returns false if buf doesn't hold a state.
+void lsencode(const LexerState* self, unsigned char* buf);
+bool lsdecode(LexerState* self, const unsigned char* buf);
+
+// Scan the next chunk of an input: buf holds its bytes from state->offset
+// on, and last is true if they run to its end. tw gets the tokens which
+// are complete, with offsets in the whole input, and the state is advanced
+// past them. Returns the number of bytes of buf used; the next call needs
+// the rest, followed by the next chunk, or SIZE_MAX (with errno set) if it
+// runs out of memory. Brackets are not matched (and no closer is flagged
+// TF_UNMATCHED).
+size_t scan_chunk(const char* buf, size_t len, bool last, LexerState* state, TokenWriter* tw);
+
+// Push-mode scanner for inputs which arrive a chunk at a time (chunk.c).
+// callback gets each token as soon as it is complete, with offsets in the
+// whole input; the token and its text are only valid during the call.
+typedef struct Scanner Scanner;
+typedef void (*TokenCallback)(const Token* tok, void* data);
+
+Scanner* scanner_new(TokenCallback callback, void* data);
+void scanner_free(Scanner* self);
+// Scan the next len bytes of the input, as far as its tokens are complete.
+// Returns false (with errno set) if they can't be buffered, and the scanner
+// is unchanged then, or if it runs out of memory while scanning them.
+bool scanner_feed(Scanner* self, const char* buf, size_t len);
+// Scan the rest, at the end of the input. False (with errno set) if it runs
+// out of memory.
+bool scanner_finish(Scanner* self);
+
+
+// Begin line of every TA_CHECKPOINT-th token is kept in a TokenArray
+#define TA_CHECKPOINT 256
+
+// Field that few tokens have: token indices (increasing) and their values
+typedef struct {
+  size_t* indices;
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} SparseColumn;
+
+// Tokens of a whole input as parallel arrays, one per field (tokens.c)
+typedef struct {
+  size_t count;
+  size_t capacity;
+  uint8_t* kinds;          // TC_*
+  uint8_t* flags;          // TF_*
+  uint8_t* types;          // LT_*
+  uint32_t* offsets;       // of the lexemes in the input
+  uint32_t* lengths;
+  uint16_t* line_deltas;   // begin line - begin line of the previous token
+  uint32_t* matches;       // index of the matching bracket, or BRACKET_NONE
+  int* checkpoints;
+  SparseColumn lines;      // begin lines whose delta doesn't fit
+  SparseColumn end_lines;  // of tokens spanning several lines
+  SparseColumn values;     // of tokens with TF_VALUE
+  SparseColumn errors;     // error messages
+  int last_line;
+} TokenArray;
+
+// Walks a TokenArray in order, decoding line numbers on the way
+typedef struct {
+  const TokenArray* array;
+  size_t index;
+  int line;                // begin line of the token at index
+  size_t escape;           // next entry of array->lines
+} TokenCursor;
+
+TokenArray* tanew(void);
+void tafree(TokenArray* self);
+// False if the array can't grow; it is only fit for tafree() then
+bool taappend(TokenArray* self, const Token* tok);
+// Tokenize the whole input into a new TokenArray, NULL (with errno set) if
+// it runs out of memory
+TokenArray* tascan(FileReader* fr, MacroTable* macros);
+int taline(const TokenArray* self, size_t i);
+int taendline(const TokenArray* self, size_t i);
+bool tavalue(const TokenArray* self, size_t i, uint64_t* value);
+const char* taerror(const TokenArray* self, size_t i);
+// Index of the bracket matching token i, count if there is none
+size_t tamatch(const TokenArray* self, size_t i);
+// Index of the first token of kind at or after from, count if none
+size_t tafind(const TokenArray* self, int kind, size_t from);
+size_t tacount(const TokenArray* self, int kind);
+// Cursor before the first token; tanext() moves it, false at the end
+TokenCursor tacursor(const TokenArray* self);
+bool tanext(TokenCursor* self);
+
+
+// Tokens are delivered to a BatchWriter callback up to TOKEN_BATCH_SIZE at
+// a time
+#define TOKEN_BATCH_SIZE 4096
+
+// tokens and their texts are only valid during the call
+typedef void (*BatchCallback)(const Token* tokens, size_t count, void* data);
+
+// A TokenWriter which buffers the tokens of a scan of input and passes
+// them on to callback in batches. finish delivers the last batch (brackets
+// are dropped); after scans which don't call finish, call bwflush().
+TokenWriter* bwnew(const char* input, size_t input_length, BatchCallback callback, void* data);
+void bwflush(TokenWriter* self);
+void bwfree(TokenWriter* self);
+
+
+// Output sinks (sinks.c): the tokens of one scan written in several formats
+// at once, each to a file of its own
+
+// Buffering and flushing of the file of a sink
+typedef struct {
+  size_t buffer_size;  // of the stdio buffer, 0 for the default
+  size_t flush_tokens; // flush after every so many tokens, 0 only at the end
+} SinkPolicy;
+
+typedef struct {
+  const char* name;    // text, tsv, json, binary or packed
+  bool binary;         // the file is opened in binary mode
+  SinkPolicy policy;   // default policy
+  // open writes the header of the format to fout, close its trailer (but
+  // doesn't close fout) and frees the writer
+  TokenWriter* (*open)(FILE* fout);
+  void (*close)(TokenWriter* self);
+} SinkFormat;
+
+// NULL if there is no format of this name
+const SinkFormat* sink_format(const char* name);
+
+// A TokenWriter which passes the tokens of a scan of input on to all of its
+// sinks, a batch at a time (see bwnew()). swadd() opens path and returns
+// false (with errno set) if it can't, or can't allocate the sink; policy
+// may be NULL for the default of the format. swclose() delivers the last batch, closes the sinks and frees
+// the writer, and returns false if writing any of them failed.
+TokenWriter* swnew(const char* input, size_t input_length);
+bool swadd(TokenWriter* self, const SinkFormat* format, const char* path, const SinkPolicy* policy);
+bool swclose(TokenWriter* self);
+
+
+// Dependency graph output formats
+enum {
+  DEPS_MAKE, // Makefile rules, like "cc -M"
+  DEPS_JSON
+};
+
+typedef struct {
+  const char** include_dirs; // -I search paths, in order
+  size_t include_dirs_count;
+  int jobs;                  // number of worker threads
+  int format;                // DEPS_*
+  const MacroTable* macros;  // -D/-U, NULL to follow every #include
+} DepsOptions;
+
+// Follow the #include directives of the given files recursively and write
+// the dependency graph to fout. Returns false if an input can't be read.
+bool scan_deps(const char* const* inputs, size_t inputs_count,
+               const DepsOptions* opts, FILE* fout);
+
+
+// Serve binary token streams on a Unix domain socket until SIGINT/SIGTERM.
+// Returns false if the socket can't be set up.
+bool serve(const char* socket_path, const MacroTable* macros);
+
+// Binary token stream of filename from the server at socket_path, mapped
+// read-only (size bytes), or NULL. Unmap it with release_tokens().
+const void* request_tokens(const char* socket_path, const char* filename, size_t* size);
+void release_tokens(const void* tokens, size_t size);
+
+#endif  // SCANNER_H_
@@ -0,0 +1,411 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// server.c lets several tools share the tokens of the same files without
+// each of them running the scanner (scanner --serve / --connect).
+//
+// The server listens on a Unix domain socket, and only serves clients of
+// its own user (checked with SO_PEERCRED), since it reads files with its
+// own permissions. A client sends one request line, "LEX <absolute path>\n",
+// and the server answers "OK <size>\n" or "ERR <message>\n". With OK, it
+// passes a file descriptor (SCM_RIGHTS) of a sealed memfd holding the
+// binary token stream (see write_binary() in scanner.c) of the file, which
+// the client maps read-only, so the tokens are never copied on their way to
+// it. The memfd has no name anyone else could open, and the seals keep
+// clients from changing it.
+//
+// Token streams are cached by the 64-bit FNV-1a hash and the length of the
+// file content, and a hit is compared with the content, so a file is only
+// lexed again after it has changed, and identical files share one stream.
+// The cache keeps the CACHE_MAX_ENTRIES most recently used streams; an
+// evicted memfd is closed, which doesn't affect clients that have already
+// received it.
+//
+// Requests are served one at a time, so a client which doesn't send its
+// request (or read the answer) within REQUEST_TIMEOUT_SEC seconds is
+// dropped. SIGINT or SIGTERM stops the server, which then removes its
+// socket.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "scanner.h"
+
+#define CACHE_MAX_ENTRIES 64
+#define REQUEST_MAX_LEN (PATH_MAX + 16)
+#define RESPONSE_MAX_LEN 128
+#define REQUEST_TIMEOUT_SEC 5
+
+typedef struct {
+  uint64_t hash;
+  size_t length;      // of the file content
+  char* content;      // to tell hash collisions apart
+  int fd;             // sealed memfd of the token stream, -1 if the entry is empty
+  size_t size;        // of the token stream
+  uint64_t last_used;
+} CacheEntry;
+
+typedef struct {
+  const MacroTable* macros;
+  CacheEntry entries[CACHE_MAX_ENTRIES];
+  uint64_t clock;
+} Cache;
+
+static volatile sig_atomic_t stopping = 0;
+
+
+static void
+on_stop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+static uint64_t
+hash_content(const char* buf, size_t len) {
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) buf[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static bool
+sockaddr_of(const char* socket_path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr->sun_path, socket_path);
+  return true;
+}
+
+// Read a line of at most size - 1 chars (without the newline)
+static bool
+read_line(int fd, char* buf, size_t size) {
+  size_t n = 0;
+  char c = 0x00;
+  while (n + 1 < size) {
+    ssize_t r = read(fd, &c, 1);
+    if (r <= 0) {
+      return false;
+    } else if (c == '\n') {
+      buf[n] = 0x00;
+      return true;
+    }
+    buf[n++] = c;
+  }
+  return false;
+}
+
+static bool
+write_all(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w <= 0) {
+      return false;
+    }
+    buf += w;
+    n -= w;
+  }
+  return true;
+}
+
+// Write response, passing fd along with it unless it is -1
+static bool
+send_response(int client, const char* response, int fd) {
+  size_t n = strlen(response);
+  struct iovec iov = { .iov_base = (void*) response, .iov_len = n };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  if (fd != -1) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  ssize_t w = sendmsg(client, &msg, 0);
+  return w >= 0 && write_all(client, response + w, n - w);
+}
+
+// Read the response line (like read_line()) and the file descriptor passed
+// with it into *fd, or -1 if there is none
+static bool
+receive_response(int server, char* buf, size_t size, int* fd) {
+  size_t n = 0;
+  *fd = -1;
+  while (n + 1 < size) {
+    struct iovec iov = { .iov_base = buf + n, .iov_len = size - 1 - n };
+    union {
+      struct cmsghdr header;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t r = recvmsg(server, &msg, MSG_CMSG_CLOEXEC);
+    if (r <= 0) {
+      return false;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && *fd == -1) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+    char* newline = memchr(buf + n, '\n', r);
+    n += r;
+    if (newline) {
+      *newline = 0x00;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the client runs as the user of the server
+static bool
+is_own_user(int client) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+
+// Lex fr into a new sealed memfd of entry. Returns false, with errno set,
+// if it can't be made.
+static bool
+lex_into(const Cache* cache, FileReader* fr, CacheEntry* entry) {
+  char* stream = NULL;
+  size_t size = 0;
+  FILE* fout = open_memstream(&stream, &size);
+  if (!fout) {
+    return false;
+  }
+
+  TokenWriter tw = {
+    .write = write_binary,
+    .fout = fout,
+    .finish = write_binary_brackets
+  };
+  write_binary_header(fout);
+  MacroTable* macros = (cache->macros) ? mtclone(cache->macros) : NULL;
+  bool scanned = scan(fr, &tw, macros);
+  if (macros) {
+    mtfree(macros);
+  }
+  fclose(fout);
+  if (!scanned) {
+    free(stream);
+    errno = ENOMEM;
+    return false;
+  }
+
+  int fd = memfd_create("scanner-tokens", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  bool ok = (fd != -1 && write_all(fd, stream, size) &&
+             fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0);
+  int error = errno;
+  if (!ok && fd != -1) {
+    close(fd);
+  }
+  free(stream);
+  entry->fd = (ok) ? fd : -1;
+  entry->size = size;
+  errno = error;
+  return ok;
+}
+
+// Token stream of filename, lexing it if it isn't cached. Returns NULL and
+// sets *error (an errno) if it can't.
+static const CacheEntry*
+lookup(Cache* cache, const char* filename, int* error) {
+  FileReader* fr = fropen(filename, false);
+  if (!fr) {
+    *error = errno;
+    return NULL;
+  }
+  uint64_t hash = hash_content(fr->buf, fr->len);
+
+  CacheEntry* victim = &cache->entries[0];
+  for (size_t i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->fd != -1 && entry->hash == hash && entry->length == fr->len &&
+        !memcmp(entry->content, fr->buf, fr->len)) {
+      entry->last_used = ++cache->clock;
+      frclose(fr);
+      return entry;
+    }
+    if (entry->fd == -1 || (victim->fd != -1 && entry->last_used < victim->last_used)) {
+      victim = entry;
+    }
+  }
+
+  // Cache miss, replacing the least recently used entry once the stream is
+  // made
+  CacheEntry fresh = {
+    .hash = hash,
+    .length = fr->len,
+    .content = malloc(fr->len + 1),
+    .fd = -1,
+    .last_used = ++cache->clock
+  };
+  if (!fresh.content || !lex_into(cache, fr, &fresh)) {
+    *error = (fresh.content) ? errno : ENOMEM;
+    free(fresh.content);
+    frclose(fr);
+    return NULL;
+  }
+  memcpy(fresh.content, fr->buf, fr->len);
+  frclose(fr);
+  if (victim->fd != -1) {
+    close(victim->fd);
+    free(victim->content);
+  }
+  *victim = fresh;
+  return victim;
+}
+
+static void
+handle(Cache* cache, int client) {
+  char request[REQUEST_MAX_LEN];
+  char response[RESPONSE_MAX_LEN];
+  int fd = -1;
+
+  if (!read_line(client, request, sizeof(request)) || strncmp(request, "LEX ", 4)) {
+    snprintf(response, sizeof(response), "ERR bad request\n");
+  } else if (!is_own_user(client)) {
+    snprintf(response, sizeof(response), "ERR %s\n", strerror(EACCES));
+  } else {
+    int error = 0;
+    const CacheEntry* entry = lookup(cache, request + 4, &error);
+    if (entry) {
+      snprintf(response, sizeof(response), "OK %zu\n", entry->size);
+      fd = entry->fd;
+    } else {
+      snprintf(response, sizeof(response), "ERR %s\n", strerror(error));
+    }
+  }
+  send_response(client, response, fd);
+}
+
+bool serve(const char* socket_path, const MacroTable* macros) {
+  struct sockaddr_un addr;
+  if (!sockaddr_of(socket_path, &addr)) {
+    return false;
+  }
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server == -1) {
+    return false;
+  }
+  unlink(socket_path);
+  if (bind(server, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(server, 16) == -1) {
+    close(server);
+    return false;
+  }
+
+  // Without SA_RESTART, so that accept() returns when stopping
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  Cache* cache = calloc(1, sizeof(Cache));
+  cache->macros = macros;
+  for (size_t i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    cache->entries[i].fd = -1;
+  }
+  struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_SEC, .tv_usec = 0 };
+  while (!stopping) {
+    int client = accept(server, NULL, NULL);
+    if (client == -1) {
+      continue;
+    }
+    // A slow client mustn't hold up the others
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    handle(cache, client);
+    close(client);
+  }
+
+  // Clean up
+  for (size_t i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    if (cache->entries[i].fd != -1) {
+      close(cache->entries[i].fd);
+      free(cache->entries[i].content);
+    }
+  }
+  free(cache);
+  close(server);
+  unlink(socket_path);
+  return true;
+}
+
+
+const void* request_tokens(const char* socket_path, const char* filename, size_t* size) {
+  char path[PATH_MAX];
+  struct sockaddr_un addr;
+  if (!realpath(filename, path) || !sockaddr_of(socket_path, &addr)) {
+    return NULL;
+  }
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server == -1) {
+    return NULL;
+  }
+  if (connect(server, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+    close(server);
+    return NULL;
+  }
+
+  char request[REQUEST_MAX_LEN];
+  char response[RESPONSE_MAX_LEN];
+  snprintf(request, sizeof(request), "LEX %s\n", path);
+  int fd = -1;
+  bool ok = write_all(server, request, strlen(request)) &&
+            receive_response(server, response, sizeof(response), &fd);
+  close(server);
+
+  if (!ok || fd == -1 || sscanf(response, "OK %zu", size) != 1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    errno = EPROTO;
+    return NULL;
+  }
+
+  const void* tokens = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return (tokens == MAP_FAILED) ? NULL : tokens;
+}
+
+void release_tokens(const void* tokens, size_t size) {
+  munmap((void*) tokens, size);
+}
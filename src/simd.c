@@ -0,0 +1,491 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// simd.c holds the kernels which classify the bytes of the input in blocks
+// (finding newlines, whitespace, ...), compiled once per instruction set so
+// that one binary runs fast on old and new x86 machines alike.
+//
+// The structural kernels serve the structural index (index.c): bitmaps of
+// the chars which open or close literals and comments, and the prefix xor
+// which turns the quotes of a block into the inside of its string literals.
+// The prefix xor is a carry-less multiplication by all ones where the CPU
+// has one (every CPU with AVX2), six shifts otherwise.
+//
+// Every variant of a kernel is an ordinary function built with a target
+// attribute, so no special compiler flags are needed. The kernels table
+// points to the variants of one instruction set: the best one the CPU
+// supports, detected with cpuid before main() runs, or the one selected
+// with isa_select() (scanner --isa=NAME, for benchmarking). Kernels are
+// only called through the table, once per block of 64 bytes.
+//
+// On other architectures, or compilers without target attributes, only the
+// scalar variants exist.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scanner.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+static const char* const isa_names[ISA_LAST] = {
+  [ISA_SCALAR] = "scalar",
+  [ISA_SSE2]   = "sse2",
+  [ISA_AVX2]   = "avx2",
+  [ISA_AVX512] = "avx512"
+};
+
+
+// Scalar variants
+static uint64_t
+newline_mask_scalar(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i++) {
+    mask |= (uint64_t) (block[i] == '\r' || block[i] == '\n') << i;
+  }
+  return mask;
+}
+
+static uint64_t
+whitespace_mask_scalar(const char* block, uint64_t* newlines) {
+  uint64_t mask = 0;
+  uint64_t newline_mask = 0;
+  for (int i = 0; i < 64; i++) {
+    char c = block[i];
+    newline_mask |= (uint64_t) (c == '\r' || c == '\n') << i;
+    mask |= (uint64_t) (c == ' ' || c == '\t' || c == '\r' || c == '\n') << i;
+  }
+  *newlines = newline_mask;
+  return mask;
+}
+
+static void
+structural_masks_scalar(const char* block, StructuralMasks* masks) {
+  StructuralMasks m = {0};
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = (uint64_t) 1 << i;
+    switch (block[i]) {
+      case '"':  m.quotes |= bit; break;
+      case '\'': m.apostrophes |= bit; break;
+      case '\\': m.backslashes |= bit; break;
+      case '/':  m.slashes |= bit; break;
+      case '*':  m.stars |= bit; break;
+      case '#':  m.hashes |= bit; break;
+      case '\r':
+      case '\n': m.newlines |= bit; break;
+    }
+  }
+  *masks = m;
+}
+
+static uint64_t
+iden_mask_scalar(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i++) {
+    char c = block[i];
+    bool iden = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                c == '_';
+    mask |= (uint64_t) iden << i;
+  }
+  return mask;
+}
+
+static uint64_t
+digit_mask_scalar(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i++) {
+    mask |= (uint64_t) (block[i] >= '0' && block[i] <= '9') << i;
+  }
+  return mask;
+}
+
+static uint64_t
+prefix_xor_scalar(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+
+#ifdef SIMD_X86
+// SSE2 variants, 4 x 16 bytes
+__attribute__((target("sse2")))
+static uint64_t
+newline_mask_sse2(const char* block) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (block + i));
+    uint64_t bits = (unsigned int) _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+    mask |= bits << i;
+  }
+  return mask;
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+whitespace_mask_sse2(const char* block, uint64_t* newlines) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  uint64_t mask = 0;
+  uint64_t newline_mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (block + i));
+    __m128i newline = _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf));
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab));
+    newline_mask |= (uint64_t) (unsigned int) _mm_movemask_epi8(newline) << i;
+    mask |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_or_si128(newline, blank)) << i;
+  }
+  *newlines = newline_mask;
+  return mask;
+}
+
+// Bits of the bytes of the 4 chunks of a block equal to c
+__attribute__((target("sse2")))
+static uint64_t
+match_sse2(const __m128i* chunks, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    uint64_t bits = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], needle));
+    mask |= bits << (i * 16);
+  }
+  return mask;
+}
+
+__attribute__((target("sse2")))
+static void
+structural_masks_sse2(const char* block, StructuralMasks* masks) {
+  __m128i chunks[4];
+  for (int i = 0; i < 4; i++) {
+    chunks[i] = _mm_loadu_si128((const __m128i*) (block + i * 16));
+  }
+  masks->quotes = match_sse2(chunks, '"');
+  masks->apostrophes = match_sse2(chunks, '\'');
+  masks->backslashes = match_sse2(chunks, '\\');
+  masks->slashes = match_sse2(chunks, '/');
+  masks->stars = match_sse2(chunks, '*');
+  masks->hashes = match_sse2(chunks, '#');
+  masks->newlines = match_sse2(chunks, '\r') | match_sse2(chunks, '\n');
+}
+
+// 0xff in each byte of chunk between lo and hi (unsigned), inclusive
+__attribute__((target("sse2")))
+static __m128i
+in_range_sse2(__m128i chunk, char lo, char hi) {
+  __m128i offset = _mm_sub_epi8(chunk, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(hi - lo)), offset);
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+iden_mask_sse2(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (block + i));
+    __m128i letter = in_range_sse2(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i digit = in_range_sse2(chunk, '0', '9');
+    __m128i underscore = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_'));
+    __m128i iden = _mm_or_si128(_mm_or_si128(letter, digit), underscore);
+    mask |= (uint64_t) (unsigned int) _mm_movemask_epi8(iden) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+digit_mask_sse2(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (block + i));
+    mask |= (uint64_t) (unsigned int) _mm_movemask_epi8(in_range_sse2(chunk, '0', '9')) << i;
+  }
+  return mask;
+}
+
+// AVX2 variants, 2 x 32 bytes
+__attribute__((target("avx2")))
+static uint64_t
+newline_mask_avx2(const char* block) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  __m256i lo = _mm256_loadu_si256((const __m256i*) block);
+  __m256i hi = _mm256_loadu_si256((const __m256i*) (block + 32));
+  uint64_t lo_bits = (unsigned int) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, cr), _mm256_cmpeq_epi8(lo, lf)));
+  uint64_t hi_bits = (unsigned int) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, cr), _mm256_cmpeq_epi8(hi, lf)));
+  return lo_bits | (hi_bits << 32);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+whitespace_mask_avx2(const char* block, uint64_t* newlines) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  uint64_t mask = 0;
+  uint64_t newline_mask = 0;
+  for (int i = 0; i < 64; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (block + i));
+    __m256i newline = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf));
+    __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab));
+    newline_mask |= (uint64_t) (unsigned int) _mm256_movemask_epi8(newline) << i;
+    mask |= (uint64_t) (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(newline, blank)) << i;
+  }
+  *newlines = newline_mask;
+  return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+match_avx2(__m256i lo, __m256i hi, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  uint64_t lo_bits = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+  uint64_t hi_bits = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+  return lo_bits | (hi_bits << 32);
+}
+
+__attribute__((target("avx2")))
+static void
+structural_masks_avx2(const char* block, StructuralMasks* masks) {
+  __m256i lo = _mm256_loadu_si256((const __m256i*) block);
+  __m256i hi = _mm256_loadu_si256((const __m256i*) (block + 32));
+  masks->quotes = match_avx2(lo, hi, '"');
+  masks->apostrophes = match_avx2(lo, hi, '\'');
+  masks->backslashes = match_avx2(lo, hi, '\\');
+  masks->slashes = match_avx2(lo, hi, '/');
+  masks->stars = match_avx2(lo, hi, '*');
+  masks->hashes = match_avx2(lo, hi, '#');
+  masks->newlines = match_avx2(lo, hi, '\r') | match_avx2(lo, hi, '\n');
+}
+
+__attribute__((target("avx2")))
+static __m256i
+in_range_avx2(__m256i chunk, char lo, char hi) {
+  __m256i offset = _mm256_sub_epi8(chunk, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(hi - lo)), offset);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+iden_mask_avx2(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (block + i));
+    __m256i letter = in_range_avx2(_mm256_or_si256(chunk, _mm256_set1_epi8(0x20)), 'a', 'z');
+    __m256i digit = in_range_avx2(chunk, '0', '9');
+    __m256i underscore = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('_'));
+    __m256i iden = _mm256_or_si256(_mm256_or_si256(letter, digit), underscore);
+    mask |= (uint64_t) (unsigned int) _mm256_movemask_epi8(iden) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+digit_mask_avx2(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (block + i));
+    mask |= (uint64_t) (unsigned int) _mm256_movemask_epi8(in_range_avx2(chunk, '0', '9')) << i;
+  }
+  return mask;
+}
+
+// Carry-less multiplication by all ones: bit i of the product is the xor
+// of bits 0..i
+__attribute__((target("pclmul,sse2")))
+static uint64_t
+prefix_xor_clmul(uint64_t bits) {
+  __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, bits), _mm_set1_epi8(-1), 0);
+  uint64_t low = 0;
+  _mm_storel_epi64((__m128i*) &low, product);
+  return low;
+}
+
+// AVX-512 variants, the whole block at once
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+newline_mask_avx512(const char* block) {
+  __m512i chunk = _mm512_loadu_si512((const void*) block);
+  return _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\r')) |
+         _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n'));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+whitespace_mask_avx512(const char* block, uint64_t* newlines) {
+  __m512i chunk = _mm512_loadu_si512((const void*) block);
+  uint64_t newline_mask = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\r')) |
+                          _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n'));
+  *newlines = newline_mask;
+  return newline_mask |
+         _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(' ')) |
+         _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\t'));
+}
+
+// Bits of the bytes of chunk between lo and hi (unsigned), inclusive
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+in_range_avx512(__m512i chunk, char lo, char hi) {
+  return _mm512_cmple_epu8_mask(_mm512_sub_epi8(chunk, _mm512_set1_epi8(lo)),
+                                _mm512_set1_epi8(hi - lo));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+iden_mask_avx512(const char* block) {
+  __m512i chunk = _mm512_loadu_si512((const void*) block);
+  return in_range_avx512(_mm512_or_si512(chunk, _mm512_set1_epi8(0x20)), 'a', 'z') |
+         in_range_avx512(chunk, '0', '9') |
+         _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('_'));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+digit_mask_avx512(const char* block) {
+  return in_range_avx512(_mm512_loadu_si512((const void*) block), '0', '9');
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+structural_masks_avx512(const char* block, StructuralMasks* masks) {
+  __m512i chunk = _mm512_loadu_si512((const void*) block);
+  masks->quotes = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('"'));
+  masks->apostrophes = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\''));
+  masks->backslashes = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\\'));
+  masks->slashes = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('/'));
+  masks->stars = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('*'));
+  masks->hashes = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('#'));
+  masks->newlines = _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\r')) |
+                    _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8('\n'));
+}
+#endif
+
+
+static const Kernels isa_kernels[ISA_LAST] = {
+  [ISA_SCALAR] = {
+    .newline_mask = newline_mask_scalar,
+    .whitespace_mask = whitespace_mask_scalar,
+    .structural_masks = structural_masks_scalar,
+    .prefix_xor = prefix_xor_scalar,
+    .iden_mask = iden_mask_scalar,
+    .digit_mask = digit_mask_scalar
+  },
+#ifdef SIMD_X86
+  [ISA_SSE2] = {
+    .newline_mask = newline_mask_sse2,
+    .whitespace_mask = whitespace_mask_sse2,
+    .structural_masks = structural_masks_sse2,
+    .prefix_xor = prefix_xor_scalar,
+    .iden_mask = iden_mask_sse2,
+    .digit_mask = digit_mask_sse2
+  },
+  [ISA_AVX2] = {
+    .newline_mask = newline_mask_avx2,
+    .whitespace_mask = whitespace_mask_avx2,
+    .structural_masks = structural_masks_avx2,
+    .prefix_xor = prefix_xor_clmul,
+    .iden_mask = iden_mask_avx2,
+    .digit_mask = digit_mask_avx2
+  },
+  [ISA_AVX512] = {
+    .newline_mask = newline_mask_avx512,
+    .whitespace_mask = whitespace_mask_avx512,
+    .structural_masks = structural_masks_avx512,
+    .prefix_xor = prefix_xor_clmul,
+    .iden_mask = iden_mask_avx512,
+    .digit_mask = digit_mask_avx512
+  }
+#endif
+};
+
+Kernels kernels = {
+  .newline_mask = newline_mask_scalar,
+  .whitespace_mask = whitespace_mask_scalar,
+  .structural_masks = structural_masks_scalar,
+  .prefix_xor = prefix_xor_scalar,
+  .iden_mask = iden_mask_scalar,
+  .digit_mask = digit_mask_scalar
+};
+static int selected_isa = ISA_SCALAR;
+
+
+bool isa_supported(int isa) {
+  if (isa == ISA_SCALAR) {
+    return true;
+  }
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  switch (isa) {
+    case ISA_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case ISA_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul");
+    case ISA_AVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+             __builtin_cpu_supports("pclmul");
+  }
+#endif
+  return false;
+}
+
+int isa_detect(void) {
+  for (int isa = ISA_LAST - 1; isa > ISA_SCALAR; isa--) {
+    if (isa_supported(isa)) {
+      return isa;
+    }
+  }
+  return ISA_SCALAR;
+}
+
+bool isa_select(int isa) {
+  if (isa < 0 || isa >= ISA_LAST || !isa_supported(isa)) {
+    return false;
+  }
+  kernels = isa_kernels[isa];
+  selected_isa = isa;
+  return true;
+}
+
+int isa_selected(void) {
+  return selected_isa;
+}
+
+int isa_parse(const char* name) {
+  for (int isa = 0; isa < ISA_LAST; isa++) {
+    if (!strcmp(name, isa_names[isa])) {
+      return isa;
+    }
+  }
+  return -1;
+}
+
+const char* isa_name(int isa) {
+  return isa_names[isa];
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+static void
+select_best_isa(void) {
+  isa_select(isa_detect());
+}
+#endif
@@ -0,0 +1,335 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// sinks.c writes the tokens of one scan in several output formats at once,
+// e.g. the text for the tests and the binary stream for an indexer, rather
+// than scanning the input once per format.
+//
+// The formats are looked up by name in a table of SinkFormats. Each one
+// makes a TokenWriter for a file: open() writes its header, and close()
+// its trailer, if any. Adding a format is adding an entry to the table.
+//
+// A SinkWriter is a TokenWriter which gathers the tokens in a BatchWriter,
+// and passes each batch on to the writers of its sinks in turn (and the
+// brackets at the end), so that each writer goes over the tokens in a loop
+// of its own. Each sink has a file of its own, with a stdio buffer of its
+// own size, and is flushed after a given number of tokens (e.g. for a reader
+// following the file as it grows, which gets the tokens a batch at a time)
+// or only when it is closed.
+//
+// TSV output, one token per line after a header line:
+//   line TAB end_line TAB kind TAB offset TAB length TAB text TAB error
+// with \t, \n, \r and \ escaped in texts, and empty fields for none.
+//
+// JSON output, an array of tokens:
+//   {"line": .., "end_line": .., "kind": "..", "offset": .., "length": ..,
+//    "text": ".." (if any), "error": ".." (if any)}
+// Texts are copied as they are if they are valid UTF-8. A byte which isn't
+// part of a valid UTF-8 sequence (e.g. of a Latin-1 literal) is written as
+// the code point of the same value (\u00XX), so that the output stays valid
+// JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "scanner.h"
+
+#define TEXT_BUFFER_SIZE 65536
+#define BINARY_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+  const SinkFormat* format;
+  SinkPolicy policy;
+  FILE* fout;
+  char* buffer;
+  TokenWriter* writer;
+  size_t pending;       // tokens written since the last flush
+} Sink;
+
+typedef struct {
+  TokenWriter base;
+  TokenWriter* batch;   // BatchWriter delivering to the sinks
+  Sink* sinks;
+  size_t count;
+  size_t capacity;
+} SinkWriter;
+
+typedef struct {
+  TokenWriter base;
+  bool first;
+} JsonWriter;
+
+
+static TokenWriter*
+open_plain(FILE* fout, void (*write)(TokenWriter*, const Token*)) {
+  TokenWriter* self = calloc(1, sizeof(TokenWriter));
+  self->write = write;
+  self->fout = fout;
+  return self;
+}
+
+static TokenWriter*
+open_text(FILE* fout) {
+  return open_plain(fout, write_text);
+}
+
+static void
+close_plain(TokenWriter* self) {
+  free(self);
+}
+
+
+static void
+put_tsv_text(FILE* fout, const char* s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    switch (s[i]) {
+      case '\t':
+        fputs("\\t", fout);
+        break;
+      case '\n':
+        fputs("\\n", fout);
+        break;
+      case '\r':
+        fputs("\\r", fout);
+        break;
+      case '\\':
+        fputs("\\\\", fout);
+        break;
+      default:
+        putc(s[i], fout);
+    }
+  }
+}
+
+static void
+write_tsv(TokenWriter* self, const Token* tok) {
+  fprintf(self->fout, "%d\t%d\t%s\t%zu\t%zu\t", tok->begin_line_number, tok->end_line_number,
+          token_name(tok->kind), tok->offset, tok->length);
+  if (tok->text) {
+    put_tsv_text(self->fout, tok->text, tok->text_length);
+  }
+  putc('\t', self->fout);
+  if (tok->error) {
+    put_tsv_text(self->fout, tok->error, strlen(tok->error));
+  }
+  putc('\n', self->fout);
+}
+
+static TokenWriter*
+open_tsv(FILE* fout) {
+  fputs("line\tend_line\tkind\toffset\tlength\ttext\terror\n", fout);
+  return open_plain(fout, write_tsv);
+}
+
+
+// Length of the valid UTF-8 sequence at s (of n bytes), 0 if there is none
+static size_t
+utf8_length(const unsigned char* s, size_t n) {
+  size_t length = (s[0] < 0x80) ? 1 :
+                  (s[0] >= 0xc2 && s[0] <= 0xdf) ? 2 :
+                  (s[0] >= 0xe0 && s[0] <= 0xef) ? 3 :
+                  (s[0] >= 0xf0 && s[0] <= 0xf4) ? 4 : 0;
+  if (length == 0 || length > n) {
+    return 0;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  // Overlong forms, surrogates, and code points past U+10FFFF
+  if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0) ||
+      (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90)) {
+    return 0;
+  }
+  return length;
+}
+
+static void
+put_json_string(FILE* fout, const char* s, size_t n) {
+  putc('"', fout);
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    size_t length = (c >= 0x80) ? utf8_length((const unsigned char*) s + i, n - i) : 1;
+    if (length > 1) {
+      fwrite(s + i, 1, length, fout);
+      i += length - 1;
+    } else if (c >= 0x80) {
+      fprintf(fout, "\\u%04x", c);
+    } else if (c == '"' || c == '\\') {
+      fprintf(fout, "\\%c", c);
+    } else if (c == '\n') {
+      fputs("\\n", fout);
+    } else if (c == '\t') {
+      fputs("\\t", fout);
+    } else if (c < 0x20) {
+      fprintf(fout, "\\u%04x", c);
+    } else {
+      putc(c, fout);
+    }
+  }
+  putc('"', fout);
+}
+
+static void
+write_json(TokenWriter* self, const Token* tok) {
+  JsonWriter* jw = (JsonWriter*) self;
+  fputs((jw->first) ? "\n" : ",\n", self->fout);
+  jw->first = false;
+  fprintf(self->fout, "{\"line\": %d, \"end_line\": %d, \"kind\": \"%s\", \"offset\": %zu, \"length\": %zu",
+          tok->begin_line_number, tok->end_line_number, token_name(tok->kind), tok->offset, tok->length);
+  if (tok->text) {
+    fputs(", \"text\": ", self->fout);
+    put_json_string(self->fout, tok->text, tok->text_length);
+  }
+  if (tok->error) {
+    fputs(", \"error\": ", self->fout);
+    put_json_string(self->fout, tok->error, strlen(tok->error));
+  }
+  putc('}', self->fout);
+}
+
+static TokenWriter*
+open_json(FILE* fout) {
+  JsonWriter* self = calloc(1, sizeof(JsonWriter));
+  self->base.write = write_json;
+  self->base.fout = fout;
+  self->first = true;
+  putc('[', fout);
+  return &self->base;
+}
+
+static void
+close_json(TokenWriter* self) {
+  fputs("\n]\n", self->fout);
+  free(self);
+}
+
+
+static TokenWriter*
+open_binary(FILE* fout) {
+  TokenWriter* self = open_plain(fout, write_binary);
+  self->finish = write_binary_brackets;
+  write_binary_header(fout);
+  return self;
+}
+
+
+static const SinkFormat sink_formats[] = {
+  { "text",   false, { TEXT_BUFFER_SIZE, 0 },   open_text,   close_plain },
+  { "tsv",    false, { TEXT_BUFFER_SIZE, 0 },   open_tsv,    close_plain },
+  { "json",   false, { TEXT_BUFFER_SIZE, 0 },   open_json,   close_json },
+  { "binary", true,  { BINARY_BUFFER_SIZE, 0 }, open_binary, close_plain },
+  { "packed", true,  { BINARY_BUFFER_SIZE, 0 }, pwnew,       pwfree }
+};
+
+const SinkFormat* sink_format(const char* name) {
+  for (size_t i = 0; i < sizeof(sink_formats) / sizeof(sink_formats[0]); i++) {
+    if (!strcmp(sink_formats[i].name, name)) {
+      return &sink_formats[i];
+    }
+  }
+  return NULL;
+}
+
+
+static void
+write_sinks_batch(const Token* tokens, size_t count, void* data) {
+  SinkWriter* sw = (SinkWriter*) data;
+  for (size_t i = 0; i < sw->count; i++) {
+    Sink* sink = &sw->sinks[i];
+    for (size_t j = 0; j < count; j++) {
+      sink->writer->write(sink->writer, &tokens[j]);
+      if (sink->policy.flush_tokens && ++sink->pending == sink->policy.flush_tokens) {
+        fflush(sink->fout);
+        sink->pending = 0;
+      }
+    }
+  }
+}
+
+static void
+write_sinks(TokenWriter* self, const Token* tok) {
+  SinkWriter* sw = (SinkWriter*) self;
+  sw->batch->write(sw->batch, tok);
+}
+
+static void
+finish_sinks(TokenWriter* self, const BracketPair* pairs, size_t count) {
+  SinkWriter* sw = (SinkWriter*) self;
+  bwflush(sw->batch);
+  for (size_t i = 0; i < sw->count; i++) {
+    TokenWriter* writer = sw->sinks[i].writer;
+    if (writer->finish) {
+      writer->finish(writer, pairs, count);
+    }
+  }
+}
+
+TokenWriter* swnew(const char* input, size_t input_length) {
+  SinkWriter* self = calloc(1, sizeof(SinkWriter));
+  self->base.write = write_sinks;
+  self->base.finish = finish_sinks;
+  self->batch = bwnew(input, input_length, write_sinks_batch, self);
+  return &self->base;
+}
+
+bool swadd(TokenWriter* self, const SinkFormat* format, const char* path, const SinkPolicy* policy) {
+  SinkWriter* sw = (SinkWriter*) self;
+  FILE* fout = fopen(path, (format->binary) ? "wb" : "w");
+  if (!fout) {
+    return false;
+  }
+  if (sw->count == sw->capacity) {
+    size_t capacity = (sw->capacity) ? sw->capacity * 2 : 4;
+    Sink* sinks = realloc(sw->sinks, capacity * sizeof(Sink));
+    if (!sinks) {
+      fclose(fout);
+      errno = ENOMEM;
+      return false;
+    }
+    sw->sinks = sinks;
+    sw->capacity = capacity;
+  }
+  SinkPolicy sink_policy = (policy) ? *policy : format->policy;
+  char* buffer = NULL;
+  if (sink_policy.buffer_size) {
+    buffer = malloc(sink_policy.buffer_size);
+    if (!buffer) {
+      fclose(fout);
+      errno = ENOMEM;
+      return false;
+    }
+    setvbuf(fout, buffer, _IOFBF, sink_policy.buffer_size);
+  }
+  Sink* sink = &sw->sinks[sw->count++];
+  sink->format = format;
+  sink->policy = sink_policy;
+  sink->fout = fout;
+  sink->buffer = buffer;
+  sink->pending = 0;
+  sink->writer = format->open(fout);
+  return true;
+}
+
+bool swclose(TokenWriter* self) {
+  SinkWriter* sw = (SinkWriter*) self;
+  bool ok = true;
+  // The last batch of a scan which doesn't call finish (scan_lines())
+  bwflush(sw->batch);
+  for (size_t i = 0; i < sw->count; i++) {
+    Sink* sink = &sw->sinks[i];
+    sink->format->close(sink->writer);
+    ok &= !ferror(sink->fout);
+    ok &= (fclose(sink->fout) == 0);
+    free(sink->buffer);
+  }
+  bwfree(sw->batch);
+  free(sw->sinks);
+  free(sw);
+  return ok;
+}
@@ -0,0 +1,369 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// tokens.c stores the tokens of a whole input as a TokenArray, for programs
+// which run passes over them rather than printing them.
+//
+// A TokenArray is a structure of arrays: one column per field, indexed by
+// token. A pass which only looks at kinds reads nothing but the kinds column
+// (one byte per token), so finding or counting tokens of a kind is a memchr()
+// or a loop the compiler vectorizes.
+//
+// Line numbers are delta-encoded: line_deltas[i] is the begin line of token
+// i minus that of token i - 1. Deltas which don't fit in 16 bits (or are
+// negative) are stored as LINE_DELTA_ESCAPE, with the line itself in a sparse
+// column. The begin line of every TA_CHECKPOINT-th token is also kept, so
+// taline() only has to add up the deltas since the last checkpoint.
+//
+// matches pairs every bracket with the one matching it, in both directions,
+// as scan() found them.
+//
+// Fields which most tokens don't have (end lines of tokens spanning several
+// lines, values of literals, errors) are sparse columns: parallel arrays of
+// token indices (increasing) and values, searched with binary search.
+//
+// A BatchWriter hands tokens to a callback TOKEN_BATCH_SIZE at a time
+// instead of one by one, so that consumers go over them in a loop of their
+// own, with one indirect call per batch. The texts of the tokens which
+// don't point into the input (unescaped literals, directives joined over
+// backslash-newlines) only live during the write() of the lexer, so they
+// are copied to a buffer of the batch, which is delivered early rather than
+// moving the buffer when it is full.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "scanner.h"
+
+#define LINE_DELTA_ESCAPE 0xffff
+// Initial size of the buffer of the copied texts of a batch
+#define BATCH_TEXTS_SIZE 65536
+
+// Collects tokens into array
+typedef struct {
+  TokenWriter base;
+  TokenArray* array;
+  bool failed;          // the array couldn't grow, which ends the scan
+} ArrayWriter;
+
+// Delivers tokens in batches
+typedef struct {
+  TokenWriter base;
+  BatchCallback callback;
+  void* data;
+  uintptr_t input;      // texts within the input are valid all along
+  size_t input_length;
+  Token* tokens;        // TOKEN_BATCH_SIZE
+  size_t count;
+  char* texts;          // copies of the other texts of the batch
+  size_t texts_length;
+  size_t texts_capacity;
+} BatchWriter;
+
+
+// Resizes *column to count elements of size bytes, false (leaving it as it
+// was) if it can't
+static bool
+grow_column(void** column, size_t count, size_t size) {
+  void* grown = realloc(*column, count * size);
+  if (!grown) {
+    return false;
+  }
+  *column = grown;
+  return true;
+}
+
+static bool
+sparse_append(SparseColumn* self, size_t index, uint64_t value) {
+  if (self->count == self->capacity) {
+    size_t capacity = (self->capacity) ? self->capacity * 2 : 16;
+    if (!grow_column((void**) &self->indices, capacity, sizeof(size_t)) ||
+        !grow_column((void**) &self->values, capacity, sizeof(uint64_t))) {
+      return false;
+    }
+    self->capacity = capacity;
+  }
+  self->indices[self->count] = index;
+  self->values[self->count++] = value;
+  return true;
+}
+
+// Position of the first index >= index in self
+static size_t
+sparse_lower_bound(const SparseColumn* self, size_t index) {
+  size_t lo = 0;
+  size_t hi = self->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (self->indices[mid] < index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static bool
+sparse_find(const SparseColumn* self, size_t index, uint64_t* value) {
+  size_t i = sparse_lower_bound(self, index);
+  if (i < self->count && self->indices[i] == index) {
+    *value = self->values[i];
+    return true;
+  }
+  return false;
+}
+
+static void
+sparse_free(SparseColumn* self) {
+  free(self->indices);
+  free(self->values);
+}
+
+
+TokenArray* tanew(void) {
+  return calloc(1, sizeof(TokenArray));
+}
+
+void tafree(TokenArray* self) {
+  free(self->kinds);
+  free(self->flags);
+  free(self->types);
+  free(self->offsets);
+  free(self->lengths);
+  free(self->line_deltas);
+  free(self->matches);
+  free(self->checkpoints);
+  sparse_free(&self->lines);
+  sparse_free(&self->end_lines);
+  sparse_free(&self->values);
+  sparse_free(&self->errors);
+  free(self);
+}
+
+bool taappend(TokenArray* self, const Token* tok) {
+  if (self->count == self->capacity) {
+    size_t capacity = (self->capacity) ? self->capacity * 2 : 1024;
+    if (!grow_column((void**) &self->kinds, capacity, sizeof(uint8_t)) ||
+        !grow_column((void**) &self->flags, capacity, sizeof(uint8_t)) ||
+        !grow_column((void**) &self->types, capacity, sizeof(uint8_t)) ||
+        !grow_column((void**) &self->offsets, capacity, sizeof(uint32_t)) ||
+        !grow_column((void**) &self->lengths, capacity, sizeof(uint32_t)) ||
+        !grow_column((void**) &self->line_deltas, capacity, sizeof(uint16_t)) ||
+        !grow_column((void**) &self->matches, capacity, sizeof(uint32_t)) ||
+        !grow_column((void**) &self->checkpoints, capacity / TA_CHECKPOINT + 1, sizeof(int))) {
+      return false;
+    }
+    self->capacity = capacity;
+  }
+
+  size_t i = self->count++;
+  self->kinds[i] = tok->kind;
+  self->flags[i] = tok->flags;
+  self->types[i] = tok->type;
+  self->offsets[i] = tok->offset;
+  self->lengths[i] = tok->length;
+  self->matches[i] = BRACKET_NONE;
+
+  int64_t delta = (int64_t) tok->begin_line_number - self->last_line;
+  if (delta >= 0 && delta < LINE_DELTA_ESCAPE) {
+    self->line_deltas[i] = delta;
+  } else {
+    self->line_deltas[i] = LINE_DELTA_ESCAPE;
+    if (!sparse_append(&self->lines, i, (uint64_t) tok->begin_line_number)) {
+      return false;
+    }
+  }
+  self->last_line = tok->begin_line_number;
+  if (i % TA_CHECKPOINT == 0) {
+    self->checkpoints[i / TA_CHECKPOINT] = tok->begin_line_number;
+  }
+
+  // Error messages are string literals, which outlive the array
+  return (tok->end_line_number == tok->begin_line_number ||
+          sparse_append(&self->end_lines, i, (uint64_t) tok->end_line_number)) &&
+         (!(tok->flags & TF_VALUE) || sparse_append(&self->values, i, tok->value.i)) &&
+         (!tok->error || sparse_append(&self->errors, i, (uintptr_t) tok->error));
+}
+
+static void
+write_array(TokenWriter* self, const Token* tok) {
+  ArrayWriter* aw = (ArrayWriter*) self;
+  if (!taappend(aw->array, tok)) {
+    aw->failed = true;
+    self->stop = true;
+  }
+}
+
+static void
+finish_array(TokenWriter* self, const BracketPair* pairs, size_t count) {
+  TokenArray* array = ((ArrayWriter*) self)->array;
+  for (size_t i = 0; i < count; i++) {
+    if (pairs[i].close != BRACKET_NONE) {
+      array->matches[pairs[i].open] = pairs[i].close;
+      array->matches[pairs[i].close] = pairs[i].open;
+    }
+  }
+}
+
+TokenArray* tascan(FileReader* fr, MacroTable* macros) {
+  ArrayWriter aw = {
+    .base = { .write = write_array, .fout = NULL, .finish = finish_array },
+    .array = tanew(),
+    .failed = false
+  };
+  if (!aw.array) {
+    return NULL;
+  }
+  if (!scan(fr, &aw.base, macros) || aw.failed) {
+    tafree(aw.array);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aw.array;
+}
+
+
+int taline(const TokenArray* self, size_t i) {
+  size_t checkpoint = i / TA_CHECKPOINT * TA_CHECKPOINT;
+  int line = self->checkpoints[i / TA_CHECKPOINT];
+  for (size_t j = checkpoint + 1; j <= i; j++) {
+    if (self->line_deltas[j] == LINE_DELTA_ESCAPE) {
+      uint64_t escaped = 0;
+      sparse_find(&self->lines, j, &escaped);
+      line = (int) escaped;
+    } else {
+      line += self->line_deltas[j];
+    }
+  }
+  return line;
+}
+
+int taendline(const TokenArray* self, size_t i) {
+  uint64_t end_line = 0;
+  return (sparse_find(&self->end_lines, i, &end_line)) ? (int) end_line : taline(self, i);
+}
+
+bool tavalue(const TokenArray* self, size_t i, uint64_t* value) {
+  return sparse_find(&self->values, i, value);
+}
+
+const char* taerror(const TokenArray* self, size_t i) {
+  uint64_t error = 0;
+  return (sparse_find(&self->errors, i, &error)) ? (const char*) (uintptr_t) error : NULL;
+}
+
+size_t tamatch(const TokenArray* self, size_t i) {
+  return (self->matches[i] == BRACKET_NONE) ? self->count : self->matches[i];
+}
+
+size_t tafind(const TokenArray* self, int kind, size_t from) {
+  if (from >= self->count) {
+    return self->count;
+  }
+  const uint8_t* p = memchr(self->kinds + from, kind, self->count - from);
+  return (p) ? (size_t) (p - self->kinds) : self->count;
+}
+
+size_t tacount(const TokenArray* self, int kind) {
+  size_t count = 0;
+  for (size_t i = 0; i < self->count; i++) {
+    count += (self->kinds[i] == kind);
+  }
+  return count;
+}
+
+
+TokenCursor tacursor(const TokenArray* self) {
+  TokenCursor cursor = {
+    .array = self,
+    .index = SIZE_MAX,
+    .line = 0,
+    .escape = 0
+  };
+  return cursor;
+}
+
+bool tanext(TokenCursor* self) {
+  const TokenArray* array = self->array;
+  size_t i = ++self->index;
+  if (i >= array->count) {
+    self->index = array->count;
+    return false;
+  }
+  if (array->line_deltas[i] == LINE_DELTA_ESCAPE) {
+    // Escaped lines are met in order, no need to search for them
+    self->line = (int) array->lines.values[self->escape++];
+  } else {
+    self->line += array->line_deltas[i];
+  }
+  return true;
+}
+
+
+static void
+write_batch(TokenWriter* self, const Token* tok) {
+  BatchWriter* bw = (BatchWriter*) self;
+  bool copy = tok->text && !((uintptr_t) tok->text >= bw->input &&
+                             (uintptr_t) tok->text + tok->text_length <= bw->input + bw->input_length);
+  if (copy && bw->texts_length + tok->text_length > bw->texts_capacity) {
+    bwflush(self);
+    if (tok->text_length > bw->texts_capacity) {
+      bw->texts_capacity = tok->text_length;
+      bw->texts = realloc(bw->texts, bw->texts_capacity);
+    }
+  }
+
+  Token* t = &bw->tokens[bw->count++];
+  *t = *tok;
+  if (copy) {
+    memcpy(bw->texts + bw->texts_length, tok->text, tok->text_length);
+    t->text = bw->texts + bw->texts_length;
+    bw->texts_length += tok->text_length;
+  }
+  if (bw->count == TOKEN_BATCH_SIZE) {
+    bwflush(self);
+  }
+}
+
+static void
+finish_batch(TokenWriter* self, const BracketPair* pairs, size_t count) {
+  (void) pairs;
+  (void) count;
+  bwflush(self);
+}
+
+TokenWriter* bwnew(const char* input, size_t input_length, BatchCallback callback, void* data) {
+  BatchWriter* self = calloc(1, sizeof(BatchWriter));
+  self->base.write = write_batch;
+  self->base.finish = finish_batch;
+  self->callback = callback;
+  self->data = data;
+  self->input = (uintptr_t) input;
+  self->input_length = input_length;
+  self->tokens = malloc(TOKEN_BATCH_SIZE * sizeof(Token));
+  self->texts_capacity = BATCH_TEXTS_SIZE;
+  self->texts = malloc(self->texts_capacity);
+  return &self->base;
+}
+
+void bwflush(TokenWriter* self) {
+  BatchWriter* bw = (BatchWriter*) self;
+  if (bw->count > 0) {
+    bw->callback(bw->tokens, bw->count, bw->data);
+  }
+  bw->count = 0;
+  bw->texts_length = 0;
+}
+
+void bwfree(TokenWriter* self) {
+  BatchWriter* bw = (BatchWriter*) self;
+  free(bw->tokens);
+  free(bw->texts);
+  free(bw);
+}
@@ -0,0 +1,10 @@
+int main(int argc, char* argv[]) {
+  int a[2][3] = { { 1, 2, 3 }, { 4, 5, 6 } };
+  if ((argc > 1) && argv[1][0]) {
+    return a[0][(1)];
+  }
+  f(a[1);
+  g(]);
+  return (0;
+}
+}
@@ -0,0 +1,52 @@
+#ifdef LINUX
+int linux_only;
+#else
+int not_linux;
+#endif
+#ifndef WIN32
+int not_win32;
+#endif
+#if VERSION >= 3 && defined(LINUX) // comment after the directive
+int version_3;
+#elif VERSION == 2
+int version_2;
+#else
+int version_1;
+#endif
+#if 0
+#if nested
+#error never seen
+#endif
+#include "skipped.h"
+#elif !defined(UNKNOWN) && (1 << 4) == 0x10 ? 1 : 0
+int elif_taken;
+#else
+int else_skipped;
+#endif
+#define LEVEL LINUX + VERSION
+#if LEVEL * 2 == 7
+int expanded_as_text;
+#endif
+#undef LINUX
+#ifdef LINUX
+int undefined_again;
+#endif
+#define F(x) (x)
+#if F(0) || __has_include(<stdio.h>)
+int function_like;
+#endif
+#if 0 && 1 / 0
+int and_skipped;
+#endif
+#if 1 || 1 % 0
+int or_taken;
+#endif
+#if VERSION ? 1 : 1 / 0
+int conditional_taken;
+#endif
+#if 0 && 1 || 1 / 0
+#endif
+#if 1 +
+#endif
+#else
+#endif
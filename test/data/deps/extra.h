@@ -0,0 +1,5 @@
+#if !defined(EXTRA_H)
+#define EXTRA_H
+int extra;
+#endif
+int after_guard;
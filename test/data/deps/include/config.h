@@ -0,0 +1,6 @@
+#pragma once
+
+// Included again by a different name, but lexed only once
+#include "../util.h"
+
+#define CONFIG_VALUE 42
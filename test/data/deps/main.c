@@ -0,0 +1,8 @@
+#include <stdio.h>
+#include "util.h"
+#include <config.h>
+#include "util.h"
+
+int main() {
+  return util(CONFIG_VALUE);
+}
@@ -0,0 +1,12 @@
+#include "include/config.h"
+#ifdef WITH_EXTRA
+#include "extra.h"
+#endif
+
+// #include "comment.h"
+/* #include "block.h" */
+static const char* s = "#include \"string.h\" /* not a comment";
+static char q = '"';
+static const char* t = "a\
+#include \"continued.h\"";
+#include "util.h"
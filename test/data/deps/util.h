@@ -0,0 +1,14 @@
+// Include guard, after a comment
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <config.h>
+#include "missing.h"
+
+#ifdef DEBUG
+int debug;
+#endif
+
+int util(int x);
+
+#endif  // UTIL_H
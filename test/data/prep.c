@@ -9,3 +9,26 @@
 #   include  "stdlib.h"
 #include <stdlib.h
 #include "stdlib.h
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define SWAP(a, b) \
+  do { \
+    int t = a; a = b; b = t; \
+  } while (0)
+#undef MAX
+#if defined(FOO) && FOO > 1
+#ifdef BAR
+#ifndef BAZ   /* block comment */
+#elif 0
+#else
+#endif // FOO
+#line 42 "file.c"
+#error "don't use // here"
+#pragma once
+#
+#include HEADER
+#include
+#bogus directive
+#define LIMIT 10 /* kept out */ /* of the value */
+#if LIMIT /* inside */ > 1 /* spans
+   two lines */
+#endif
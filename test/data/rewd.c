@@ -0,0 +1,6 @@
+whilereturn elsewhile elsexabc
+double do_it doing
+if_ ifelse iffy
+intint integer int8
+sizeofx structure unionx enumerate
+constant gotox returned
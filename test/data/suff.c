@@ -0,0 +1,19 @@
+10UL
+0x1fULL
+1.5f
+2.0L
+10u
+10l
+10ll
+10LLU
+4294967295
+0xffffffff
+2147483648
+0x1.8p3
+0x1p-2
+0x.8P1
+3.5e5F
+10lol
+1.0fx
+10lL
+0x1p
@@ -0,0 +1,8 @@
+int a = b ~ c;
+@decorator
+x = $y + `z`;
+char* p = "ok"; \
+y \ z
+café = 1;
+#define A @
+@~$`\ end
@@ -0,0 +1,7 @@
+char* ok = "héllo € 😀";
+char* latin = "caf";
+char* cut = "";
+char* overlong = " ";
+char* surrogate = "";
+char* big = " ";
+x = ;
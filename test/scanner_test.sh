@@ -1,11 +1,25 @@
 #!/usr/bin/env bash
 
+SCANNER=${SCANNER:-./scanner}
+
 function scanner_test() {
-  echo "Testing $1"
-  ./scanner test/data/$1 2>&1 >/dev/null
-  diff output.txt test/result/$2
+  echo "Testing $1 ${@:3}"
+  $SCANNER "${@:3}" test/data/$1 2>&1 >/dev/null
+  diff output.txt test/result/$2 || failed=1
+}
+
+function deps_test() {
+  echo "Testing deps ${@:2}"
+  $SCANNER "${@:2}" -I test/data/deps/include \
+    test/data/deps/main.c test/data/deps/other.c | diff - test/result/$1 || failed=1
 }
 
+function stats_test() {
+  echo "Testing stats $1 ${@:3}"
+  $SCANNER --stats "${@:3}" test/data/$1 | diff - test/result/$2 || failed=1
+}
+
+failed=0
 
 scanner_test "sc.c" "sc.txt"
 scanner_test "mc.c" "mc.txt"
@@ -15,3 +29,321 @@ scanner_test "inte.c" "inte.txt"
 scanner_test "iden.c" "iden.txt"
 scanner_test "char.c" "char.txt"
 scanner_test "str.c" "str.txt"
+scanner_test "suff.c" "suff.txt"
+scanner_test "ws.c" "ws.txt"
+scanner_test "unkn.c" "unkn.txt"
+scanner_test "rewd.c" "rewd.txt"
+scanner_test "cond.c" "cond.txt" -D LINUX -D VERSION=3 -U WIN32
+
+# Line numbers resolved from the newline index must match
+scanner_test "mc.c" "mc.txt" --lazy-lines
+scanner_test "prep.c" "prep.txt" --lazy-lines
+scanner_test "str.c" "str.txt" --lazy-lines
+
+# Every kernel variant this CPU supports must give the same results
+for isa in scalar sse2 avx2 avx512; do
+  if $SCANNER --isa=$isa --stats test/data/sc.c >/dev/null 2>&1; then
+    scanner_test "mc.c" "mc.txt" --lazy-lines --isa=$isa
+    scanner_test "prep.c" "prep.txt" --lazy-lines --isa=$isa
+    scanner_test "ws.c" "ws.txt" --isa=$isa
+  fi
+done
+
+# Inputs scanned a chunk at a time, with tokens (and comments, literals and
+# directives spanning lines) split across chunks, must give the same tokens
+for size in 1 7 64; do
+  scanner_test "mc.c" "mc.txt" --chunks $size
+  scanner_test "prep.c" "prep.txt" --chunks $size
+  scanner_test "str.c" "str.txt" --chunks $size
+  scanner_test "inte.c" "inte.txt" --chunks $size
+  scanner_test "unkn.c" "unkn.txt" --chunks $size
+  scanner_test "ws.c" "ws.txt" --chunks $size
+done
+
+# Lines may end with \r or \r\n in chunked input as well
+function chunk_eol_test() {
+  echo "Testing chunked $1 with $2 line ends"
+  local input=$(mktemp /tmp/scanner-eol.XXXXXX)
+  local expected=$(mktemp /tmp/scanner-eol-out.XXXXXX)
+  if [ $2 == cr ]; then
+    tr '\n' '\r' < test/data/$1 > $input
+  else
+    sed 's/$/\r/' test/data/$1 > $input
+  fi
+  $SCANNER $input $expected >/dev/null
+  for size in 1 7 64; do
+    $SCANNER --chunks $size $input output.txt >/dev/null
+    diff output.txt $expected || failed=1
+  done
+  rm -f $input $expected
+}
+
+chunk_eol_test "prep.c" cr
+chunk_eol_test "str.c" cr
+chunk_eol_test "prep.c" crlf
+chunk_eol_test "str.c" crlf
+
+# A directive and a string literal continued over 100000 lines each, read
+# 64 bytes at a time, take well under a second when every line isn't
+# scanned again from the beginning of the token
+function linear_chunks_test() {
+  echo "Testing linear time of continued tokens in chunks"
+  local input=$(mktemp /tmp/scanner-linear.XXXXXX)
+  local output=$(mktemp /tmp/scanner-linear-out.XXXXXX)
+  { echo '#define BIG \'; seq 100000 | sed 's/.*/  x& + \\/'; echo '  0'
+    echo 's = "\'; seq 100000 | sed 's/.*/&\\/'; echo '";'; } > $input
+  timeout 10 $SCANNER --chunks 64 $input $output >/dev/null || failed=1
+  rm -f $input $output
+}
+
+linear_chunks_test
+
+# Saving the lexer state after every chunk (--state) encodes and decodes it
+# between chunks, which must not change the tokens
+state=$(mktemp -u /tmp/scanner-state.XXXXXX)
+for size in 1 7 64; do
+  scanner_test "mc.c" "mc.txt" --chunks $size --state $state
+  scanner_test "prep.c" "prep.txt" --chunks $size --state $state
+  scanner_test "str.c" "str.txt" --chunks $size --state $state
+done
+[ ! -e $state ] || failed=1
+
+# value ($1) as $2 little-endian bytes
+function le() {
+  local i
+  for ((i = 0; i < $2; i++)); do
+    printf "\\x$(printf %02x $((($1 >> (8 * i)) & 255)))"
+  done
+}
+
+# A chunked scan resumed from a saved state must give the tokens of a scan
+# of the whole input from there on. The state is taken in mode $3 at the
+# beginning of line $4, in a token beginning on line $5.
+function state_test() {
+  echo "Testing lexer state $1 mode $3 line $4"
+  local offset=$(head -n $(($4 - 1)) test/data/$1 | wc -c)
+  local token_offset=$(head -n $(($5 - 1)) test/data/$1 | wc -c)
+  { le 1 1; le $3 1; le $4 4; le $offset 8; le $5 4; le $token_offset 8; } > $state
+  $SCANNER --chunks 7 --state $state test/data/$1 output.txt >/dev/null || failed=1
+  awk -F'\t' -v first=$5 '{ split($1, lines, "-"); if (lines[1] >= first) print }' \
+    test/result/$2 | diff output.txt - || failed=1
+  rm -f $state
+}
+
+state_test "mc.c" "mc.txt" 0 4 4
+state_test "mc.c" "mc.txt" 1 2 1
+state_test "prep.c" "prep.txt" 4 13 13
+
+# A state of another version ($1) or in an unknown mode ($2) is rejected
+function bad_state_test() {
+  echo "Testing bad lexer state $1 $2"
+  { le $1 1; le $2 1; head -c 24 /dev/zero; } > $state
+  $SCANNER --chunks 7 --state $state test/data/mc.c output.txt >/dev/null 2>&1 && failed=1
+  rm -f $state
+}
+
+bad_state_test 2 0
+bad_state_test 0 0
+bad_state_test 1 5
+bad_state_test 1 255
+
+# Bytes no lexer accepts must never stall the scanner: 8 MB of them (in
+# runs, and between tokens) take well under a second when scanned in linear
+# time, so the timeout only trips on a hang or a quadratic scan
+function linear_test() {
+  echo "Testing linear time $1"
+  local input=$(mktemp /tmp/scanner-linear.XXXXXX)
+  local output=$(mktemp /tmp/scanner-linear-out.XXXXXX)
+  yes 'x@~$`\ y @@@@~~~~$$$$````\\\\ 1+~2' | head -c 8000000 > $input
+  timeout 30 $1 $input $output >/dev/null || failed=1
+  rm -f $input $output
+}
+
+linear_test $SCANNER
+
+# Lines scanned from the checkpoints of the line index must give the tokens
+# of a scan of the whole input which begin on these lines. Comments, string
+# literals and directives span the checkpoints (every 1024 lines) of a
+# 7-line block repeated 1000 times, and a bare "0x" shifts line numbers.
+function lines_test() {
+  echo "Testing lines $*"
+  local input=$(mktemp /tmp/scanner-lines.XXXXXX)
+  for i in $(seq 1000); do
+    printf '%s\n' 'int a = 0x10; /* comment' ' spanning */ char* s = "str\' \
+      'ing"; #define X \' '  1 + 2' '#include <stdio.h>' "x = 'a' + 1.5e3; // sc" 'y = 0x'
+  done > $input
+  $SCANNER "$@" $input full.txt >/dev/null
+  # Without the index, with it, and with an index gone stale
+  for pass in build load stale; do
+    if [ $pass == stale ]; then
+      echo "z = 1;" >> $input
+      $SCANNER "$@" $input full.txt >/dev/null
+    fi
+    for range in 1-5 1020-1030 1025-1025 2049-2050 4090-4100 7990-8010 9000-9100; do
+      $SCANNER "$@" --lines $range $input output.txt >/dev/null
+      awk -F'\t' -v first=${range%-*} -v last=${range#*-} \
+        '{ split($1, lines, "-"); if (lines[1] >= first && lines[1] <= last) print }' \
+        full.txt | diff output.txt - || failed=1
+    done
+  done
+  rm -f $input $input.lines full.txt
+}
+
+lines_test
+lines_test --lazy-lines
+
+# Token counts from the token array
+stats_test "str.c" "str_stats.txt"
+stats_test "cond.c" "cond_stats.txt" -D LINUX -D VERSION=3 -U WIN32
+
+# Offsets and lengths are 32-bit, so a (sparse) 4 GiB input is rejected
+# rather than truncated
+function huge_test() {
+  echo "Testing 4 GiB input $*"
+  local input=$(mktemp /tmp/scanner-huge.XXXXXX)
+  truncate -s 4294967296 $input
+  $SCANNER "$@" $input 2>&1 >/dev/null | grep -q "File too large" || failed=1
+  rm -f $input
+}
+
+huge_test -b
+huge_test --stats
+stats_test "brackets.c" "brackets_stats.txt"
+
+# Include dependency graph, which must not depend on the number of threads
+deps_test "deps.d" --deps -j 1
+deps_test "deps.d" --deps -j 8
+deps_test "deps.json" --deps=json -j 8
+deps_test "deps_cond.d" --deps -U WITH_EXTRA
+
+# Token streams from the server must match the ones written by -b
+function server_test() {
+  echo "Testing server $1"
+  $SCANNER -b test/data/$1 output.txt >/dev/null
+  $SCANNER --connect $socket test/data/$1 server.bin >/dev/null
+  cmp output.txt server.bin || failed=1
+  rm -f server.bin
+}
+
+socket=$(mktemp -u /tmp/scanner-test.XXXXXX)
+$SCANNER --serve $socket &
+server=$!
+for i in $(seq 50); do
+  [ -S $socket ] && break
+  sleep 0.1
+done
+server_test "str.c"
+server_test "str.c"
+server_test "flot.c"
+# Streams are passed as file descriptors, never published by name
+ls /dev/shm 2>/dev/null | grep -q "^scanner-" && failed=1
+kill $server
+wait $server
+
+# Packed streams must unpack to the text and binary streams of the input
+function packed_test() {
+  echo "Testing packed $1 ${@:3}"
+  $SCANNER -z "${@:3}" test/data/$1 packed.bin >/dev/null
+  $SCANNER --unpack packed.bin >/dev/null
+  diff output.txt test/result/$2 || failed=1
+  $SCANNER -b "${@:3}" test/data/$1 binary.bin >/dev/null
+  $SCANNER --unpack -b packed.bin output.txt >/dev/null
+  cmp output.txt binary.bin || failed=1
+  rm -f packed.bin binary.bin
+}
+
+packed_test "prep.c" "prep.txt"
+packed_test "flot.c" "flot.txt"
+packed_test "inte.c" "inte.txt"
+packed_test "str.c" "str.txt"
+packed_test "unkn.c" "unkn.txt"
+packed_test "cond.c" "cond.txt" -D LINUX -D VERSION=3 -U WIN32
+
+# One scan writing several outputs must write each of them as a scan with
+# that output alone does, whatever their buffers and flush policies
+function sinks_test() {
+  echo "Testing sinks $1"
+  $SCANNER -o text=output.txt -o binary=sinks.bin,buffer=16 -o packed=sinks.z,flush=1 \
+    -o tsv=sinks.tsv -o json=sinks.json,buffer=64,flush=7 test/data/$1 >/dev/null
+  diff output.txt test/result/$2.txt || failed=1
+  diff sinks.tsv test/result/$2.tsv || failed=1
+  diff sinks.json test/result/$2.json || failed=1
+  $SCANNER -b test/data/$1 binary.bin >/dev/null
+  cmp sinks.bin binary.bin || failed=1
+  $SCANNER -z test/data/$1 packed.bin >/dev/null
+  cmp sinks.z packed.bin || failed=1
+  rm -f sinks.bin sinks.z sinks.tsv sinks.json binary.bin packed.bin
+}
+
+sinks_test "str.c" "str"
+sinks_test "unkn.c" "unkn"
+sinks_test "utf8.c" "utf8"
+
+# Sinks get the tokens in batches. More than a batch of tokens, more copied
+# texts (unescaped literals, joined directives) than the buffer of a batch
+# holds, and a directive longer than this buffer deliver batches early, and
+# must give the tokens which the push-mode scanner writes one at a time
+function batch_test() {
+  echo "Testing batches"
+  local input=$(mktemp /tmp/scanner-batch.XXXXXX)
+  local expected=$(mktemp /tmp/scanner-batch-out.XXXXXX)
+  for i in $(seq 300); do
+    printf 's = "%0200d\\t%040d";\n' $i $i
+  done > $input
+  echo '#define LONG \' >> $input
+  for i in $(seq 2000); do
+    printf '  %040d \\\n' $i
+  done >> $input
+  echo '  0' >> $input
+  for i in $(seq 5000); do
+    echo "x = y + $i;"
+  done >> $input
+  $SCANNER -o text=output.txt $input >/dev/null
+  $SCANNER --chunks 65536 $input $expected >/dev/null
+  diff output.txt $expected || failed=1
+  rm -f $input $expected
+}
+
+batch_test
+
+# Lexer generated from spec/c.lex (make gen). It must give the tokens of
+# scanner --lazy-lines on every input, which differs from the default mode
+# only in the line numbers after a bare "0x" (see spec/c.lex), so inte.c is
+# left out of the expected results.
+function gen_test() {
+  echo "Testing generated lexer $1"
+  ./scanner --lazy-lines $1 expected.txt >/dev/null
+  ./scanner-gen $1 output.txt >/dev/null
+  diff output.txt expected.txt || failed=1
+  rm -f expected.txt
+}
+
+if [ -x ./scanner-gen ]; then
+  for input in test/data/*.c; do
+    gen_test $input
+  done
+  # Comments closed by **/ and unterminated at the end of input without a
+  # newline, literals longer than the scanner keeps, and a NUL byte
+  input=$(mktemp /tmp/scanner-gen.XXXXXX)
+  { printf '/* a **/ b */ x; /** doc **/ */\n"%0300d" \x27\\0\x27 \x27%0300d\n\0\n'
+    printf '// end'; } > $input
+  gen_test $input
+  printf '/* runaway' > $input
+  gen_test $input
+  rm -f $input
+
+  SCANNER=./scanner-gen
+  scanner_test "sc.c" "sc.txt"
+  scanner_test "mc.c" "mc.txt"
+  scanner_test "prep.c" "prep.txt"
+  scanner_test "flot.c" "flot.txt"
+  scanner_test "iden.c" "iden.txt"
+  scanner_test "char.c" "char.txt"
+  scanner_test "str.c" "str.txt"
+  scanner_test "unkn.c" "unkn.txt"
+  scanner_test "rewd.c" "rewd.txt"
+  scanner_test "suff.c" "suff.txt"
+  linear_test $SCANNER
+fi
+
+exit $failed
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+#
+# usage: tools/bench.sh <scanner>...         time each scanner on the corpus
+#        tools/bench.sh --train <scanner>    run a profiling build on the corpus
+#
+# The corpus is example/*.c and test/data/*.c, repeated up to $BENCH_MB
+# megabytes into $BENCH_DIR/corpus.c. Every scanner is timed $BENCH_RUNS
+# times in each output mode, and the best times are reported together with
+# the speedup over the first scanner and whether it passes the unit tests.
+
+BENCH_DIR=${BENCH_DIR:-bench}
+BENCH_MB=${BENCH_MB:-16}
+BENCH_RUNS=${BENCH_RUNS:-5}
+CORPUS=$BENCH_DIR/corpus.c
+INPUTS="example/*.c test/data/*.c"
+
+function make_corpus() {
+  mkdir -p $BENCH_DIR
+  if [ -f $CORPUS ] && [ $(stat -c %s $CORPUS) -ge $((BENCH_MB * 1000000)) ]; then
+    return
+  fi
+  : > $CORPUS
+  while [ $(stat -c %s $CORPUS) -lt $((BENCH_MB * 1000000)) ]; do
+    for f in $INPUTS; do
+      cat $f
+      echo
+    done >> $CORPUS
+  done
+}
+
+# Best wall time of $BENCH_RUNS runs, in milliseconds
+function best_time() {
+  local best=
+  for i in $(seq $BENCH_RUNS); do
+    local start=$(date +%s%N)
+    "$@" >/dev/null 2>&1
+    local ms=$((($(date +%s%N) - start) / 1000000))
+    if [ -z "$best" ] || [ $ms -lt $best ]; then
+      best=$ms
+    fi
+  done
+  echo $best
+}
+
+function train() {
+  # Every mode on every input, so that no path is left without a profile
+  for f in $INPUTS $CORPUS; do
+    $1 $f $BENCH_DIR/train.txt >/dev/null
+    $1 -l $f $BENCH_DIR/train.txt >/dev/null
+    $1 -b $f $BENCH_DIR/train.bin >/dev/null
+    $1 -D LINUX -U WIN32 $f $BENCH_DIR/train.txt >/dev/null
+    $1 --stats $f >/dev/null
+  done
+  $1 --deps -I test/data/deps/include test/data/deps/*.c >/dev/null
+  rm -f $BENCH_DIR/train.txt $BENCH_DIR/train.bin
+}
+
+make_corpus
+
+if [ "$1" == "--train" ]; then
+  train $2
+  exit 0
+fi
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <scanner>..." >&2
+  exit 1
+fi
+
+size=$(stat -c %s $CORPUS)
+echo "Corpus: $CORPUS ($((size / 1000000)) MB), best of $BENCH_RUNS runs"
+printf "%-28s %10s %10s %10s %8s %s\n" "scanner" "text ms" "binary ms" "MB/s" "speedup" "tests"
+
+baseline=
+for scanner in "$@"; do
+  text=$(best_time $scanner $CORPUS $BENCH_DIR/bench.txt)
+  binary=$(best_time $scanner -b $CORPUS $BENCH_DIR/bench.bin)
+  baseline=${baseline:-$text}
+  if SCANNER=$scanner ./test/scanner_test.sh >/dev/null 2>&1; then
+    tests=ok
+  else
+    tests=FAILED
+  fi
+  awk -v s="$scanner" -v t=$text -v b=$binary -v base=$baseline -v size=$size -v tests=$tests \
+    'BEGIN { printf "%-28s %10d %10d %10.1f %7.2fx %s\n", s, t, b, size / 1000 / (t ? t : 1), base / (t ? t : 1), tests }'
+done
+rm -f $BENCH_DIR/bench.txt $BENCH_DIR/bench.bin
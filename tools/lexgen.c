@@ -0,0 +1,1302 @@
+// Copyright 2019 Marco Wang <m.aesophor@gmail.com>
+//
+// Implementation note:
+//
+// lexgen.c reads a declarative token specification (see spec/c.lex) and
+// emits a standalone C lexer specialized for it.
+//
+// The hand-written scanner used to probe every lexing function for each
+// token. The generated lexer instead computes, at generation time, which
+// token classes can possibly start with each byte. Bytes with the same
+// candidate list share a dispatch state, and each state only tries its own
+// candidates (still in spec order, so priorities are preserved). States are
+// entered through computed gotos on GCC/Clang and through a switch otherwise.
+//
+// Keyword and symbol matching are specialized as well: symbols become a switch
+// on the first char with candidates ordered by length (longest match first),
+// and keywords a switch on the first char with candidates in spec order (the
+// first keyword the input starts with wins, as in the hand-written scanner).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_CLASSES 64
+#define MAX_ARGS 256
+#define MAX_LINE_LEN 1024
+#define CLASS_NAME_MAX_LEN 16
+
+typedef enum {
+  K_LINE_COMMENT,
+  K_BLOCK_COMMENT,
+  K_DIRECTIVE,
+  K_SYMBOLS,
+  K_KEYWORDS,
+  K_CHAR_LITERAL,
+  K_STRING_LITERAL,
+  K_FLOAT,
+  K_IDENTIFIER,
+  K_INTEGER,
+  K_UNKNOWN,
+  K_LAST
+} Kind;
+
+static const struct {
+  const char* name;
+  int min_args;
+  int max_args;
+} kinds[K_LAST] = {
+  [K_LINE_COMMENT]   = {"line_comment",   1, 1},
+  [K_BLOCK_COMMENT]  = {"block_comment",  2, 2},
+  [K_DIRECTIVE]      = {"directive",      1, MAX_ARGS},
+  [K_SYMBOLS]        = {"symbols",        1, MAX_ARGS},
+  [K_KEYWORDS]       = {"keywords",       1, MAX_ARGS},
+  [K_CHAR_LITERAL]   = {"char_literal",   1, 1},
+  [K_STRING_LITERAL] = {"string_literal", 1, 1},
+  [K_FLOAT]          = {"float",          0, 0},
+  [K_IDENTIFIER]     = {"identifier",     0, 0},
+  [K_INTEGER]        = {"integer",        0, 0},
+  [K_UNKNOWN]        = {"unknown",        0, 0}
+};
+
+typedef struct {
+  char name[CLASS_NAME_MAX_LEN];
+  Kind kind;
+  char* args[MAX_ARGS];
+  int args_count;
+  int line_number; // where it was declared in the spec
+} TokenClass;
+
+typedef struct {
+  TokenClass classes[MAX_CLASSES];
+  int classes_count;
+} Spec;
+
+
+static bool parse_spec(FILE* fin, const char* filename, Spec* spec);
+static bool check_spec(const Spec* spec, const char* filename);
+static void free_spec(Spec* spec);
+static void start_set(const TokenClass* cls, bool set[256]);
+
+static void gen_prelude(FILE* out, const Spec* spec, const char* spec_filename);
+static void gen_class(FILE* out, const TokenClass* cls);
+static void gen_dispatch(FILE* out, const Spec* spec);
+static void gen_main(FILE* out);
+
+static void put_char_literal(FILE* out, int c);
+static void put_string_literal(FILE* out, const char* s);
+static bool is_whitespace(int c);
+static bool is_iden_start(int c);
+
+
+// Spec parsing
+static bool
+parse_spec(FILE* fin, const char* filename, Spec* spec) {
+  char line[MAX_LINE_LEN];
+  int line_number = 0;
+  TokenClass* current = NULL;
+
+  while (fgets(line, sizeof(line), fin)) {
+    line_number++;
+    if (line[0] == '#') {
+      continue;
+    }
+
+    // Indented lines continue the argument list of the previous class
+    bool continuation = is_whitespace(line[0]);
+    char* saveptr = NULL;
+    char* word = strtok_r(line, " \t\r\n", &saveptr);
+    if (!word) {
+      continue;
+    }
+
+    if (!continuation) {
+      if (strcmp(word, "token")) {
+        fprintf(stderr, "%s:%d: expected \"token\", got \"%s\"\n", filename, line_number, word);
+        return false;
+      }
+      if (spec->classes_count == MAX_CLASSES) {
+        fprintf(stderr, "%s:%d: too many token classes\n", filename, line_number);
+        return false;
+      }
+
+      char* name = strtok_r(NULL, " \t\r\n", &saveptr);
+      char* kind = name ? strtok_r(NULL, " \t\r\n", &saveptr) : NULL;
+      if (!kind) {
+        fprintf(stderr, "%s:%d: expected \"token <NAME> <kind>\"\n", filename, line_number);
+        return false;
+      }
+      if (strlen(name) >= CLASS_NAME_MAX_LEN) {
+        fprintf(stderr, "%s:%d: token class name too long\n", filename, line_number);
+        return false;
+      }
+
+      current = &spec->classes[spec->classes_count++];
+      strcpy(current->name, name);
+      current->line_number = line_number;
+      current->kind = K_LAST;
+      for (int i = 0; i < K_LAST; i++) {
+        if (!strcmp(kind, kinds[i].name)) {
+          current->kind = i;
+        }
+      }
+      if (current->kind == K_LAST) {
+        fprintf(stderr, "%s:%d: unknown kind \"%s\"\n", filename, line_number, kind);
+        return false;
+      }
+      word = strtok_r(NULL, " \t\r\n", &saveptr);
+    } else if (!current) {
+      fprintf(stderr, "%s:%d: continuation line without a token class\n", filename, line_number);
+      return false;
+    }
+
+    for (; word; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      if (current->args_count == MAX_ARGS) {
+        fprintf(stderr, "%s:%d: too many arguments\n", filename, line_number);
+        return false;
+      }
+      current->args[current->args_count++] = strdup(word);
+    }
+  }
+  return true;
+}
+
+static bool
+check_spec(const Spec* spec, const char* filename) {
+  if (spec->classes_count == 0) {
+    fprintf(stderr, "%s: no token classes\n", filename);
+    return false;
+  }
+
+  for (int i = 0; i < spec->classes_count; i++) {
+    const TokenClass* cls = &spec->classes[i];
+    int n = cls->args_count;
+
+    if (n < kinds[cls->kind].min_args || n > kinds[cls->kind].max_args) {
+      fprintf(stderr, "%s:%d: wrong number of arguments for %s\n",
+              filename, cls->line_number, kinds[cls->kind].name);
+      return false;
+    }
+    if ((cls->kind == K_CHAR_LITERAL || cls->kind == K_STRING_LITERAL) &&
+        strlen(cls->args[0]) != 1) {
+      fprintf(stderr, "%s:%d: quote must be a single char\n", filename, cls->line_number);
+      return false;
+    }
+    if (cls->kind == K_KEYWORDS) {
+      for (int j = 0; j < n; j++) {
+        if (!is_iden_start(cls->args[j][0])) {
+          fprintf(stderr, "%s:%d: \"%s\" is not a valid keyword\n",
+                  filename, cls->line_number, cls->args[j]);
+          return false;
+        }
+      }
+    }
+    for (int j = i + 1; j < spec->classes_count; j++) {
+      if (cls->kind == K_UNKNOWN && spec->classes[j].kind == K_UNKNOWN) {
+        fprintf(stderr, "%s:%d: more than one unknown class\n",
+                filename, spec->classes[j].line_number);
+        return false;
+      }
+      if (!strcmp(cls->name, spec->classes[j].name)) {
+        fprintf(stderr, "%s:%d: duplicate token class %s\n",
+                filename, spec->classes[j].line_number, cls->name);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void
+free_spec(Spec* spec) {
+  for (int i = 0; i < spec->classes_count; i++) {
+    for (int j = 0; j < spec->classes[i].args_count; j++) {
+      free(spec->classes[i].args[j]);
+    }
+  }
+}
+
+// Which bytes can start a token of the given class
+static void
+start_set(const TokenClass* cls, bool set[256]) {
+  memset(set, 0x00, 256 * sizeof(bool));
+
+  switch (cls->kind) {
+    case K_LINE_COMMENT:
+    case K_BLOCK_COMMENT:
+    case K_DIRECTIVE:
+    case K_CHAR_LITERAL:
+    case K_STRING_LITERAL:
+      set[(unsigned char) cls->args[0][0]] = true;
+      break;
+    case K_SYMBOLS:
+    case K_KEYWORDS:
+      for (int i = 0; i < cls->args_count; i++) {
+        set[(unsigned char) cls->args[i][0]] = true;
+      }
+      break;
+    case K_FLOAT:
+      set['+'] = set['-'] = set['.'] = true;
+      // fall through
+    case K_INTEGER:
+      for (int c = '0'; c <= '9'; c++) {
+        set[c] = true;
+      }
+      break;
+    case K_IDENTIFIER:
+      for (int c = 0; c < 256; c++) {
+        set[c] = is_iden_start(c);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+
+// Code generation
+static void
+gen_prelude(FILE* out, const Spec* spec, const char* spec_filename) {
+  fprintf(out,
+    "// Generated by lexgen from %s -- DO NOT EDIT.\n"
+    "//\n"
+    "// Token classes (in priority order):", spec_filename);
+  for (int i = 0; i < spec->classes_count; i++) {
+    fprintf(out, " %s", spec->classes[i].name);
+  }
+  fprintf(out, "\n\n");
+
+  fputs(
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#if defined(__GNUC__) && !defined(LEXGEN_NO_COMPUTED_GOTO)\n"
+    "#define LEXGEN_COMPUTED_GOTO\n"
+    "#define STATE(n) state_##n:\n"
+    "#else\n"
+    "#define STATE(n) case n:\n"
+    "#endif\n"
+    "\n"
+    "#define DEFAULT_OUTPUT_FILENAME \"output.txt\"\n"
+    "// Like scanner, literals keep at most LITERAL_MAX_LEN - 1 bytes of text\n"
+    "#define LITERAL_MAX_LEN 256\n"
+    "\n"
+    "typedef struct {\n"
+    "  const char* buf;\n"
+    "  size_t len;\n"
+    "  size_t pos;\n"
+    "  int line_number;\n"
+    "  char* scratch; // unescaped literals, directives without backslash-newlines\n"
+    "  FILE* fout;\n"
+    "} Lexer;\n"
+    "\n"
+    "\n"
+    "static inline bool\n"
+    "is_newline(int c) {\n"
+    "  return c == 0xd || c == 0xa;\n"
+    "}\n"
+    "\n"
+    "static inline bool\n"
+    "is_digit(int c) {\n"
+    "  return c >= '0' && c <= '9';\n"
+    "}\n"
+    "\n"
+    "static inline bool\n"
+    "is_hex_digit(int c) {\n"
+    "  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');\n"
+    "}\n"
+    "\n"
+    "static inline bool\n"
+    "is_iden_char(int c) {\n"
+    "  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || is_digit(c);\n"
+    "}\n"
+    "\n"
+    "// Byte at offset i, or -1 past the end of input\n"
+    "static inline int\n"
+    "at(const Lexer* lx, size_t i) {\n"
+    "  return (i < lx->len) ? (unsigned char) lx->buf[i] : -1;\n"
+    "}\n"
+    "\n"
+    "// Consume the byte at *i, keeping track of line number\n"
+    "static inline int\n"
+    "advance(Lexer* lx, size_t* i) {\n"
+    "  int c = at(lx, *i);\n"
+    "  if (c != -1) {\n"
+    "    (*i)++;\n"
+    "    lx->line_number += (is_newline(c)) ? 1 : 0;\n"
+    "  }\n"
+    "  return c;\n"
+    "}\n"
+    "\n"
+    "static inline bool\n"
+    "starts_with(const Lexer* lx, const char* s, size_t n) {\n"
+    "  return lx->len - lx->pos >= n && !memcmp(lx->buf + lx->pos, s, n);\n"
+    "}\n"
+    "\n"
+    "// Length of the integer suffix (u, l, ll or a combination) at i, not\n"
+    "// taken if it runs into an identifier, e.g., 10lol\n"
+    "static inline size_t\n"
+    "integer_suffix_length(const Lexer* lx, size_t i) {\n"
+    "  size_t j = i;\n"
+    "  bool u = false;\n"
+    "  if (at(lx, j) == 'u' || at(lx, j) == 'U') {\n"
+    "    u = true;\n"
+    "    j++;\n"
+    "  }\n"
+    "  if (at(lx, j) == 'l' || at(lx, j) == 'L') {\n"
+    "    j += (at(lx, j + 1) == at(lx, j)) ? 2 : 1; // but not lL or Ll\n"
+    "  }\n"
+    "  if (!u && (at(lx, j) == 'u' || at(lx, j) == 'U')) {\n"
+    "    j++;\n"
+    "  }\n"
+    "  return (is_iden_char(at(lx, j))) ? 0 : j - i;\n"
+    "}\n"
+    "\n"
+    "// Length of the float suffix (f or l, in either case) at i\n"
+    "static inline size_t\n"
+    "float_suffix_length(const Lexer* lx, size_t i) {\n"
+    "  int c = at(lx, i);\n"
+    "  bool suffix = c == 'f' || c == 'F' || c == 'l' || c == 'L';\n"
+    "  return (suffix && !is_iden_char(at(lx, i + 1))) ? 1 : 0;\n"
+    "}\n"
+    "\n"
+    "// Length of the hex float at i, e.g., 0x1.8p3, or 0 if there is none\n"
+    "static inline size_t\n"
+    "hex_float_length(const Lexer* lx, size_t i) {\n"
+    "  if (at(lx, i) != '0' || (at(lx, i + 1) != 'x' && at(lx, i + 1) != 'X')) {\n"
+    "    return 0;\n"
+    "  }\n"
+    "  size_t j = i + 2;\n"
+    "  size_t digits = 0;\n"
+    "  for (; is_hex_digit(at(lx, j)); j++) {\n"
+    "    digits++;\n"
+    "  }\n"
+    "  if (at(lx, j) == '.') {\n"
+    "    for (j++; is_hex_digit(at(lx, j)); j++) {\n"
+    "      digits++;\n"
+    "    }\n"
+    "  }\n"
+    "  if (digits == 0 || (at(lx, j) != 'p' && at(lx, j) != 'P')) {\n"
+    "    return 0;\n"
+    "  }\n"
+    "  j++;\n"
+    "  if (at(lx, j) == '+' || at(lx, j) == '-') {\n"
+    "    j++;\n"
+    "  }\n"
+    "  if (!is_digit(at(lx, j))) {\n"
+    "    return 0;\n"
+    "  }\n"
+    "  while (is_digit(at(lx, j))) {\n"
+    "    j++;\n"
+    "  }\n"
+    "  return j - i;\n"
+    "}\n"
+    "\n"
+    "// Like scanner, the text of a literal ends at its first NUL\n"
+    "static inline size_t\n"
+    "text_length(const char* s, size_t n) {\n"
+    "  const char* nul = memchr(s, 0, n);\n"
+    "  return (nul) ? (size_t) (nul - s) : n;\n"
+    "}\n"
+    "\n"
+    "static size_t\n"
+    "count_newlines(const char* s, size_t n) {\n"
+    "  size_t count = 0;\n"
+    "  for (size_t i = 0; i < n; i++) {\n"
+    "    count += (is_newline(s[i])) ? 1 : 0;\n"
+    "  }\n"
+    "  return count;\n"
+    "}\n"
+    "\n"
+    "static const char*\n"
+    "find(const char* s, size_t n, const char* needle, size_t m) {\n"
+    "  const char* end = s + n;\n"
+    "  while ((size_t) (end - s) >= m && (s = memchr(s, needle[0], end - s - m + 1))) {\n"
+    "    if (!memcmp(s, needle, m)) {\n"
+    "      return s;\n"
+    "    }\n"
+    "    s++;\n"
+    "  }\n"
+    "  return NULL;\n"
+    "}\n"
+    "\n"
+    "static char\n"
+    "get_escaped_char(char c) {\n"
+    "  switch (c) {\n"
+    "    case 'a': return 0x07;\n"
+    "    case 'b': return 0x08;\n"
+    "    case 'e': return 0x1b;\n"
+    "    case 'f': return 0x0c;\n"
+    "    case 'n': return 0x0a;\n"
+    "    case 'r': return 0x0d;\n"
+    "    case 't': return 0x09;\n"
+    "    case 'v': return 0x0b;\n"
+    "    default: return c;\n"
+    "  }\n"
+    "}\n"
+    "\n"
+    "static void\n"
+    "emit(Lexer* lx, int begin, int end, const char* cls,\n"
+    "     const char* text, size_t n, const char* error) {\n"
+    "  if (begin != end) {\n"
+    "    fprintf(lx->fout, \"%d-%d\\t%s\", begin, end, cls);\n"
+    "  } else {\n"
+    "    fprintf(lx->fout, \"%d\\t%s\", end, cls);\n"
+    "  }\n"
+    "  if (text) {\n"
+    "    fprintf(lx->fout, \"\\t%.*s\", (int) n, text); // up to a NUL, as write_text()\n"
+    "  }\n"
+    "  if (error) {\n"
+    "    fprintf(lx->fout, \"\\tERROR: %s\", error);\n"
+    "  }\n"
+    "  fputc('\\n', lx->fout);\n"
+    "}\n"
+    "\n", out);
+
+  bool has_directive = false;
+  bool has_include = false;
+  for (int i = 0; i < spec->classes_count; i++) {
+    const TokenClass* cls = &spec->classes[i];
+    if (cls->kind == K_DIRECTIVE) {
+      has_directive = true;
+      for (int j = 1; j < cls->args_count; j++) {
+        has_include |= !strcmp(cls->args[j], "include");
+      }
+    }
+  }
+
+  if (has_directive) {
+    fputs(
+      "// End of the logical line starting at i, before the newline or // comment\n"
+      "// which ends it and the blanks and /* */ comments before that\n"
+      "// (backslash-newlines and /* */ comments within the line don't end it)\n"
+      "static size_t\n"
+      "directive_end(const Lexer* lx, size_t i) {\n"
+      "  int quote = 0;\n"
+      "  size_t end = i;\n"
+      "  while (i < lx->len) {\n"
+      "    int c = at(lx, i);\n"
+      "    if (c == '\\\\' && is_newline(at(lx, i + 1))) {\n"
+      "      i += (at(lx, i + 1) == '\\r' && at(lx, i + 2) == '\\n') ? 3 : 2;\n"
+      "      end = i;\n"
+      "      continue;\n"
+      "    } else if (is_newline(c)) {\n"
+      "      break;\n"
+      "    }\n"
+      "\n"
+      "    if (quote) {\n"
+      "      if (c == '\\\\' && i + 1 < lx->len) {\n"
+      "        i++;\n"
+      "      } else if (c == quote) {\n"
+      "        quote = 0;\n"
+      "      }\n"
+      "    } else if (c == '\"' || c == '\\'') {\n"
+      "      quote = c;\n"
+      "    } else if (c == '/' && at(lx, i + 1) == '/') {\n"
+      "      break;\n"
+      "    } else if (c == '/' && at(lx, i + 1) == '*') {\n"
+      "      const char* closer = find(lx->buf + i + 2, lx->len - i - 2, \"*/\", 2);\n"
+      "      i = (closer) ? (size_t) (closer - lx->buf) + 2 : lx->len;\n"
+      "      continue;\n"
+      "    }\n"
+      "    if (c != ' ' && c != '\\t') {\n"
+      "      end = i + 1;\n"
+      "    }\n"
+      "    i++;\n"
+      "  }\n"
+      "  return end;\n"
+      "}\n"
+      "\n"
+      "// Directive taking the rest of the line. name and i delimit its name.\n"
+      "// error is reported unless the directive is empty (\"#\" alone), and\n"
+      "// empty_error if nothing follows the name.\n"
+      "static bool\n"
+      "lex_directive_line(Lexer* lx, size_t name, size_t i, const char* cls,\n"
+      "                   const char* error, const char* empty_error) {\n"
+      "  size_t args = i;\n"
+      "  while (at(lx, args) == ' ' || at(lx, args) == '\\t') {\n"
+      "    args++;\n"
+      "  }\n"
+      "  // A trailing // or /* */ comment is lexed as a token of its own\n"
+      "  size_t end = directive_end(lx, args);\n"
+      "  if (args == end) {\n"
+      "    error = (name == i) ? NULL : (empty_error) ? empty_error : error;\n"
+      "  }\n"
+      "  size_t text_end = (end > args) ? end : (i > name) ? i : lx->pos + 1;\n"
+      "\n"
+      "  // Drop the backslash-newlines of joined lines\n"
+      "  int begin_line_number = lx->line_number;\n"
+      "  size_t n = 0;\n"
+      "  for (size_t j = lx->pos; j < text_end; j++) {\n"
+      "    if (lx->buf[j] == '\\\\' && j + 1 < text_end && is_newline(lx->buf[j + 1])) {\n"
+      "      j += (lx->buf[j + 1] == '\\r' && j + 2 < text_end && lx->buf[j + 2] == '\\n') ? 2 : 1;\n"
+      "      continue;\n"
+      "    }\n"
+      "    lx->scratch[n++] = lx->buf[j];\n"
+      "  }\n"
+      "  lx->line_number += count_newlines(lx->buf + lx->pos, end - lx->pos);\n"
+      "  emit(lx, begin_line_number, lx->line_number, cls, lx->scratch, n, error);\n"
+      "  lx->pos = end;\n"
+      "  return true;\n"
+      "}\n"
+      "\n", out);
+  }
+
+  if (has_include) {
+    fputs(
+      "// include <...> or include \"...\", name and i delimit \"include\"\n"
+      "static bool\n"
+      "lex_header_name(Lexer* lx, size_t name, size_t i, const char* cls) {\n"
+      "  size_t header = i;\n"
+      "  while (at(lx, header) == ' ' || at(lx, header) == '\\t') {\n"
+      "    header++;\n"
+      "  }\n"
+      "\n"
+      "  int closing_symbol = at(lx, header);\n"
+      "  if (closing_symbol == '<') {\n"
+      "    closing_symbol = '>';\n"
+      "  } else if (closing_symbol != '\"') {\n"
+      "    // Computed include, e.g. #include HEADER\n"
+      "    return lex_directive_line(lx, name, i, cls, NULL, \"expected < or \\\"\");\n"
+      "  }\n"
+      "\n"
+      "  i = header;\n"
+      "  do {\n"
+      "    i++;\n"
+      "  } while (i < lx->len && at(lx, i) != closing_symbol && !is_newline(at(lx, i)));\n"
+      "\n"
+      "  if (at(lx, i) == closing_symbol) {\n"
+      "    emit(lx, lx->line_number, lx->line_number, cls, lx->buf + lx->pos, i + 1 - lx->pos, NULL);\n"
+      "    lx->pos = i + 1;\n"
+      "  } else {\n"
+      "    // Like the hand-written scanner, the newline is consumed\n"
+      "    // before an unterminated header name is reported.\n"
+      "    size_t n = i - lx->pos;\n"
+      "    const char* text = lx->buf + lx->pos;\n"
+      "    advance(lx, &i);\n"
+      "    emit(lx, lx->line_number, lx->line_number, cls, text, n,\n"
+      "         (closing_symbol == '>') ? \"missing >\" : \"missing \\\"\");\n"
+      "    lx->pos = i;\n"
+      "  }\n"
+      "  return true;\n"
+      "}\n"
+      "\n", out);
+  }
+}
+
+static void
+gen_line_comment(FILE* out, const TokenClass* cls) {
+  const char* opener = cls->args[0];
+  fprintf(out, "static bool\nlex_%s(Lexer* lx) {\n", cls->name);
+  fprintf(out, "  if (!starts_with(lx, ");
+  put_string_literal(out, opener);
+  fprintf(out, ", %zu)) {\n    return false;\n  }\n", strlen(opener));
+  fprintf(out,
+    "  size_t end = lx->pos + %zu;\n"
+    "  while (end < lx->len && !is_newline(lx->buf[end])) {\n"
+    "    end++;\n"
+    "  }\n"
+    "  // Like scan_sc(), one line up if the input ends without a newline\n"
+    "  int line_number = (end < lx->len) ? lx->line_number : lx->line_number - 1;\n"
+    "  emit(lx, line_number, line_number, \"%s\", lx->buf + lx->pos, end - lx->pos, NULL);\n"
+    "  lx->pos = end;\n"
+    "  return true;\n"
+    "}\n\n", strlen(opener), cls->name);
+}
+
+static void
+gen_block_comment(FILE* out, const TokenClass* cls) {
+  const char* opener = cls->args[0];
+  const char* closer = cls->args[1];
+  fprintf(out, "static bool\nlex_%s(Lexer* lx) {\n", cls->name);
+  fprintf(out, "  if (!starts_with(lx, ");
+  put_string_literal(out, opener);
+  fprintf(out, ", %zu)) {\n    return false;\n  }\n", strlen(opener));
+  fprintf(out,
+    "  int begin_line_number = lx->line_number;\n"
+    "  size_t i = lx->pos + %zu;\n"
+    "  bool closed = false;\n"
+    "  while (i < lx->len && !closed) {\n"
+    "    if (lx->buf[i] == ", strlen(opener));
+  put_char_literal(out, (unsigned char) closer[0]);
+  fprintf(out,
+    ") {\n"
+    "      // Like scan_mc(), the char after it is never the first of the\n"
+    "      // closer (e.g. **/ doesn't close /*)\n"
+    "      closed = lx->len - i >= %zu && !memcmp(lx->buf + i, ", strlen(closer));
+  put_string_literal(out, closer);
+  fprintf(out,
+    ", %zu);\n"
+    "      i += (closed) ? %zu : 2;\n"
+    "    } else {\n"
+    "      i++;\n"
+    "    }\n"
+    "  }\n"
+    "  size_t end = (i < lx->len) ? i : lx->len;\n"
+    "  lx->line_number += count_newlines(lx->buf + lx->pos, end - lx->pos);\n"
+    "  lx->pos = end;\n"
+    "\n"
+    "  if (closed) {\n"
+    "    emit(lx, begin_line_number, lx->line_number, \"%s\", NULL, 0, NULL);\n"
+    "  } else {\n"
+    "    // Like scan_mc(), the last line is taken to end with a newline\n"
+    "    emit(lx, begin_line_number, lx->line_number - 1, \"%s\", NULL, 0, \"missing ",
+    strlen(closer), strlen(closer), cls->name, cls->name);
+  for (const char* p = closer; *p; p++) {
+    fprintf(out, (*p == '"' || *p == '\\') ? "\\%c" : "%c", *p);
+  }
+  fprintf(out,
+    "\");\n"
+    "  }\n"
+    "  return true;\n"
+    "}\n\n");
+}
+
+static void
+gen_directive(FILE* out, const TokenClass* cls) {
+  const char* lead = cls->args[0];
+  fprintf(out, "static bool\nlex_%s(Lexer* lx) {\n", cls->name);
+  fprintf(out, "  if (!starts_with(lx, ");
+  put_string_literal(out, lead);
+  fprintf(out, ", %zu)) {\n    return false;\n  }\n", strlen(lead));
+  fprintf(out,
+    "  size_t i = lx->pos + %zu;\n"
+    "  while (at(lx, i) == ' ' || at(lx, i) == '\\t') {\n"
+    "    i++;\n"
+    "  }\n"
+    "  size_t name = i;\n"
+    "  while (is_iden_char(at(lx, i))) {\n"
+    "    i++;\n"
+    "  }\n"
+    "\n", strlen(lead));
+
+  for (int j = 1; j < cls->args_count; j++) {
+    const char* name = cls->args[j];
+    fprintf(out, "  if (i - name == %zu && !memcmp(lx->buf + name, ", strlen(name));
+    put_string_literal(out, name);
+    fprintf(out, ", %zu)) {\n", strlen(name));
+    if (!strcmp(name, "include")) {
+      fprintf(out, "    return lex_header_name(lx, name, i, \"%s\");\n", cls->name);
+    } else {
+      fprintf(out, "    return lex_directive_line(lx, name, i, \"%s\", NULL, NULL);\n", cls->name);
+    }
+    fprintf(out, "  }\n");
+  }
+  fprintf(out,
+    "  return lex_directive_line(lx, name, i, \"%s\", \"unknown directive\", NULL);\n"
+    "}\n\n", cls->name);
+}
+
+static int
+compare_by_length_desc(const void* a, const void* b) {
+  size_t la = strlen(*(char* const*) a);
+  size_t lb = strlen(*(char* const*) b);
+  return (la < lb) - (la > lb);
+}
+
+static void
+gen_symbols(FILE* out, const TokenClass* cls) {
+  // Longest match first; qsort is not stable, but symbols
+  // of the same length and first char can never both match.
+  char* symbols[MAX_ARGS];
+  memcpy(symbols, cls->args, cls->args_count * sizeof(char*));
+  qsort(symbols, cls->args_count, sizeof(char*), compare_by_length_desc);
+
+  fprintf(out,
+    "static bool\n"
+    "lex_%s(Lexer* lx) {\n"
+    "  size_t n = 0;\n"
+    "  switch (at(lx, lx->pos)) {\n", cls->name);
+
+  bool done[256] = {false};
+  for (int i = 0; i < cls->args_count; i++) {
+    unsigned char first = symbols[i][0];
+    if (done[first]) {
+      continue;
+    }
+    done[first] = true;
+
+    fprintf(out, "    case ");
+    put_char_literal(out, first);
+    fprintf(out, ":\n");
+
+    // Multi-char candidates become an if-else chain,
+    // a single-char candidate is the final else.
+    bool chained = false;
+    for (int j = i; j < cls->args_count; j++) {
+      if ((unsigned char) symbols[j][0] != first) {
+        continue;
+      }
+      size_t len = strlen(symbols[j]);
+      if (len == 1) {
+        fprintf(out, (chained) ? "      } else {\n        n = 1;\n" : "      n = 1;\n");
+        break;
+      }
+      fprintf(out, (chained) ? "      } else if (starts_with(lx, " : "      if (starts_with(lx, ");
+      put_string_literal(out, symbols[j]);
+      fprintf(out, ", %zu)) {\n        n = %zu;\n", len, len);
+      chained = true;
+    }
+    if (chained) {
+      fprintf(out, "      }\n");
+    }
+    fprintf(out, "      break;\n");
+  }
+
+  fprintf(out,
+    "    default:\n"
+    "      break;\n"
+    "  }\n"
+    "\n"
+    "  if (n == 0) {\n"
+    "    return false;\n"
+    "  }\n"
+    "  emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, n, NULL);\n"
+    "  lx->pos += n;\n"
+    "  return true;\n"
+    "}\n\n", cls->name);
+}
+
+static void
+gen_keywords(FILE* out, const TokenClass* cls) {
+  // Like scan_rewd(), the first word in spec order the input starts with
+  // wins, even in the middle of a longer identifier (e.g. "do" in "double")
+  fprintf(out,
+    "static bool\n"
+    "lex_%s(Lexer* lx) {\n"
+    "  size_t n = 0;\n"
+    "  switch (at(lx, lx->pos)) {\n", cls->name);
+
+  bool done[256] = {false};
+  for (int i = 0; i < cls->args_count; i++) {
+    unsigned char first = cls->args[i][0];
+    if (done[first]) {
+      continue;
+    }
+    done[first] = true;
+
+    fprintf(out, "    case ");
+    put_char_literal(out, first);
+    fprintf(out, ":\n");
+    const char* chain = "      if";
+    for (int j = i; j < cls->args_count; j++) {
+      if ((unsigned char) cls->args[j][0] != first) {
+        continue;
+      }
+      size_t len = strlen(cls->args[j]);
+      fprintf(out, "%s (starts_with(lx, ", chain);
+      put_string_literal(out, cls->args[j]);
+      fprintf(out, ", %zu)) {\n        n = %zu;\n", len, len);
+      chain = "      } else if";
+    }
+    fprintf(out, "      }\n      break;\n");
+  }
+
+  fprintf(out,
+    "    default:\n"
+    "      break;\n"
+    "  }\n"
+    "\n"
+    "  if (n == 0) {\n"
+    "    return false;\n"
+    "  }\n"
+    "  emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, n, NULL);\n"
+    "  lx->pos += n;\n"
+    "  return true;\n"
+    "}\n\n", cls->name);
+}
+
+static void
+gen_char_literal(FILE* out, const TokenClass* cls) {
+  fprintf(out, "static bool\nlex_%s(Lexer* lx) {\n  const int quote = ", cls->name);
+  put_char_literal(out, (unsigned char) cls->args[0][0]);
+  fprintf(out,
+    ";\n"
+    "  if (at(lx, lx->pos) != quote) {\n"
+    "    return false;\n"
+    "  }\n"
+    "\n"
+    "  size_t i = lx->pos + 1;\n"
+    "  size_t n = 0;\n"
+    "  int c = advance(lx, &i);\n"
+    "  while (c != quote && c != -1 && !is_newline(c)) {\n"
+    "    if (c == '\\\\') {\n"
+    "      if ((c = advance(lx, &i)) == -1) {\n"
+    "        break;\n"
+    "      }\n"
+    "      c = (unsigned char) get_escaped_char(c);\n"
+    "    }\n"
+    "    if (n < LITERAL_MAX_LEN - 1) {\n"
+    "      lx->scratch[n++] = c;\n"
+    "    }\n"
+    "    c = advance(lx, &i);\n"
+    "  }\n"
+    "  lx->pos = i;\n"
+    "  n = text_length(lx->scratch, n);\n"
+    "\n"
+    "  if (n == 0) {\n"
+    "    emit(lx, lx->line_number, lx->line_number, \"%s\", NULL, 0,\n"
+    "         \"expected at least one char literal\");\n"
+    "  } else if (c == quote) {\n"
+    "    emit(lx, lx->line_number, lx->line_number, \"%s\", lx->scratch, n, NULL);\n"
+    "  } else {\n"
+    "    emit(lx, lx->line_number, lx->line_number, \"%s\", lx->scratch, n, \"missing ",
+    cls->name, cls->name, cls->name);
+  fprintf(out, (cls->args[0][0] == '"' || cls->args[0][0] == '\\') ? "\\%c" : "%c", cls->args[0][0]);
+  fprintf(out,
+    "\");\n"
+    "  }\n"
+    "  return true;\n"
+    "}\n\n");
+}
+
+static void
+gen_string_literal(FILE* out, const TokenClass* cls) {
+  fprintf(out, "static bool\nlex_%s(Lexer* lx) {\n  const int quote = ", cls->name);
+  put_char_literal(out, (unsigned char) cls->args[0][0]);
+  fprintf(out,
+    ";\n"
+    "  if (at(lx, lx->pos) != quote) {\n"
+    "    return false;\n"
+    "  }\n"
+    "\n"
+    "  int begin_line_number = lx->line_number;\n"
+    "  size_t i = lx->pos + 1;\n"
+    "  size_t n = 0;\n"
+    "  int c = advance(lx, &i);\n"
+    "  while (c != quote && c != -1 && !is_newline(c)) {\n"
+    "    if (c == '\\\\') {\n"
+    "      c = advance(lx, &i);\n"
+    "      if (c == '\\n') { // multi-line string\n"
+    "        c = advance(lx, &i);\n"
+    "      } else if (c != -1) {\n"
+    "        c = (unsigned char) get_escaped_char(c);\n"
+    "      }\n"
+    "      if (c == -1) {\n"
+    "        break;\n"
+    "      }\n"
+    "    }\n"
+    "    if (n < LITERAL_MAX_LEN - 1) {\n"
+    "      lx->scratch[n++] = c;\n"
+    "    }\n"
+    "    c = advance(lx, &i);\n"
+    "  }\n"
+    "  lx->pos = i;\n"
+    "  n = text_length(lx->scratch, n);\n"
+    "\n"
+    "  if (c == quote) {\n"
+    "    emit(lx, begin_line_number, lx->line_number, \"%s\", lx->scratch, n, NULL);\n"
+    "  } else {\n"
+    "    // The terminating newline has been consumed already\n"
+    "    int begin = (lx->line_number - 1 != begin_line_number) ? begin_line_number : lx->line_number;\n"
+    "    emit(lx, begin, lx->line_number, \"%s\", lx->scratch, n, \"missing ",
+    cls->name, cls->name);
+  fprintf(out, (cls->args[0][0] == '"' || cls->args[0][0] == '\\') ? "\\%c" : "%c", cls->args[0][0]);
+  fprintf(out,
+    "\");\n"
+    "  }\n"
+    "  return true;\n"
+    "}\n\n");
+}
+
+static void
+gen_float(FILE* out, const TokenClass* cls) {
+  fprintf(out,
+    "static bool\n"
+    "lex_%s(Lexer* lx) {\n"
+    "  size_t i = lx->pos;\n"
+    "  if (at(lx, i) == '+' || at(lx, i) == '-') {\n"
+    "    i++;\n"
+    "  }\n"
+    "\n"
+    "  // Hexadecimal float, e.g., 0x1.8p3 (the binary exponent is mandatory)\n"
+    "  size_t hex_length = hex_float_length(lx, i);\n"
+    "  if (hex_length) {\n"
+    "    i += hex_length;\n"
+    "    i += float_suffix_length(lx, i);\n"
+    "    emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, i - lx->pos, NULL);\n"
+    "    lx->pos = i;\n"
+    "    return true;\n"
+    "  }\n"
+    "\n"
+    "  if (is_digit(at(lx, i))) { // D+.D*\n"
+    "    while (is_digit(at(lx, i))) {\n"
+    "      i++;\n"
+    "    }\n"
+    "    if (at(lx, i) != '.') {\n"
+    "      return false;\n"
+    "    }\n"
+    "    i++;\n"
+    "  } else if (at(lx, i) == '.' && is_digit(at(lx, i + 1))) { // D*.D+\n"
+    "    i++;\n"
+    "  } else {\n"
+    "    return false;\n"
+    "  }\n"
+    "  while (is_digit(at(lx, i))) {\n"
+    "    i++;\n"
+    "  }\n"
+    "\n"
+    "  // Optional exponent, only taken if at least one digit follows\n"
+    "  if (at(lx, i) == 'e' || at(lx, i) == 'E') {\n"
+    "    size_t j = i + 1;\n"
+    "    if (at(lx, j) == '+' || at(lx, j) == '-') {\n"
+    "      j++;\n"
+    "    }\n"
+    "    if (is_digit(at(lx, j))) {\n"
+    "      while (is_digit(at(lx, j))) {\n"
+    "        j++;\n"
+    "      }\n"
+    "      i = j;\n"
+    "    }\n"
+    "  }\n"
+    "  i += float_suffix_length(lx, i);\n"
+    "\n"
+    "  emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, i - lx->pos, NULL);\n"
+    "  lx->pos = i;\n"
+    "  return true;\n"
+    "}\n\n", cls->name, cls->name, cls->name);
+}
+
+static void
+gen_identifier(FILE* out, const TokenClass* cls) {
+  fprintf(out,
+    "static bool\n"
+    "lex_%s(Lexer* lx) {\n"
+    "  int c = at(lx, lx->pos);\n"
+    "  if (is_digit(c) || !is_iden_char(c)) {\n"
+    "    return false;\n"
+    "  }\n"
+    "  size_t i = lx->pos + 1;\n"
+    "  while (is_iden_char(at(lx, i))) {\n"
+    "    i++;\n"
+    "  }\n"
+    "  emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, i - lx->pos, NULL);\n"
+    "  lx->pos = i;\n"
+    "  return true;\n"
+    "}\n\n", cls->name, cls->name);
+}
+
+static void
+gen_integer(FILE* out, const TokenClass* cls) {
+  fprintf(out,
+    "static bool\n"
+    "lex_%s(Lexer* lx) {\n"
+    "  size_t i = lx->pos;\n"
+    "  if (!is_digit(at(lx, i))) {\n"
+    "    return false;\n"
+    "  }\n"
+    "\n"
+    "  if (at(lx, i) != '0') { // decimal\n"
+    "    while (is_digit(at(lx, i))) {\n"
+    "      i++;\n"
+    "    }\n"
+    "  } else if ((at(lx, i + 1) == 'x' || at(lx, i + 1) == 'X') && is_hex_digit(at(lx, i + 2))) {\n"
+    "    i += 2;\n"
+    "    while (is_hex_digit(at(lx, i))) {\n"
+    "      i++;\n"
+    "    }\n"
+    "  } else { // octal or decimal 0\n"
+    "    i++;\n"
+    "    while (at(lx, i) >= '0' && at(lx, i) <= '7') {\n"
+    "      i++;\n"
+    "    }\n"
+    "  }\n"
+    "  i += integer_suffix_length(lx, i);\n"
+    "\n"
+    "  emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, i - lx->pos, NULL);\n"
+    "  lx->pos = i;\n"
+    "  return true;\n"
+    "}\n\n", cls->name, cls->name);
+}
+
+static void
+gen_unknown(FILE* out, const TokenClass* cls) {
+  (void) cls;
+  fprintf(out, "// Emitted by lex_all() for the bytes no other class accepts\n\n");
+}
+
+static void
+gen_class(FILE* out, const TokenClass* cls) {
+  static void (*gen[K_LAST])(FILE* out, const TokenClass* cls) = {
+    [K_LINE_COMMENT]   = gen_line_comment,
+    [K_BLOCK_COMMENT]  = gen_block_comment,
+    [K_DIRECTIVE]      = gen_directive,
+    [K_SYMBOLS]        = gen_symbols,
+    [K_KEYWORDS]       = gen_keywords,
+    [K_CHAR_LITERAL]   = gen_char_literal,
+    [K_STRING_LITERAL] = gen_string_literal,
+    [K_FLOAT]          = gen_float,
+    [K_IDENTIFIER]     = gen_identifier,
+    [K_INTEGER]        = gen_integer,
+    [K_UNKNOWN]        = gen_unknown
+  };
+
+  fprintf(out, "// %s (%s)\n", cls->name, kinds[cls->kind].name);
+  gen[cls->kind](out, cls);
+}
+
+static void
+gen_dispatch(FILE* out, const Spec* spec) {
+  // Candidate classes of every byte as a bitmask, in spec order
+  uint64_t candidates[256] = {0};
+  for (int i = 0; i < spec->classes_count; i++) {
+    bool set[256];
+    start_set(&spec->classes[i], set);
+    for (int c = 0; c < 256; c++) {
+      candidates[c] |= (set[c]) ? (uint64_t) 1 << i : 0;
+    }
+  }
+
+  // State 0 skips whitespace, state 1 has no candidates at all.
+  // Any other distinct candidate set gets a state of its own.
+  uint64_t states[256 + 2] = {0};
+  int states_count = 2;
+  int state_of[256];
+  for (int c = 0; c < 256; c++) {
+    if (is_whitespace(c) && !candidates[c]) {
+      state_of[c] = 0;
+      continue;
+    }
+    if (!candidates[c]) {
+      state_of[c] = 1;
+      continue;
+    }
+    int s = 2;
+    while (s < states_count && states[s] != candidates[c]) {
+      s++;
+    }
+    if (s == states_count) {
+      states[states_count++] = candidates[c];
+    }
+    state_of[c] = s;
+  }
+
+  fprintf(out,
+    "static void\n"
+    "lex_all(Lexer* lx) {\n"
+    "  // Byte -> dispatch state. Each state tries, in priority order,\n"
+    "  // only the token classes that can start with that byte.\n"
+    "  static const unsigned char state_of[256] = {");
+  for (int c = 0; c < 256; c++) {
+    fprintf(out, "%s%d%s", (c % 16 == 0) ? "\n    " : "", state_of[c], (c < 255) ? ", " : "");
+  }
+  fprintf(out, "\n  };\n#ifdef LEXGEN_COMPUTED_GOTO\n  static void* const states[] = {");
+  for (int s = 0; s < states_count; s++) {
+    fprintf(out, "%s&&state_%d%s", (s % 8 == 0) ? "\n    " : "", s, (s < states_count - 1) ? ", " : "");
+  }
+  fprintf(out,
+    "\n  };\n#endif\n"
+    "\n"
+    "  while (lx->pos < lx->len) {\n"
+    "    unsigned char c = lx->buf[lx->pos];\n"
+    "#ifdef LEXGEN_COMPUTED_GOTO\n"
+    "    goto *states[state_of[c]];\n"
+    "#else\n"
+    "    switch (state_of[c]) {\n"
+    "#endif\n"
+    "    STATE(0)\n"
+    "      lx->line_number += (is_newline(c)) ? 1 : 0;\n"
+    "      lx->pos++;\n"
+    "      continue;\n");
+
+  for (int s = 2; s < states_count; s++) {
+    fprintf(out, "    STATE(%d)", s);
+    // List the bytes of this state as a reading aid
+    int shown = 0;
+    for (int c = 33; c < 127 && shown < 12; c++) {
+      if (state_of[c] == s) {
+        fprintf(out, "%s%c", (shown++) ? " " : " // ", c);
+      }
+    }
+    fprintf(out, "\n");
+    for (int i = 0; i < spec->classes_count; i++) {
+      if (states[s] & ((uint64_t) 1 << i)) {
+        fprintf(out, "      if (lex_%s(lx)) {\n        continue;\n      }\n", spec->classes[i].name);
+      }
+    }
+    fprintf(out, "      goto unmatched;\n");
+  }
+
+  const TokenClass* unknown = NULL;
+  for (int i = 0; i < spec->classes_count; i++) {
+    unknown = (spec->classes[i].kind == K_UNKNOWN) ? &spec->classes[i] : unknown;
+  }
+
+  fprintf(out,
+    "    STATE(1)\n"
+    "    unmatched:\n");
+  if (unknown) {
+    fprintf(out,
+      "      // No token class accepts this byte: it starts a %s token, which\n"
+      "      // takes the bytes after it that no class can start with either\n"
+      "      {\n"
+      "        size_t i = lx->pos + 1;\n"
+      "        while (i < lx->len && state_of[(unsigned char) lx->buf[i]] == 1) {\n"
+      "          i++;\n"
+      "        }\n"
+      "        emit(lx, lx->line_number, lx->line_number, \"%s\", lx->buf + lx->pos, i - lx->pos,\n"
+      "             \"unexpected character\");\n"
+      "        lx->line_number += (is_newline(c)) ? 1 : 0;\n"
+      "        lx->pos = i;\n"
+      "      }\n"
+      "      continue;\n", unknown->name, unknown->name);
+  } else {
+    fprintf(out,
+      "      // No token class accepts this byte, skip it\n"
+      "      lx->line_number += (is_newline(c)) ? 1 : 0;\n"
+      "      lx->pos++;\n");
+  }
+  fprintf(out,
+    "#ifndef LEXGEN_COMPUTED_GOTO\n"
+    "    }\n"
+    "#endif\n"
+    "  }\n"
+    "}\n\n");
+}
+
+static void
+gen_main(FILE* out) {
+  fputs(
+    "int\n"
+    "main(int argc, char* args[]) {\n"
+    "  if (argc <= 1 || argc >= 4) {\n"
+    "    printf(\"usage: %s <input file> <output file>\\n\", args[0]);\n"
+    "    return EXIT_SUCCESS;\n"
+    "  }\n"
+    "\n"
+    "  FILE* fin = fopen(args[1], \"r\");\n"
+    "  if (!fin) {\n"
+    "    perror(\"Fatal error\");\n"
+    "    return EXIT_FAILURE;\n"
+    "  }\n"
+    "\n"
+    "  // Load the whole input into memory\n"
+    "  size_t capacity = 4096;\n"
+    "  size_t len = 0;\n"
+    "  size_t n = 0;\n"
+    "  char* buf = (char*) malloc(capacity);\n"
+    "  while (buf && (n = fread(buf + len, 1, capacity - len, fin)) > 0) {\n"
+    "    len += n;\n"
+    "    if (len == capacity) {\n"
+    "      capacity *= 2;\n"
+    "      char* tmp = (char*) realloc(buf, capacity);\n"
+    "      if (!tmp) {\n"
+    "        free(buf);\n"
+    "      }\n"
+    "      buf = tmp;\n"
+    "    }\n"
+    "  }\n"
+    "  fclose(fin);\n"
+    "\n"
+    "  const char* output_filename = (argc == 3) ? args[2] : DEFAULT_OUTPUT_FILENAME;\n"
+    "  FILE* fout = fopen(output_filename, \"w\");\n"
+    "  char* scratch = (char*) malloc(len + 1);\n"
+    "  if (!buf || !fout || !scratch) {\n"
+    "    perror(\"Fatal error\");\n"
+    "    return EXIT_FAILURE;\n"
+    "  }\n"
+    "\n"
+    "  Lexer lx = {\n"
+    "    .buf = buf,\n"
+    "    .len = len,\n"
+    "    .pos = 0,\n"
+    "    .line_number = 1,\n"
+    "    .scratch = scratch,\n"
+    "    .fout = fout\n"
+    "  };\n"
+    "  lex_all(&lx);\n"
+    "\n"
+    "  fclose(fout);\n"
+    "  free(scratch);\n"
+    "  free(buf);\n"
+    "\n"
+    "  printf(\"Output has been written to: %s\\n\", output_filename);\n"
+    "  return EXIT_SUCCESS;\n"
+    "}\n", out);
+}
+
+
+// Utility functions
+static void
+put_char_literal(FILE* out, int c) {
+  if (c == '\'' || c == '\\') {
+    fprintf(out, "'\\%c'", c);
+  } else if (c >= 0x20 && c < 0x7f) {
+    fprintf(out, "'%c'", c);
+  } else {
+    fprintf(out, "0x%02x", c);
+  }
+}
+
+static void
+put_string_literal(FILE* out, const char* s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if (*s >= 0x20 && *s < 0x7f) {
+      fputc(*s, out);
+    } else {
+      fprintf(out, "\\x%02x", (unsigned char) *s);
+    }
+  }
+  fputc('"', out);
+}
+
+static bool
+is_whitespace(int c) {
+  return c == ' ' || c == '\t' || c == 0xd || c == 0xa;
+}
+
+static bool
+is_iden_start(int c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+
+int
+main(int argc, char* args[]) {
+  if (argc != 3) {
+    printf("usage: %s <spec file> <output C file>\n", args[0]);
+    return EXIT_SUCCESS;
+  }
+
+  FILE* fin = fopen(args[1], "r");
+  if (!fin) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+
+  Spec* spec = (Spec*) calloc(1, sizeof(Spec));
+  bool ok = parse_spec(fin, args[1], spec) && check_spec(spec, args[1]);
+  fclose(fin);
+  if (!ok) {
+    free_spec(spec);
+    free(spec);
+    return EXIT_FAILURE;
+  }
+
+  FILE* out = fopen(args[2], "w");
+  if (!out) {
+    perror("Fatal error");
+    return EXIT_FAILURE;
+  }
+
+  gen_prelude(out, spec, args[1]);
+  for (int i = 0; i < spec->classes_count; i++) {
+    gen_class(out, &spec->classes[i]);
+  }
+  gen_dispatch(out, spec);
+  gen_main(out);
+
+  fclose(out);
+  free_spec(spec);
+  free(spec);
+
+  printf("Lexer has been written to: %s\n", args[2]);
+  return EXIT_SUCCESS;
+}